@@ -0,0 +1,135 @@
+/*************************************************************************
+	> File Name: alphabet.c
+	> Description: Byte equivalence classes (alphabet compression) of the
+	> DFA built by str2dfa
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alphabet.h"
+#include "msdfa.h"
+
+/* Key used to split the classes while walking the states */
+struct alphabet_key {
+	int byte;
+	int class;
+	long state;
+	long flag;
+};
+
+static int
+alphabet_key_cmp(const void *a_, const void *b_) {
+	const struct alphabet_key *a = a_, *b = b_;
+
+	if (a->class != b->class)
+		return a->class < b->class ? -1 : 1;
+	if (a->state != b->state)
+		return a->state < b->state ? -1 : 1;
+	if (a->flag != b->flag)
+		return a->flag < b->flag ? -1 : 1;
+	return a->byte - b->byte;
+}
+
+/* Compute the byte equivalence classes of the DFA: two bytes are in the same
+ * class if every state has the same transition on both of them. The classes
+ * start with a single one and are refined by the row of each state.
+ *
+ * byte_class must hold ALPHABET_SIZE entries. Return the number of classes,
+ * or -1 on error.
+ */
+int
+alphabet_fromkv(struct str2dfa_kv *entries, int n_entry,
+				unsigned char *byte_class) {
+	struct dfa_table table;
+	struct alphabet_key keys[ALPHABET_SIZE];
+	int class[ALPHABET_SIZE], remap[ALPHABET_SIZE];
+	int i_byte, n_class = 1;
+	long state, idx;
+
+	if (dfa_table_fromkv(entries, n_entry, ALPHABET_SIZE, &table) < 0) {
+		fprintf(stderr, "ERR: can't allocate the DFA table\n");
+		return -1;
+	}
+
+	memset(class, 0, sizeof(class));
+	for (state = 0; state < table.n_state; state++) {
+		for (i_byte = 0; i_byte < ALPHABET_SIZE; i_byte++) {
+			idx = state * ALPHABET_SIZE + i_byte;
+			keys[i_byte].byte = i_byte;
+			keys[i_byte].class = class[i_byte];
+			keys[i_byte].state = table.state[idx];
+			keys[i_byte].flag = table.flag[idx];
+		}
+		qsort(keys, ALPHABET_SIZE, sizeof(keys[0]), alphabet_key_cmp);
+		n_class = 0;
+		for (i_byte = 0; i_byte < ALPHABET_SIZE; i_byte++) {
+			if (i_byte > 0 &&
+				(keys[i_byte].class != keys[i_byte - 1].class ||
+				 keys[i_byte].state != keys[i_byte - 1].state ||
+				 keys[i_byte].flag != keys[i_byte - 1].flag))
+				n_class++;
+			class[keys[i_byte].byte] = n_class;
+		}
+		n_class++;
+	}
+	dfa_table_free(&table);
+
+	/* Number the classes by their first byte */
+	memset(remap, -1, sizeof(remap));
+	n_class = 0;
+	for (i_byte = 0; i_byte < ALPHABET_SIZE; i_byte++) {
+		if (remap[class[i_byte]] < 0)
+			remap[class[i_byte]] = n_class++;
+	}
+	for (i_byte = 0; i_byte < ALPHABET_SIZE; i_byte++) {
+		byte_class[i_byte] = remap[class[i_byte]];
+	}
+	return n_class;
+}
+
+/* Translate the units of the entries to classes. All bytes of a class have
+ * the same transitions, so only the first entry of each (state, class) is
+ * kept. Return the number of entries, or -1 on error.
+ */
+int
+alphabet_compress(struct str2dfa_kv *entries, int n_entry,
+				  const unsigned char *byte_class, int n_class,
+				  struct str2dfa_kv **result) {
+	struct dfa_table table;
+	struct str2dfa_kv *class_entries;
+	unsigned char class_byte[ALPHABET_SIZE];
+	int i_byte, i_class, n_class_entry = 0;
+	long state, idx;
+
+	if (dfa_table_fromkv(entries, n_entry, ALPHABET_SIZE, &table) < 0) {
+		fprintf(stderr, "ERR: can't allocate the DFA table\n");
+		return -1;
+	}
+
+	/* A representative byte of each class */
+	for (i_byte = ALPHABET_SIZE - 1; i_byte >= 0; i_byte--) {
+		class_byte[byte_class[i_byte]] = i_byte;
+	}
+
+	class_entries = malloc(sizeof(struct str2dfa_kv) * (n_entry + 1));
+	if (!class_entries) {
+		dfa_table_free(&table);
+		return -1;
+	}
+	for (state = 0; state < table.n_state; state++) {
+		for (i_class = 0; i_class < n_class; i_class++) {
+			idx = state * ALPHABET_SIZE + class_byte[i_class];
+			if (table.state[idx] == 0 && table.flag[idx] == 0)
+				continue;
+			class_entries[n_class_entry].key_state = state;
+			class_entries[n_class_entry].key_unit = i_class;
+			class_entries[n_class_entry].value_state = table.state[idx];
+			class_entries[n_class_entry].value_flag = table.flag[idx];
+			n_class_entry++;
+		}
+	}
+	dfa_table_free(&table);
+	*result = class_entries;
+	return n_class_entry;
+}
@@ -0,0 +1,18 @@
+/*************************************************************************
+	> File Name: alphabet.h
+	> Description: Byte equivalence classes (alphabet compression) of the
+	> DFA built by str2dfa
+ ************************************************************************/
+
+#ifndef _ALPHABET_H
+#define _ALPHABET_H
+
+#include "str2dfa.h"
+
+#define ALPHABET_SIZE 256
+
+int alphabet_fromkv(struct str2dfa_kv *, int, unsigned char *byte_class);
+int alphabet_compress(struct str2dfa_kv *, int, const unsigned char *,
+					  int, struct str2dfa_kv **result);
+
+#endif
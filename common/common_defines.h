@@ -27,6 +27,32 @@ struct config {
 	int tail_call_map_idx[32];
 	char tail_call_map_progsec[32][32];
 	bool xsk_poll_mode;
+	int map_size_count;
+	char map_size_name[8][32];
+	__u32 map_size_entries[8];
+	int inner_map_count;
+	char inner_map_outer[8][32];
+	char inner_map_name[8][32];
+	int inspect_stride;
+	int bench_repeat;
+	bool print_table_size;
+	bool compile_ruleset;
+	bool match_all;
+	char ruleset_file[512];
+	char pattern_file[512];
+	char action_file[512];
+	int top_n;
+	char alert_file[512];
+	int alert_wakeup;
+	char port_group_file[512];
+	bool prefilter;
+	bool qgram;
+	int short_len;
+	bool verdict_cache;
+	int stream_depth;
+	int block_ttl;
+	bool list_blocked;
+	char trust_file[512];
 };
 
 /* Defined in common_params.o */
@@ -2,6 +2,9 @@
 
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -18,6 +21,11 @@ static inline bool IS_ERR_OR_NULL(const void *ptr)
 
 #define pr_warning printf
 
+/* Kernel internal errno, returned by BPF commands a map does not support */
+#ifndef ENOTSUPP
+#define ENOTSUPP	524
+#endif
+
 /* As close as possible to libbpf bpf_prog_load_xattr(), with the
  * difference of handling pinned maps.
  */
@@ -160,3 +168,98 @@ int bpf_prog_load_xattr_maps(const struct bpf_prog_load_attr_maps *attr,
 	*prog_fd = bpf_program__fd(first_prog);
 	return 0;
 }
+
+/* The BPF_MAP_*_BATCH commands, which this libbpf does not wrap yet */
+static int bpf_map_batch(int cmd, int fd, void *in_batch, void *out_batch,
+			 const void *keys, const void *values, __u32 *count,
+			 __u64 elem_flags)
+{
+	union bpf_attr attr;
+	int err;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.batch.map_fd = fd;
+	attr.batch.in_batch = (__u64)(unsigned long)in_batch;
+	attr.batch.out_batch = (__u64)(unsigned long)out_batch;
+	attr.batch.keys = (__u64)(unsigned long)keys;
+	attr.batch.values = (__u64)(unsigned long)values;
+	attr.batch.count = *count;
+	attr.batch.elem_flags = elem_flags;
+
+	err = syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+	*count = attr.batch.count;
+	return err;
+}
+
+/* Whether the last batch command failed because the kernel (before 5.6)
+ * or the map type has no batch operations
+ */
+bool bpf_map_batch_unsupported(void)
+{
+	return errno == EINVAL || errno == ENOTSUPP || errno == EOPNOTSUPP;
+}
+
+/* BPF_MAP_UPDATE_BATCH. On return *count holds the number of elements
+ * updated.
+ */
+int bpf_map_update_batch_compat(int fd, const void *keys, const void *values,
+				__u32 *count, __u64 elem_flags)
+{
+	return bpf_map_batch(BPF_MAP_UPDATE_BATCH, fd, NULL, NULL, keys, values,
+			     count, elem_flags);
+}
+
+/* BPF_MAP_LOOKUP_BATCH, reading up to *count elements from the position
+ * in_batch, NULL for the first call, into keys and values. out_batch
+ * receives the position to pass to the next call. On return *count holds
+ * the number of elements read, the last call fails with ENOENT.
+ */
+int bpf_map_lookup_batch_compat(int fd, void *in_batch, void *out_batch,
+				void *keys, void *values, __u32 *count,
+				__u64 elem_flags)
+{
+	return bpf_map_batch(BPF_MAP_LOOKUP_BATCH, fd, in_batch, out_batch,
+			     keys, values, count, elem_flags);
+}
+
+/* BPF_MAP_DELETE_BATCH. On return *count holds the number of elements
+ * deleted, a missing key stops the batch with ENOENT.
+ */
+int bpf_map_delete_batch_compat(int fd, const void *keys, __u32 *count,
+				__u64 elem_flags)
+{
+	return bpf_map_batch(BPF_MAP_DELETE_BATCH, fd, NULL, NULL, keys, NULL,
+			     count, elem_flags);
+}
+
+/* Update count elements with one batch syscall, or one by one on kernels
+ * without batch operations (before 5.6). Once the batch is refused, the
+ * later calls go straight to the fallback. Return 0, or -errno on error.
+ */
+int bpf_map_update_elems(int fd, const void *keys, __u32 key_size,
+			 const void *values, __u32 value_size, __u32 count,
+			 __u64 elem_flags, bool *batched)
+{
+	static bool batch_unsupported;
+	__u32 i, done = count;
+
+	if (!batch_unsupported) {
+		if (!bpf_map_update_batch_compat(fd, keys, values, &done,
+						 elem_flags)) {
+			*batched = true;
+			return 0;
+		}
+		if (done > 0 || !bpf_map_batch_unsupported())
+			return -errno;
+		batch_unsupported = true;
+	}
+
+	*batched = false;
+	for (i = 0; i < count; i++) {
+		if (bpf_map_update_elem(fd, (const char *)keys + i * key_size,
+					(const char *)values + i * value_size,
+					elem_flags) < 0)
+			return -errno;
+	}
+	return 0;
+}
@@ -21,4 +21,16 @@ struct bpf_prog_load_attr_maps {
 int bpf_prog_load_xattr_maps(const struct bpf_prog_load_attr_maps *attr,
 			     struct bpf_object **pobj, int *prog_fd);
 
+bool bpf_map_batch_unsupported(void);
+int bpf_map_update_batch_compat(int fd, const void *keys, const void *values,
+				__u32 *count, __u64 elem_flags);
+int bpf_map_lookup_batch_compat(int fd, void *in_batch, void *out_batch,
+				void *keys, void *values, __u32 *count,
+				__u64 elem_flags);
+int bpf_map_delete_batch_compat(int fd, const void *keys, __u32 *count,
+				__u64 elem_flags);
+int bpf_map_update_elems(int fd, const void *keys, __u32 key_size,
+			 const void *values, __u32 value_size, __u32 count,
+			 __u64 elem_flags, bool *batched);
+
 #endif /* __COMMON_LIBBPF_H */
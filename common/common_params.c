@@ -184,6 +184,92 @@ void parse_cmdline_args(int argc, char **argv,
 			dest  = (char *)&cfg->progsec;
 			strncpy(dest, optarg, sizeof(cfg->progsec));
 			break;
+		case 4: /* --stride */
+			cfg->inspect_stride = atoi(optarg);
+			break;
+		case 5: /* --bench */
+			cfg->bench_repeat = atoi(optarg);
+			break;
+		case 6: /* --map-size */
+			if (cfg->map_size_count >= 8 ||
+			    sscanf(optarg, "%31[^:]:%u",
+			  cfg->map_size_name[cfg->map_size_count],
+			  &(cfg->map_size_entries[cfg->map_size_count])) < 2) {
+				fprintf(stderr, "ERR: --map-size <entry> with wrong format\n");
+				goto error;
+			}
+			cfg->map_size_count += 1;
+			break;
+		case 11: /* --inner-map */
+			if (cfg->inner_map_count >= 8 ||
+			    sscanf(optarg, "%31[^:]:%31s",
+			  cfg->inner_map_outer[cfg->inner_map_count],
+			  cfg->inner_map_name[cfg->inner_map_count]) < 2) {
+				fprintf(stderr, "ERR: --inner-map <entry> with wrong format\n");
+				goto error;
+			}
+			cfg->inner_map_count += 1;
+			break;
+		case 12: /* --match-all */
+			cfg->match_all = true;
+			break;
+		case 13: /* --actions */
+			dest  = (char *)&cfg->action_file;
+			strncpy(dest, optarg, sizeof(cfg->action_file) - 1);
+			break;
+		case 14: /* --top */
+			cfg->top_n = atoi(optarg);
+			break;
+		case 15: /* --alert-log */
+			dest  = (char *)&cfg->alert_file;
+			strncpy(dest, optarg, sizeof(cfg->alert_file) - 1);
+			break;
+		case 16: /* --wakeup */
+			cfg->alert_wakeup = atoi(optarg);
+			break;
+		case 17: /* --port-groups */
+			dest  = (char *)&cfg->port_group_file;
+			strncpy(dest, optarg, sizeof(cfg->port_group_file) - 1);
+			break;
+		case 18: /* --prefilter */
+			cfg->prefilter = true;
+			break;
+		case 19: /* --qgram */
+			cfg->qgram = true;
+			break;
+		case 20: /* --short-len */
+			cfg->short_len = atoi(optarg);
+			break;
+		case 21: /* --verdict-cache */
+			cfg->verdict_cache = true;
+			break;
+		case 22: /* --stream-depth */
+			cfg->stream_depth = atoi(optarg);
+			break;
+		case 23: /* --block-ttl */
+			cfg->block_ttl = atoi(optarg);
+			break;
+		case 24: /* --blocklist */
+			cfg->list_blocked = true;
+			break;
+		case 25: /* --trust */
+			dest  = (char *)&cfg->trust_file;
+			strncpy(dest, optarg, sizeof(cfg->trust_file) - 1);
+			break;
+		case 7: /* --table-size */
+			cfg->print_table_size = true;
+			break;
+		case 8: /* --compile */
+			cfg->compile_ruleset = true;
+			break;
+		case 9: /* --ruleset */
+			dest  = (char *)&cfg->ruleset_file;
+			strncpy(dest, optarg, sizeof(cfg->ruleset_file) - 1);
+			break;
+		case 10: /* --patterns */
+			dest  = (char *)&cfg->pattern_file;
+			strncpy(dest, optarg, sizeof(cfg->pattern_file) - 1);
+			break;
 		case 'L': /* --src-mac */
 			dest  = (char *)&cfg->src_mac;
 			strncpy(dest, optarg, sizeof(cfg->src_mac));
@@ -3,6 +3,7 @@
 #include <net/if.h>     /* IF_NAMESIZE */
 #include <stdlib.h>     /* exit(3) */
 #include <errno.h>
+#include <unistd.h>     /* close */
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -16,6 +17,18 @@
 #define PATH_MAX	4096
 #endif
 
+/* The programs see the fragments of multi-buffer packets, and all of them
+ * have the flag, as a program can only tail call the programs alike
+ */
+#ifdef HAVE_XDP_FRAGS
+#ifndef BPF_F_XDP_HAS_FRAGS
+#define BPF_F_XDP_HAS_FRAGS	(1U << 5)
+#endif
+#define XDP_PROG_FLAGS		BPF_F_XDP_HAS_FRAGS
+#else
+#define XDP_PROG_FLAGS		0
+#endif
+
 int xdp_link_attach(int ifindex, __u32 xdp_flags, int prog_fd)
 {
 	int err;
@@ -99,39 +112,39 @@ int xdp_link_detach(int ifindex, __u32 xdp_flags, __u32 expected_prog_id)
 	return EXIT_OK;
 }
 
-struct bpf_object *load_bpf_object_file(const char *filename, int ifindex)
+/* A program calling bpf_loop() (Linux 5.17) is not loaded on an older
+ * kernel, its bpf_program__fd() is then negative. The callers pick
+ * another program for its job.
+ */
+static int skip_bpf_loop_prep(struct bpf_program *prog, int n,
+			      struct bpf_insn *insns, int insns_cnt,
+			      struct bpf_prog_prep_result *res)
 {
-	int first_prog_fd = -1;
-	struct bpf_object *obj;
-	int err;
-
-	/* This struct allow us to set ifindex, this features is used for
-	 * hardware offloading XDP programs (note this sets libbpf
-	 * bpf_program->prog_ifindex and foreach bpf_map->map_ifindex).
-	 */
-	struct bpf_prog_load_attr prog_load_attr = {
-		.prog_type = BPF_PROG_TYPE_XDP,
-		.ifindex   = ifindex,
-	};
-	prog_load_attr.file = filename;
-
-	/* Use libbpf for extracting BPF byte-code from BPF-ELF object, and
-	 * loading this into the kernel via bpf-syscall
-	 */
-	err = bpf_prog_load_xattr(&prog_load_attr, &obj, &first_prog_fd);
-	if (err) {
-		fprintf(stderr, "ERR: loading BPF-OBJ file(%s) (%d): %s\n",
-			filename, err, strerror(-err));
-		return NULL;
+	int i;
+
+	res->new_insn_ptr = insns;
+	res->new_insn_cnt = insns_cnt;
+	res->pfd = NULL;
+
+	for (i = 0; i < insns_cnt; i++) {
+		if (insns[i].code == (BPF_JMP | BPF_CALL) &&
+		    insns[i].src_reg == 0 && insns[i].imm == BPF_FUNC_loop) {
+			if (verbose)
+				printf("INFO: no bpf_loop() in the kernel, "
+				       "not loading %s\n",
+				       bpf_program__title(prog, false));
+			res->new_insn_ptr = NULL;
+			res->new_insn_cnt = 0;
+			break;
+		}
 	}
-
-	/* Notice how a pointer to a libbpf bpf_object is returned */
-	return obj;
+	return 0;
 }
 
 static struct bpf_object *open_bpf_object(const char *file, int ifindex)
 {
 	int err;
+	bool has_bpf_loop;
 	struct bpf_object *obj;
 	struct bpf_map *map;
 	struct bpf_program *prog, *first_prog = NULL;
@@ -149,9 +162,15 @@ static struct bpf_object *open_bpf_object(const char *file, int ifindex)
 		return NULL;
 	}
 
+	has_bpf_loop = bpf_probe_helper(BPF_FUNC_loop, BPF_PROG_TYPE_XDP,
+					ifindex);
+
 	bpf_object__for_each_program(prog, obj) {
 		bpf_program__set_type(prog, BPF_PROG_TYPE_XDP);
 		bpf_program__set_ifindex(prog, ifindex);
+		bpf_program__set_extra_flags(prog, XDP_PROG_FLAGS);
+		if (!has_bpf_loop)
+			bpf_program__set_prep(prog, 1, skip_bpf_loop_prep);
 		if (!first_prog)
 			first_prog = prog;
 	}
@@ -169,6 +188,33 @@ static struct bpf_object *open_bpf_object(const char *file, int ifindex)
 	return obj;
 }
 
+struct bpf_object *load_bpf_object_file(const char *filename, int ifindex)
+{
+	struct bpf_object *obj;
+	int err;
+
+	/* The ifindex is used for hardware offloading XDP programs (note
+	 * this sets libbpf bpf_program->prog_ifindex and foreach
+	 * bpf_map->map_ifindex).
+	 */
+	obj = open_bpf_object(filename, ifindex);
+	if (!obj)
+		return NULL;
+
+	/* Use libbpf for extracting BPF byte-code from BPF-ELF object, and
+	 * loading this into the kernel via bpf-syscall
+	 */
+	err = bpf_object__load(obj);
+	if (err) {
+		fprintf(stderr, "ERR: loading BPF-OBJ file(%s) (%d): %s\n",
+			filename, err, strerror(-err));
+		return NULL;
+	}
+
+	/* Notice how a pointer to a libbpf bpf_object is returned */
+	return obj;
+}
+
 static int reuse_maps(struct bpf_object *obj, const char *path)
 {
 	struct bpf_map *map;
@@ -233,6 +279,102 @@ struct bpf_object *load_bpf_object_file_reuse_maps(const char *file,
 	return obj;
 }
 
+/* Create a map like the template, to give the kernel the type of the inner
+ * maps of a map-in-map
+ */
+static int create_inner_map(struct bpf_object *obj, const char *outer_name,
+			    const char *template_name)
+{
+	struct bpf_create_map_attr attr = { 0 };
+	const struct bpf_map_def *def;
+	struct bpf_map *outer, *template;
+	int fd, err;
+
+	outer = bpf_object__find_map_by_name(obj, outer_name);
+	template = bpf_object__find_map_by_name(obj, template_name);
+	if (!outer || !template) {
+		fprintf(stderr, "ERR: no map %s in object\n",
+			outer ? template_name : outer_name);
+		return -1;
+	}
+	def = bpf_map__def(template);
+	attr.name = template_name;
+	attr.map_type = def->type;
+	attr.key_size = def->key_size;
+	attr.value_size = def->value_size;
+	attr.max_entries = def->max_entries;
+	attr.map_flags = def->map_flags;
+	fd = bpf_create_map_xattr(&attr);
+	if (fd < 0) {
+		fprintf(stderr, "ERR: creating inner map of %s (%d): %s\n",
+			outer_name, errno, strerror(errno));
+		return -1;
+	}
+	err = bpf_map__set_inner_map_fd(outer, fd);
+	if (err) {
+		fprintf(stderr, "ERR: setting inner map of %s (%d): %s\n",
+			outer_name, err, strerror(-err));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Same as load_bpf_object_file(), but the maps given by --map-size are
+ * created with their max_entries overridden, and the maps given by
+ * --inner-map are created with the (resized) template as inner map.
+ */
+struct bpf_object *load_bpf_object_file_resize_maps(const char *file,
+						    int ifindex,
+						    struct config *cfg)
+{
+	int i, err;
+	int inner_map_fd[8];
+	struct bpf_object *obj;
+	struct bpf_map *map;
+
+	obj = open_bpf_object(file, ifindex);
+	if (!obj) {
+		fprintf(stderr, "ERR: failed to open object %s\n", file);
+		return NULL;
+	}
+
+	for (i = 0; i < cfg->map_size_count; i++) {
+		map = bpf_object__find_map_by_name(obj, cfg->map_size_name[i]);
+		if (!map) {
+			fprintf(stderr, "ERR: no map %s in object %s\n",
+				cfg->map_size_name[i], file);
+			return NULL;
+		}
+		err = bpf_map__resize(map, cfg->map_size_entries[i]);
+		if (err) {
+			fprintf(stderr, "ERR: resizing map %s to %u (%d): %s\n",
+				cfg->map_size_name[i], cfg->map_size_entries[i],
+				err, strerror(-err));
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < cfg->inner_map_count; i++) {
+		inner_map_fd[i] = create_inner_map(obj, cfg->inner_map_outer[i],
+						   cfg->inner_map_name[i]);
+		if (inner_map_fd[i] < 0)
+			return NULL;
+	}
+
+	err = bpf_object__load(obj);
+	/* The kernel only needs the inner maps while creating the outer ones */
+	for (i = 0; i < cfg->inner_map_count; i++)
+		close(inner_map_fd[i]);
+	if (err) {
+		fprintf(stderr, "ERR: loading BPF-OBJ file(%s) (%d): %s\n",
+			file, err, strerror(-err));
+		return NULL;
+	}
+
+	return obj;
+}
+
 struct bpf_object *load_bpf_and_xdp_attach(struct config *cfg)
 {
 	struct bpf_program *bpf_prog;
@@ -250,6 +392,9 @@ struct bpf_object *load_bpf_and_xdp_attach(struct config *cfg)
 		bpf_obj = load_bpf_object_file_reuse_maps(cfg->filename,
 							  offload_ifindex,
 							  cfg->pin_dir);
+	else if (cfg->map_size_count || cfg->inner_map_count)
+		bpf_obj = load_bpf_object_file_resize_maps(cfg->filename,
+							   offload_ifindex, cfg);
 	else
 		bpf_obj = load_bpf_object_file(cfg->filename, offload_ifindex);
 	if (!bpf_obj) {
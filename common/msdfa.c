@@ -0,0 +1,205 @@
+/*************************************************************************
+	> File Name: msdfa.c
+	> Description: Multi-stride DFA built from the single-stride entries
+	> of str2dfa
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "msdfa.h"
+
+/* Build the dense table, n_unit is the size of the alphabet of the entries */
+int
+dfa_table_fromkv(struct str2dfa_kv *entries, int n_entry, int n_unit,
+				 struct dfa_table *table) {
+	int i_entry;
+	long idx;
+
+	table->n_state = 1;
+	table->n_unit = n_unit;
+	for (i_entry = 0; i_entry < n_entry; i_entry++) {
+		if (entries[i_entry].key_state >= table->n_state)
+			table->n_state = entries[i_entry].key_state + 1;
+		if (entries[i_entry].value_state >= table->n_state)
+			table->n_state = entries[i_entry].value_state + 1;
+	}
+
+	table->state = calloc(table->n_state * n_unit, sizeof(long));
+	table->flag = calloc(table->n_state * n_unit, sizeof(long));
+	if (!table->state || !table->flag) {
+		free(table->state);
+		free(table->flag);
+		return -1;
+	}
+
+	for (i_entry = 0; i_entry < n_entry; i_entry++) {
+		if ((unsigned char)entries[i_entry].key_unit >= n_unit) {
+			dfa_table_free(table);
+			return -1;
+		}
+		idx = entries[i_entry].key_state * n_unit +
+			(unsigned char)entries[i_entry].key_unit;
+		table->state[idx] = entries[i_entry].value_state;
+		table->flag[idx] = entries[i_entry].value_flag;
+	}
+	return 0;
+}
+
+void
+dfa_table_free(struct dfa_table *table) {
+	free(table->state);
+	free(table->flag);
+	table->state = NULL;
+	table->flag = NULL;
+}
+
+/* Walk the whole stride from the given state. The scan may go on past an
+ * accepting state, so the walk never stops early: it reports the flag met
+ * on the last unit, and the one met on the unit before.
+ */
+static void
+dfa_table_walk(struct dfa_table *table, long state, unsigned char *unit,
+			   int stride, long *value_state, long *value_flag,
+			   long *value_first_flag) {
+	int i_unit;
+	long idx;
+
+	*value_flag = 0;
+	*value_first_flag = 0;
+	for (i_unit = 0; i_unit < stride; i_unit++) {
+		idx = state * table->n_unit + unit[i_unit];
+		state = table->state[idx];
+		if (i_unit == stride - 2)
+			*value_first_flag = table->flag[idx];
+		else if (i_unit == stride - 1)
+			*value_flag = table->flag[idx];
+	}
+	*value_state = state;
+}
+
+static int
+msdfa_push(struct msdfa_kv **entries, int *n_entry, int *capacity,
+		   long state, unsigned char *unit, int stride,
+		   long value_state, long value_flag, long value_first_flag) {
+	struct msdfa_kv *entry;
+
+	if (*n_entry == *capacity) {
+		int new_capacity = *capacity ? *capacity * 2 : 256;
+		entry = realloc(*entries, sizeof(struct msdfa_kv) * new_capacity);
+		if (!entry)
+			return -1;
+		*entries = entry;
+		*capacity = new_capacity;
+	}
+	entry = &(*entries)[(*n_entry)++];
+	memset(entry, 0, sizeof(*entry));
+	entry->key_state = state;
+	memcpy(entry->key_unit, unit, stride);
+	entry->value_state = value_state;
+	entry->value_flag = value_flag;
+	entry->value_first_flag = value_first_flag;
+	return 0;
+}
+
+/* Build the stride-2 transitions from the single-stride DFA entries, whose
+ * units are taken from an alphabet of n_unit symbols.
+ *
+ * A complete multi-stride table needs n_state * n_unit^stride entries, which is
+ * too large for a BPF map. The result is therefore split in two parts:
+ *  - every transition of the root state (key_state == 0), which is stored
+ *    in a dense array in the kernel;
+ *  - the transitions of the other states that differ from the ones of the
+ *    root state. Missing entries fall back to the root row.
+ * The transitions of a state only differ from the root ones when its first
+ * step leads elsewhere, so only few units need to be checked for each state.
+ *
+ * Return the number of entries, or -1 on error.
+ */
+int
+msdfa_fromkv(struct str2dfa_kv *entries, int n_entry, int n_unit, int stride,
+			 struct msdfa_kv **result) {
+	struct dfa_table table;
+	struct msdfa_kv *ms_entries = NULL;
+	int n_ms_entry = 0, capacity = 0;
+	long *root_state, *root_flag, *root_first_flag;
+	long state, first_idx, root_idx;
+	long value_state, value_flag, value_first_flag;
+	unsigned char unit[MSDFA_STRIDE_MAX];
+	int i_first, i_second;
+
+	if (stride != 2) {
+		fprintf(stderr, "ERR: stride %d is not supported\n", stride);
+		return -1;
+	}
+
+	if (dfa_table_fromkv(entries, n_entry, n_unit, &table) < 0) {
+		fprintf(stderr, "ERR: can't allocate the DFA table\n");
+		return -1;
+	}
+
+	root_state = malloc(sizeof(long) * n_unit * n_unit);
+	root_flag = malloc(sizeof(long) * n_unit * n_unit);
+	root_first_flag = malloc(sizeof(long) * n_unit * n_unit);
+	if (!root_state || !root_flag || !root_first_flag) {
+		fprintf(stderr, "ERR: can't allocate the root row\n");
+		goto error;
+	}
+
+	/* The root row, every unit is kept */
+	for (i_first = 0; i_first < n_unit; i_first++) {
+		for (i_second = 0; i_second < n_unit; i_second++) {
+			root_idx = i_first * n_unit + i_second;
+			unit[0] = i_first;
+			unit[1] = i_second;
+			dfa_table_walk(&table, 0, unit, stride,
+						   &root_state[root_idx], &root_flag[root_idx],
+						   &root_first_flag[root_idx]);
+			if (msdfa_push(&ms_entries, &n_ms_entry, &capacity, 0, unit,
+						   stride, root_state[root_idx],
+						   root_flag[root_idx],
+						   root_first_flag[root_idx]) < 0)
+				goto error;
+		}
+	}
+
+	/* The other states, only units that differ from the root row */
+	for (state = 1; state < table.n_state; state++) {
+		for (i_first = 0; i_first < n_unit; i_first++) {
+			first_idx = state * n_unit + i_first;
+			if (table.state[first_idx] == table.state[i_first] &&
+				table.flag[first_idx] == table.flag[i_first])
+				continue;
+			for (i_second = 0; i_second < n_unit; i_second++) {
+				root_idx = i_first * n_unit + i_second;
+				unit[0] = i_first;
+				unit[1] = i_second;
+				dfa_table_walk(&table, state, unit, stride, &value_state,
+							   &value_flag, &value_first_flag);
+				if (value_state == root_state[root_idx] &&
+					value_flag == root_flag[root_idx] &&
+					value_first_flag == root_first_flag[root_idx])
+					continue;
+				if (msdfa_push(&ms_entries, &n_ms_entry, &capacity, state,
+							   unit, stride, value_state, value_flag,
+							   value_first_flag) < 0)
+					goto error;
+			}
+		}
+	}
+
+	free(root_state);
+	free(root_flag);
+	free(root_first_flag);
+	dfa_table_free(&table);
+	*result = ms_entries;
+	return n_ms_entry;
+
+error:
+	free(ms_entries);
+	free(root_state);
+	free(root_flag);
+	free(root_first_flag);
+	dfa_table_free(&table);
+	return -1;
+}
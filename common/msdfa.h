@@ -0,0 +1,35 @@
+/*************************************************************************
+	> File Name: msdfa.h
+	> Description: Multi-stride DFA built from the single-stride entries
+	> of str2dfa
+ ************************************************************************/
+
+#ifndef _MSDFA_H
+#define _MSDFA_H
+
+#include "str2dfa.h"
+
+#define MSDFA_STRIDE_MAX 2
+
+/* Dense single-stride transition table, missing entries go to the root */
+struct dfa_table {
+	long n_state;
+	int n_unit;
+	long *state;
+	long *flag;
+};
+
+struct msdfa_kv {
+	long key_state;
+	unsigned char key_unit[MSDFA_STRIDE_MAX];
+	long value_state;
+	long value_flag;		/* Found on the last unit of the stride */
+	long value_first_flag;	/* Found on the unit before */
+};
+
+int dfa_table_fromkv(struct str2dfa_kv *, int, int, struct dfa_table *);
+void dfa_table_free(struct dfa_table *);
+
+int msdfa_fromkv(struct str2dfa_kv *, int, int, int, struct msdfa_kv **result);
+
+#endif
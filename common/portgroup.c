@@ -0,0 +1,357 @@
+/*************************************************************************
+	> File Name: portgroup.c
+	> Description: Port groups, the patterns split by destination port into
+	> one DFA per group, all laid out in one dense table
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include "portgroup.h"
+
+#define PORT_GROUP_LINE_MAX 1024
+
+/* Bit sets of patterns, one per (protocol, port) pair */
+struct port_group_key {
+	uint8_t proto;
+	uint16_t port;
+	uint64_t *member;
+	uint32_t group;
+};
+
+static size_t member_words;
+
+static int
+port_group_key_cmp(const void *a, const void *b) {
+	const struct port_group_key *x = a, *y = b;
+	int ret;
+
+	ret = memcmp(x->member, y->member, sizeof(uint64_t) * member_words);
+	if (ret)
+		return ret;
+	if (x->proto != y->proto)
+		return x->proto < y->proto ? -1 : 1;
+	return x->port < y->port ? -1 : x->port > y->port;
+}
+
+static int
+port_group_entry_cmp(const void *a, const void *b) {
+	const struct port_group_entry *x = a, *y = b;
+
+	if (x->proto != y->proto)
+		return x->proto < y->proto ? -1 : 1;
+	return x->port < y->port ? -1 : x->port > y->port;
+}
+
+static int
+port_group_proto(const char *name) {
+	if (!strcmp(name, "tcp"))
+		return IPPROTO_TCP;
+	if (!strcmp(name, "udp"))
+		return IPPROTO_UDP;
+	return -1;
+}
+
+int
+port_group_rules_fromfile(const char *group_file, long n_pattern,
+						  struct port_group_rule **result) {
+	char line[PORT_GROUP_LINE_MAX], proto_name[8], *ports, *range, *save;
+	struct port_group_rule *rules = NULL, *p;
+	int n_rule = 0, max_rule = 0, n_line = 0, proto, n;
+	long first, last, lo, hi;
+	FILE *fp;
+
+	fp = fopen(group_file, "r");
+	if (!fp) {
+		fprintf(stderr, "ERR: can't open port group file %s: %s\n",
+				group_file, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		n_line++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0')
+			continue;
+		n = 0;
+		first = 0;
+		if (sscanf(line, " * %7[a-z]:%n", proto_name, &n) == 1 && n) {
+			first = 1;
+			last = n_pattern;
+		} else if (sscanf(line, " %ld-%ld %7[a-z]:%n", &first, &last,
+						  proto_name, &n) == 3 && n) {
+		} else if (sscanf(line, " %ld %7[a-z]:%n", &first, proto_name,
+						  &n) == 2 && n) {
+			last = first;
+		} else {
+			first = 0;
+		}
+		proto = first ? port_group_proto(proto_name) : -1;
+		if (first < 1 || last < first || last > n_pattern || proto < 0)
+			goto error;
+
+		ports = line + n;
+		for (range = strtok_r(ports, ", \t", &save); range;
+			 range = strtok_r(NULL, ", \t", &save)) {
+			if (sscanf(range, "%ld-%ld", &lo, &hi) != 2) {
+				if (sscanf(range, "%ld", &lo) != 1)
+					goto error;
+				hi = lo;
+			}
+			if (lo < 0 || hi < lo || hi > UINT16_MAX)
+				goto error;
+			if (n_rule == max_rule) {
+				max_rule = max_rule ? max_rule * 2 : 64;
+				p = realloc(rules, sizeof(*rules) * max_rule);
+				if (!p) {
+					fclose(fp);
+					free(rules);
+					return -1;
+				}
+				rules = p;
+			}
+			rules[n_rule].first = first;
+			rules[n_rule].last = last;
+			rules[n_rule].proto = proto;
+			rules[n_rule].port_lo = lo;
+			rules[n_rule].port_hi = hi;
+			n_rule++;
+		}
+	}
+	fclose(fp);
+	*result = rules;
+	return n_rule;
+
+error:
+	fprintf(stderr, "ERR: %s:%d: expect <first>[-<last>] <tcp|udp>:<ports> "
+			"for patterns 1-%ld\n", group_file, n_line, n_pattern);
+	fclose(fp);
+	free(rules);
+	return -1;
+}
+
+/* Byte classes that tell apart every byte some group does, numbered by
+ * their first byte. joint_class[b] is the class of byte b.
+ */
+static int
+port_groups_joint_class(struct str2dfa_dense *group_dfa, uint32_t n_dfa,
+						unsigned char *joint_class) {
+	static int16_t pair[STR2DFA_ALPHABET][STR2DFA_ALPHABET];
+	unsigned char next_class[STR2DFA_ALPHABET];
+	int unit, n_class = 1;
+	uint32_t g;
+
+	memset(joint_class, 0, STR2DFA_ALPHABET);
+	for (g = 0; g < n_dfa; g++) {
+		memset(pair, 0xff, sizeof(pair));
+		n_class = 0;
+		for (unit = 0; unit < STR2DFA_ALPHABET; unit++) {
+			int16_t *id = &pair[joint_class[unit]]
+				[group_dfa[g].byte_class[unit]];
+
+			if (*id < 0)
+				*id = n_class++;
+			next_class[unit] = *id;
+		}
+		memcpy(joint_class, next_class, STR2DFA_ALPHABET);
+	}
+	return n_class;
+}
+
+uint16_t
+port_group_depth(const struct str2dfa_dense *dfa,
+				 const unsigned char *member) {
+	const struct str2dfa_limit *limit;
+	uint32_t depth = 0;
+	long i;
+
+	if (!dfa->pattern_limit)
+		return 0;
+	for (i = 1; i <= dfa->n_pattern; i++) {
+		if (member && !member[i])
+			continue;
+		limit = &dfa->pattern_limit[i];
+		if (!limit->depth)
+			return 0;
+		if (limit->offset + limit->depth > depth)
+			depth = limit->offset + limit->depth;
+	}
+	return depth;
+}
+
+int
+port_groups_build(struct str2dfa_dense *dfa,
+				  const struct port_group_rule *rules, int n_rule,
+				  const unsigned char *exclude, struct port_groups *groups) {
+	static int32_t key_index[2][UINT16_MAX + 1];
+	struct port_group_key *keys = NULL;
+	struct str2dfa_dense *group_dfa = NULL;
+	struct str2dfa_trans *table = NULL, *trans;
+	unsigned char *member = NULL, joint_class[STR2DFA_ALPHABET];
+	unsigned char class_byte[STR2DFA_ALPHABET];
+	uint64_t *any = NULL, *set;
+	uint16_t *depth = NULL;
+	uint32_t n_key = 0, n_dfa = 0, g, i_key;
+	long *base = NULL, n_state = 0, state, i, max_state = 0;
+	int n_class, class, unit, i_rule, port, err = -1;
+
+	memset(groups, 0, sizeof(*groups));
+	member_words = (dfa->n_pattern + 1 + 63) / 64;
+	memset(key_index, 0xff, sizeof(key_index));
+
+	/* The patterns of each (protocol, port) pair */
+	keys = calloc(PORT_GROUP_ENTRY_MAX, sizeof(*keys));
+	any = calloc(member_words, sizeof(uint64_t));
+	if (!keys || !any)
+		goto out;
+	for (i = 1; i <= dfa->n_pattern; i++)
+		any[i / 64] |= 1ULL << (i % 64);
+	for (i_rule = 0; i_rule < n_rule; i_rule++) {
+		const struct port_group_rule *rule = &rules[i_rule];
+		int proto = rule->proto == IPPROTO_TCP ? 0 : 1;
+
+		if (rule->first < 1 || rule->last > dfa->n_pattern)
+			goto out;
+		for (port = rule->port_lo; port <= rule->port_hi; port++) {
+			int32_t *index = &key_index[proto][port];
+
+			if (*index < 0) {
+				if (n_key == PORT_GROUP_ENTRY_MAX) {
+					fprintf(stderr, "ERR: more than %d ports in groups\n",
+							PORT_GROUP_ENTRY_MAX);
+					goto out;
+				}
+				keys[n_key].proto = rule->proto;
+				keys[n_key].port = port;
+				keys[n_key].member = calloc(member_words, sizeof(uint64_t));
+				if (!keys[n_key].member)
+					goto out;
+				*index = n_key++;
+			}
+			set = keys[*index].member;
+			for (i = rule->first; i <= rule->last; i++)
+				set[i / 64] |= 1ULL << (i % 64);
+		}
+		for (i = rule->first; i <= rule->last; i++)
+			any[i / 64] &= ~(1ULL << (i % 64));
+	}
+
+	/* Pairs with the same patterns share a group */
+	qsort(keys, n_key, sizeof(*keys), port_group_key_cmp);
+	for (i_key = 0; i_key < n_key; i_key++) {
+		if (i_key == 0 || memcmp(keys[i_key].member, keys[i_key - 1].member,
+								 sizeof(uint64_t) * member_words))
+			n_dfa++;
+		keys[i_key].group = n_dfa;
+	}
+	n_dfa++;
+
+	/* The DFA of each group, the any group first */
+	group_dfa = calloc(n_dfa, sizeof(*group_dfa));
+	base = calloc(n_dfa, sizeof(*base));
+	depth = calloc(n_dfa, sizeof(*depth));
+	member = malloc(dfa->n_pattern + 1);
+	if (!group_dfa || !base || !depth || !member)
+		goto out;
+	for (g = 0, i_key = 0; g < n_dfa; g++) {
+		set = g ? keys[i_key].member : NULL;
+		for (i = 0; i <= dfa->n_pattern; i++) {
+			member[i] = !!(any[i / 64] & (1ULL << (i % 64)));
+			if (set && (set[i / 64] & (1ULL << (i % 64))))
+				member[i] = 1;
+		}
+		/* The excluded patterns are still found in the group */
+		depth[g] = port_group_depth(dfa, member);
+		for (i = 0; exclude && i <= dfa->n_pattern; i++) {
+			if (exclude[i])
+				member[i] = 0;
+		}
+		if (str2dfa_dense_subset(dfa, member, &group_dfa[g]) < 0)
+			goto out;
+		base[g] = n_state;
+		n_state += group_dfa[g].n_state;
+		if (group_dfa[g].n_state > max_state)
+			max_state = group_dfa[g].n_state;
+		while (g && i_key < n_key && keys[i_key].group == g)
+			i_key++;
+	}
+
+	/* One table over the joint byte classes, each group's states offset
+	 * by its base
+	 */
+	n_class = port_groups_joint_class(group_dfa, n_dfa, joint_class);
+	for (unit = STR2DFA_ALPHABET - 1; unit >= 0; unit--)
+		class_byte[joint_class[unit]] = unit;
+	if ((unsigned long)n_state * n_class > UINT32_MAX) {
+		fprintf(stderr, "ERR: %ld states of the port groups are too many\n",
+				n_state);
+		goto out;
+	}
+	table = malloc(sizeof(*table) * n_state * n_class);
+	if (!table)
+		goto out;
+	trans = table;
+	for (g = 0; g < n_dfa; g++) {
+		const struct str2dfa_dense *gd = &group_dfa[g];
+
+		for (state = 0; state < gd->n_state; state++) {
+			for (class = 0; class < n_class; class++, trans++) {
+				*trans = gd->table[state * gd->n_class +
+								   gd->byte_class[class_byte[class]]];
+				trans->state += base[g];
+			}
+		}
+	}
+
+	groups->n_group = n_dfa - 1;
+	groups->n_entry = n_key;
+	groups->entry = calloc(n_key ? n_key : 1, sizeof(*groups->entry));
+	if (!groups->entry)
+		goto out;
+	for (i_key = 0; i_key < n_key; i_key++) {
+		groups->entry[i_key].proto = keys[i_key].proto;
+		groups->entry[i_key].port = keys[i_key].port;
+		groups->entry[i_key].root = base[keys[i_key].group];
+		groups->entry[i_key].depth = depth[keys[i_key].group];
+	}
+	groups->any_depth = depth[0];
+	qsort(groups->entry, n_key, sizeof(*groups->entry), port_group_entry_cmp);
+
+	printf("Total %u port groups on %u ports, %ld states in the any group "
+		   "and %ld in the largest, instead of %ld in one DFA\n",
+		   groups->n_group, n_key, group_dfa[0].n_state, max_state,
+		   dfa->n_state);
+
+	free(dfa->table);
+	dfa->table = table;
+	table = NULL;
+	dfa->n_state = n_state;
+	dfa->n_class = n_class;
+	memcpy(dfa->byte_class, joint_class, sizeof(dfa->byte_class));
+	err = 0;
+
+out:
+	if (err) {
+		fprintf(stderr, "ERR: can't build the port groups\n");
+		port_groups_free(groups);
+	}
+	for (i_key = 0; keys && i_key < n_key; i_key++)
+		free(keys[i_key].member);
+	for (g = 0; group_dfa && g < n_dfa; g++)
+		str2dfa_dense_free(&group_dfa[g]);
+	free(keys);
+	free(any);
+	free(group_dfa);
+	free(base);
+	free(depth);
+	free(member);
+	free(table);
+	return err;
+}
+
+void
+port_groups_free(struct port_groups *groups) {
+	free(groups->entry);
+	memset(groups, 0, sizeof(*groups));
+}
@@ -0,0 +1,74 @@
+/*************************************************************************
+	> File Name: portgroup.h
+	> Description: Port groups, the patterns split by destination port into
+	> one DFA per group, all laid out in one dense table
+ ************************************************************************/
+
+#ifndef _PORTGROUP_H
+#define _PORTGROUP_H
+
+#include <stdint.h>
+#include "str2dfa.h"
+
+/* Distinct (protocol, port) pairs a ruleset can name */
+#define PORT_GROUP_ENTRY_MAX 4096
+
+/* Patterns first to last (1-based) are only inspected in packets of proto
+ * to a destination port from port_lo to port_hi
+ */
+struct port_group_rule {
+	long first;
+	long last;
+	uint8_t proto;		/* IPPROTO_TCP or IPPROTO_UDP */
+	uint16_t port_lo;
+	uint16_t port_hi;
+};
+
+/* The DFA a (protocol, port) pair is inspected with starts at root, and
+ * its patterns end within depth bytes of the payload
+ */
+struct port_group_entry {
+	uint8_t proto;
+	uint8_t padding;
+	uint16_t port;		/* Host byte order */
+	uint32_t root;
+	uint16_t depth;		/* 0 if some pattern may be anywhere */
+	uint16_t padding2;
+};
+
+/* Patterns named by no rule form the "any" group, inspected in every
+ * packet. Its DFA starts at state 0, the other groups also hold its
+ * patterns.
+ */
+struct port_groups {
+	uint32_t n_group;	/* Groups besides the any group */
+	uint32_t n_entry;
+	struct port_group_entry *entry;	/* Sorted by proto, port */
+	uint16_t any_depth;	/* Depth of the any group */
+};
+
+/* Read rules from a file, each line being <first>[-<last>] or * for every
+ * pattern, then <proto>:<port>[-<port>][,<port>[-<port>]...]. Return the
+ * number of rules, or -1 on error.
+ */
+int port_group_rules_fromfile(const char *group_file, long n_pattern,
+							  struct port_group_rule **result);
+
+/* How deep into the payload the patterns set in member (every pattern if
+ * NULL) end, by their pattern_limit. Return 0 if some pattern has no depth.
+ */
+uint16_t port_group_depth(const struct str2dfa_dense *dfa,
+						  const unsigned char *member);
+
+/* Replace the table of dfa, built from every pattern, with the DFAs of the
+ * groups the rules make one after another, leaving out the patterns set in
+ * exclude (if not NULL). The pattern and output link tables are kept.
+ * Return 0, or -1 on error.
+ */
+int port_groups_build(struct str2dfa_dense *dfa,
+					  const struct port_group_rule *rules, int n_rule,
+					  const unsigned char *exclude,
+					  struct port_groups *groups);
+void port_groups_free(struct port_groups *groups);
+
+#endif
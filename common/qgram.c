@@ -0,0 +1,112 @@
+/*************************************************************************
+	> File Name: qgram.c
+	> Description: Q-grams of the patterns for the packet filter in front
+	> of the DFA, one per pattern from its rarest part
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qgram.h"
+
+/* Rough commonness of a byte in benign traffic, mostly text protocols:
+ * a q-gram made of rare bytes lets fewer payload windows through
+ */
+static int
+qgram_byte_weight(unsigned char byte) {
+	if (byte == 0x00 || byte == 0xff || byte == ' ' || byte == '\r' ||
+		byte == '\n' || strchr("etaoinsrhl/.:=-", byte))
+		return 12;
+	if (byte >= 'a' && byte <= 'z')
+		return 8;
+	if (byte >= '0' && byte <= '9')
+		return 6;
+	if (byte >= 0x21 && byte <= 0x7e)
+		return 4;
+	return 1;
+}
+
+static int
+qgram_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int
+qgram_set_build(const struct str2dfa_dense *dfa, int len,
+				struct qgram_set *set) {
+	const unsigned char *pattern;
+	unsigned char gram[QGRAM_LEN_MAX];
+	int pos, best_pos, score, best_score, gram_len, k, nocase, bit;
+	long i, pattern_len, mask;
+	uint32_t n = 0, j;
+
+	memset(set, 0, sizeof(*set));
+	if (dfa->n_pattern < 1)
+		return 0;
+	set->len = len < QGRAM_LEN_MAX ? len : QGRAM_LEN_MAX;
+	/* Room for every case of the q-grams of nocase patterns */
+	set->gram = malloc(sizeof(*set->gram) * dfa->n_pattern *
+					   (dfa->pattern_nocase ? 1 << QGRAM_LEN_MAX : 1));
+	if (!set->gram) {
+		fprintf(stderr, "ERR: can't allocate the q-grams\n");
+		return -1;
+	}
+	for (i = 1; i <= dfa->n_pattern; i++) {
+		pattern = dfa->pattern_data + dfa->pattern_offset[i - 1];
+		pattern_len = dfa->pattern_offset[i] - dfa->pattern_offset[i - 1];
+		if (pattern_len > set->max_pattern_len)
+			set->max_pattern_len = pattern_len;
+		if (pattern_len == 0)
+			continue;
+		nocase = dfa->pattern_nocase && dfa->pattern_nocase[i];
+		gram_len = pattern_len < set->len ? pattern_len : set->len;
+		best_pos = 0;
+		best_score = -1;
+		for (pos = 0; pos + gram_len <= pattern_len; pos++) {
+			/* A letter of a nocase pattern passes in both cases */
+			for (k = 0, score = 0; k < gram_len; k++)
+				score += qgram_byte_weight(pattern[pos + k]) *
+					(nocase && str2dfa_letter(pattern[pos + k]) ? 2 : 1);
+			if (best_score < 0 || score < best_score) {
+				best_score = score;
+				best_pos = pos;
+			}
+		}
+		for (mask = 0; mask < 1L << gram_len; mask++) {
+			for (k = 0, bit = 0; k < gram_len; k++) {
+				gram[k] = pattern[best_pos + k];
+				if (!nocase || !str2dfa_letter(gram[k]))
+					continue;
+				if (mask & (1L << bit++))
+					gram[k] ^= 0x20;
+			}
+			/* Masks past the letters of the gram give the same cases */
+			if (mask >> bit)
+				continue;
+			set->gram[n++] = qgram_key(gram, gram_len);
+		}
+		set->lens |= 1U << gram_len;
+	}
+
+	qsort(set->gram, n, sizeof(*set->gram), qgram_cmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if (j == 0 || set->gram[i] != set->gram[j - 1])
+			set->gram[j++] = set->gram[i];
+	}
+	set->n_gram = j;
+	return 0;
+}
+
+int
+qgram_set_find(const struct qgram_set *set, uint64_t key) {
+	return bsearch(&key, set->gram, set->n_gram, sizeof(*set->gram),
+				   qgram_cmp) != NULL;
+}
+
+void
+qgram_set_free(struct qgram_set *set) {
+	free(set->gram);
+	memset(set, 0, sizeof(*set));
+}
@@ -0,0 +1,50 @@
+/*************************************************************************
+	> File Name: qgram.h
+	> Description: Q-grams of the patterns for the packet filter in front
+	> of the DFA, one per pattern from its rarest part
+ ************************************************************************/
+
+#ifndef _QGRAM_H
+#define _QGRAM_H
+
+#include <stdint.h>
+#include "str2dfa.h"
+
+/* Longest q-gram, the window of the filter is one 32-bit word */
+#define QGRAM_LEN_MAX 4
+
+/* The q-gram picked from each pattern, distinct ones once, as keys of
+ * qgram_key. A pattern shorter than q gives a shorter gram, all of it.
+ */
+struct qgram_set {
+	int len;		/* q, 0 without patterns */
+	uint32_t lens;		/* Bit l set if some gram is l bytes long */
+	uint32_t n_gram;
+	uint64_t *gram;		/* Sorted */
+	long max_pattern_len;
+};
+
+/* Key of the len-byte gram at p: its bytes read big-endian, the way the
+ * filter shifts the payload into its window, tagged with the length
+ */
+static inline uint64_t qgram_key(const unsigned char *p, int len)
+{
+	uint32_t value = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		value = value << 8 | p[i];
+	return (uint64_t)len << 32 | value;
+}
+
+/* Pick the q-gram of each pattern of the DFA, with q up to QGRAM_LEN_MAX.
+ * A nocase pattern gives its q-gram in every case of its letters.
+ * Return 0, or -1 on error.
+ */
+int qgram_set_build(const struct str2dfa_dense *dfa, int len,
+					struct qgram_set *set);
+/* Whether the key is in the set */
+int qgram_set_find(const struct qgram_set *set, uint64_t key);
+void qgram_set_free(struct qgram_set *set);
+
+#endif
@@ -0,0 +1,687 @@
+/*************************************************************************
+	> File Name: rules.c
+	> Description: Snort rule files, the contents of the rules turned into
+	> patterns with their offset and depth, and the port groups of the
+	> rule headers
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include "rules.h"
+
+/* Bytes of one content, and port ranges of one rule header */
+#define RULES_CONTENT_MAX 4096
+#define RULES_PORT_RANGES_MAX 64
+#define RULES_HEADER_TOKENS 7
+
+/* The content being read, it is added once the next one begins */
+struct rules_content {
+	unsigned char data[RULES_CONTENT_MAX];
+	long len;
+	int nocase;
+	long offset;
+	long depth;
+};
+
+struct rules_ctx {
+	struct rules *rules;
+	long pattern_max;
+	size_t data_max;
+	int group_rule_max;
+	int has_limit;
+	int has_nocase;
+	long n_rule;
+	long n_skipped;
+	long n_content;
+	long n_negated;
+	long n_nocase;
+	long n_approx;
+	long n_limited;
+};
+
+int
+rules_file(const char *file) {
+	size_t len = strlen(file);
+
+	return len > 6 && !strcmp(file + len - 6, ".rules");
+}
+
+static int
+rules_init(struct rules_ctx *ctx, struct rules *rules) {
+	memset(rules, 0, sizeof(*rules));
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->rules = rules;
+	ctx->pattern_max = 1024;
+	ctx->data_max = 65536;
+	rules->pattern_offset = calloc(ctx->pattern_max,
+								   sizeof(*rules->pattern_offset));
+	rules->pattern_limit = calloc(ctx->pattern_max,
+								  sizeof(*rules->pattern_limit));
+	rules->pattern_nocase = calloc(ctx->pattern_max, 1);
+	rules->pattern_data = malloc(ctx->data_max);
+	if (!rules->pattern_offset || !rules->pattern_limit ||
+		!rules->pattern_nocase || !rules->pattern_data) {
+		rules_free(rules);
+		return -1;
+	}
+	return 0;
+}
+
+/* Drop the limit and nocase tables no pattern needs */
+static void
+rules_trim(struct rules_ctx *ctx) {
+	if (!ctx->has_limit) {
+		free(ctx->rules->pattern_limit);
+		ctx->rules->pattern_limit = NULL;
+	}
+	if (!ctx->has_nocase) {
+		free(ctx->rules->pattern_nocase);
+		ctx->rules->pattern_nocase = NULL;
+	}
+}
+
+/* Append a pattern with its limits. Return 0, or -1 on error. */
+static int
+rules_add_pattern(struct rules_ctx *ctx, const unsigned char *data, long len,
+				  const struct str2dfa_limit *limit, int nocase) {
+	struct rules *rules = ctx->rules;
+	long n = rules->n_pattern + 1;
+	uint32_t data_len = rules->pattern_offset[n - 1];
+	void *p;
+
+	if (n > UINT16_MAX) {
+		fprintf(stderr, "ERR: more than %d patterns in the rules\n",
+				UINT16_MAX);
+		return -1;
+	}
+	if (n + 1 > ctx->pattern_max) {
+		ctx->pattern_max *= 2;
+		p = realloc(rules->pattern_offset,
+					sizeof(*rules->pattern_offset) * ctx->pattern_max);
+		if (!p)
+			return -1;
+		rules->pattern_offset = p;
+		p = realloc(rules->pattern_limit,
+					sizeof(*rules->pattern_limit) * ctx->pattern_max);
+		if (!p)
+			return -1;
+		rules->pattern_limit = p;
+		p = realloc(rules->pattern_nocase, ctx->pattern_max);
+		if (!p)
+			return -1;
+		rules->pattern_nocase = p;
+	}
+	while (data_len + len > ctx->data_max) {
+		ctx->data_max *= 2;
+		p = realloc(rules->pattern_data, ctx->data_max);
+		if (!p)
+			return -1;
+		rules->pattern_data = p;
+	}
+	memcpy(rules->pattern_data + data_len, data, len);
+	rules->pattern_offset[n] = data_len + len;
+	rules->pattern_limit[n] = *limit;
+	rules->pattern_nocase[n] = nocase;
+	rules->n_pattern = n;
+	if (limit->offset || limit->depth)
+		ctx->has_limit = 1;
+	if (nocase)
+		ctx->has_nocase = 1;
+	return 0;
+}
+
+/* Add a nocase pattern as the case-sensitive patterns of its cases */
+static int
+rules_add_cases(struct rules_ctx *ctx, const unsigned char *data, long len,
+				const struct str2dfa_limit *limit) {
+	unsigned char variant[3][RULES_CONTENT_MAX];
+	long i, mask, n_letter = 0, bit;
+	int v;
+
+	for (i = 0; i < len; i++)
+		n_letter += str2dfa_letter(data[i]);
+	if (n_letter <= RULES_NOCASE_LETTERS_MAX) {
+		for (mask = 0; mask < 1L << n_letter; mask++) {
+			for (i = 0, bit = 0; i < len; i++) {
+				variant[0][i] = data[i];
+				if (!str2dfa_letter(data[i]))
+					continue;
+				variant[0][i] = mask & (1L << bit++) ?
+					toupper(data[i]) : tolower(data[i]);
+			}
+			if (rules_add_pattern(ctx, variant[0], len, limit, 0) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	/* Too many cases, the common ones only */
+	ctx->n_approx++;
+	for (i = 0; i < len; i++) {
+		variant[0][i] = data[i];
+		variant[1][i] = tolower(data[i]);
+		variant[2][i] = toupper(data[i]);
+	}
+	for (v = 0; v < 3; v++) {
+		if ((v > 0 && !memcmp(variant[v], variant[0], len)) ||
+			(v > 1 && !memcmp(variant[v], variant[1], len)))
+			continue;
+		if (rules_add_pattern(ctx, variant[v], len, limit, 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Add the pattern of a content, a nocase one is folded into the DFA */
+static int
+rules_add_content(struct rules_ctx *ctx, const struct rules_content *content,
+				  const char *rule_file, long n_line) {
+	struct str2dfa_limit limit = { 0, 0 };
+	long i, n_letter = 0;
+
+	if (!content->len)
+		return 0;
+	/* As Snort, a depth shorter than the content is an error */
+	if (content->depth && content->depth < content->len) {
+		fprintf(stderr, "ERR: %s:%ld: depth %ld is shorter than the "
+				"content of %ld bytes\n", rule_file, n_line, content->depth,
+				content->len);
+		return -1;
+	}
+	ctx->n_content++;
+	/* Limits that do not fit only widen the match, the first and the last
+	 * bytes the content can end on are 16 bits
+	 */
+	if (content->offset <= UINT16_MAX - content->len + 1) {
+		limit.offset = content->offset;
+		if (content->depth && content->depth <= UINT16_MAX - content->offset)
+			limit.depth = content->depth;
+	}
+	if (limit.offset || limit.depth)
+		ctx->n_limited++;
+	for (i = 0; i < content->len; i++)
+		n_letter += str2dfa_letter(content->data[i]);
+	if (content->nocase && n_letter)
+		ctx->n_nocase++;
+	return rules_add_pattern(ctx, content->data, content->len, &limit,
+							 content->nocase && n_letter);
+}
+
+/* Copy the patterns of from into rules, the nocase ones set in expand
+ * given in their cases, and renumber the port group rules. Return 0, or
+ * -1 on error.
+ */
+static int
+rules_expand(const struct rules *from, const unsigned char *expand,
+			 struct rules *rules, long *n_approx) {
+	static const struct str2dfa_limit no_limit = { 0, 0 };
+	const struct str2dfa_limit *limit;
+	const unsigned char *data;
+	struct port_group_rule *rule;
+	struct rules_ctx ctx;
+	long i, len, *first;
+	int err;
+
+	first = malloc(sizeof(*first) * (from->n_pattern + 2));
+	if (!first)
+		return -1;
+	if (rules_init(&ctx, rules) < 0) {
+		free(first);
+		return -1;
+	}
+	for (i = 1; i <= from->n_pattern; i++) {
+		data = from->pattern_data + from->pattern_offset[i - 1];
+		len = from->pattern_offset[i] - from->pattern_offset[i - 1];
+		limit = from->pattern_limit ? &from->pattern_limit[i] : &no_limit;
+		first[i] = rules->n_pattern + 1;
+		if (expand[i])
+			err = rules_add_cases(&ctx, data, len, limit);
+		else
+			err = rules_add_pattern(&ctx, data, len, limit,
+									from->pattern_nocase &&
+									from->pattern_nocase[i]);
+		if (err < 0)
+			goto err;
+	}
+	first[i] = rules->n_pattern + 1;
+
+	if (from->n_group_rule) {
+		rules->group_rule = malloc(sizeof(*rules->group_rule) *
+								   from->n_group_rule);
+		if (!rules->group_rule)
+			goto err;
+		rules->n_group_rule = from->n_group_rule;
+	}
+	for (i = 0; i < from->n_group_rule; i++) {
+		rule = &rules->group_rule[i];
+		*rule = from->group_rule[i];
+		rule->first = first[from->group_rule[i].first];
+		rule->last = first[from->group_rule[i].last + 1] - 1;
+	}
+	rules_trim(&ctx);
+	*n_approx = ctx.n_approx;
+	free(first);
+	return 0;
+
+err:
+	free(first);
+	rules_free(rules);
+	return -1;
+}
+
+long
+rules_expanded_states(const struct rules *rules) {
+	struct rules expanded;
+	long n_state, n_approx;
+
+	if (!rules->pattern_nocase)
+		return str2dfa_count_states(rules->pattern_data,
+									rules->pattern_offset,
+									rules->n_pattern, NULL);
+	if (rules_expand(rules, rules->pattern_nocase, &expanded, &n_approx) < 0)
+		return -1;
+	n_state = str2dfa_count_states(expanded.pattern_data,
+								   expanded.pattern_offset,
+								   expanded.n_pattern, NULL);
+	rules_free(&expanded);
+	return n_state;
+}
+
+/* Apply a content modifier, the Snort 2 option or the Snort 3 argument
+ * after the content. Relative ones such as distance and within do not
+ * bound where the content is on its own, they are ignored.
+ */
+static void
+rules_modifier(struct rules_content *content, const char *name,
+			   const char *arg) {
+	char *end;
+	long n = -1;
+
+	if (!strcmp(name, "nocase")) {
+		content->nocase = 1;
+		return;
+	}
+	if (strcmp(name, "offset") && strcmp(name, "depth"))
+		return;
+	/* A variable of byte_extract is not known here */
+	if (arg) {
+		n = strtol(arg, &end, 10);
+		while (isspace((unsigned char)*end))
+			end++;
+		if (end == arg || *end)
+			n = -1;
+	}
+	if (!strcmp(name, "offset"))
+		content->offset = n > 0 ? n : 0;
+	else
+		content->depth = n > 0 ? n : 0;
+}
+
+/* Decode a content option, "..." with |hex| bytes and \ escapes, then the
+ * Snort 3 modifiers after it. Return 1 if it is negated, 0 if not, or -1
+ * if it is not valid.
+ */
+static int
+rules_content(const char *value, struct rules_content *content) {
+	const char *p = value;
+	char name[32], *arg, *item, *save, buf[256];
+	int hex = 0, negated = 0, digit = -1, nibble;
+
+	content->len = 0;
+	content->nocase = 0;
+	content->offset = 0;
+	content->depth = 0;
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p == '!') {
+		negated = 1;
+		p++;
+		while (isspace((unsigned char)*p))
+			p++;
+	}
+	if (*p++ != '"')
+		return -1;
+	while (*p && (hex || *p != '"')) {
+		if (hex) {
+			if (*p == '|') {
+				if (digit >= 0)
+					return -1;
+				hex = 0;
+			} else if (isxdigit((unsigned char)*p)) {
+				nibble = isdigit((unsigned char)*p) ? *p - '0' :
+						 tolower((unsigned char)*p) - 'a' + 10;
+				if (digit < 0) {
+					digit = nibble;
+				} else {
+					if (content->len == RULES_CONTENT_MAX)
+						return -1;
+					content->data[content->len++] = digit << 4 | nibble;
+					digit = -1;
+				}
+			} else if (!isspace((unsigned char)*p)) {
+				return -1;
+			}
+			p++;
+			continue;
+		}
+		if (*p == '|') {
+			hex = 1;
+			p++;
+			continue;
+		}
+		if (*p == '\\' && p[1])
+			p++;
+		if (content->len == RULES_CONTENT_MAX)
+			return -1;
+		content->data[content->len++] = *p++;
+	}
+	if (*p != '"')
+		return -1;
+
+	/* Snort 3: content:"...", nocase, offset 4, depth 20 */
+	snprintf(buf, sizeof(buf), "%s", p + 1);
+	for (item = strtok_r(buf, ",", &save); item;
+		 item = strtok_r(NULL, ",", &save)) {
+		if (sscanf(item, " %31[a-z_]", name) != 1)
+			continue;
+		arg = strstr(item, name) + strlen(name);
+		while (isspace((unsigned char)*arg))
+			arg++;
+		rules_modifier(content, name, *arg ? arg : NULL);
+	}
+	return negated;
+}
+
+/* The destination ports of a rule header as ranges. Return their number,
+ * or 0 if the rule is inspected on every port: any, a variable, a
+ * negation or too many ports.
+ */
+static int
+rules_ports(char *spec, uint16_t *lo, uint16_t *hi) {
+	char *item, *save, *end;
+	long first, last, span = 0;
+	size_t len;
+	int n = 0;
+
+	if (*spec == '[') {
+		spec++;
+		len = strlen(spec);
+		if (!len || spec[len - 1] != ']')
+			return 0;
+		spec[len - 1] = '\0';
+	}
+	for (item = strtok_r(spec, ",", &save); item;
+		 item = strtok_r(NULL, ",", &save)) {
+		while (isspace((unsigned char)*item))
+			item++;
+		if (!isdigit((unsigned char)*item) && *item != ':')
+			return 0;
+		if (*item == ':') {
+			first = 0;
+			last = strtol(item + 1, &end, 10);
+		} else {
+			first = strtol(item, &end, 10);
+			last = first;
+			if (*end == ':' && isdigit((unsigned char)end[1])) {
+				last = strtol(end + 1, &end, 10);
+			} else if (*end == ':') {
+				last = UINT16_MAX;
+				end++;
+			}
+		}
+		while (isspace((unsigned char)*end))
+			end++;
+		if (*end || first > last || last > UINT16_MAX)
+			return 0;
+		span += last - first + 1;
+		if (span > RULES_PORT_SPAN_MAX || n == RULES_PORT_RANGES_MAX)
+			return 0;
+		lo[n] = first;
+		hi[n] = last;
+		n++;
+	}
+	return n;
+}
+
+/* Port group rules for the patterns first to last of a rule */
+static int
+rules_add_group(struct rules_ctx *ctx, long first, long last, int proto,
+				const uint16_t *lo, const uint16_t *hi, int n_range) {
+	struct rules *rules = ctx->rules;
+	struct port_group_rule *rule;
+	void *p;
+	int i;
+
+	for (i = 0; i < n_range; i++) {
+		if (rules->n_group_rule == ctx->group_rule_max) {
+			ctx->group_rule_max = ctx->group_rule_max ?
+				ctx->group_rule_max * 2 : 256;
+			p = realloc(rules->group_rule,
+						sizeof(*rules->group_rule) * ctx->group_rule_max);
+			if (!p)
+				return -1;
+			rules->group_rule = p;
+		}
+		rule = &rules->group_rule[rules->n_group_rule++];
+		rule->first = first;
+		rule->last = last;
+		rule->proto = proto;
+		rule->port_lo = lo[i];
+		rule->port_hi = hi[i];
+	}
+	return 0;
+}
+
+/* Read the next option of the body, key[:value];, and cut it out. Quoted
+ * values may hold escaped quotes and semicolons. Return the key, or NULL
+ * at the end.
+ */
+static char *
+rules_option(char **body, char **value) {
+	char *p = *body, *key, *end;
+	int quoted = 0;
+
+	while (isspace((unsigned char)*p) || *p == ';')
+		p++;
+	if (!*p)
+		return NULL;
+	key = p;
+	*value = NULL;
+	for (; *p && (quoted || *p != ';'); p++) {
+		if (*p == '\\' && p[1]) {
+			p++;
+		} else if (*p == '"') {
+			quoted = !quoted;
+		} else if (*p == ':' && !quoted && !*value) {
+			*p = '\0';
+			*value = p + 1;
+		}
+	}
+	if (*p)
+		*p++ = '\0';
+	*body = p;
+	for (end = key + strlen(key); end > key && isspace((unsigned char)end[-1]);)
+		*--end = '\0';
+	return key;
+}
+
+/* Add the patterns and port groups of one rule. Return 0, or -1 on
+ * error.
+ */
+static int
+rules_parse(struct rules_ctx *ctx, char *line, const char *rule_file,
+			long n_line) {
+	static struct rules_content content;
+	char *token[RULES_HEADER_TOKENS], *body, *end, *key, *value, *save;
+	uint16_t lo[RULES_PORT_RANGES_MAX], hi[RULES_PORT_RANGES_MAX];
+	long first = ctx->rules->n_pattern + 1;
+	int n_token = 0, proto = 0, n_range = 0, ret;
+
+	body = strchr(line, '(');
+	end = strrchr(line, ')');
+	if (!body || !end || end < body) {
+		fprintf(stderr, "ERR: %s:%ld: expect <header> (<options>)\n",
+				rule_file, n_line);
+		return -1;
+	}
+	*body++ = '\0';
+	*end = '\0';
+	for (key = strtok_r(line, " \t", &save);
+		 key && n_token < RULES_HEADER_TOKENS;
+		 key = strtok_r(NULL, " \t", &save))
+		token[n_token++] = key;
+
+	/* Pass rules let packets through, and the DPI only sees TCP and UDP
+	 * payloads
+	 */
+	if (n_token < 2 || !strcmp(token[0], "pass") ||
+		!strcmp(token[1], "icmp")) {
+		ctx->n_skipped++;
+		return 0;
+	}
+	if (!strcmp(token[1], "tcp"))
+		proto = IPPROTO_TCP;
+	else if (!strcmp(token[1], "udp"))
+		proto = IPPROTO_UDP;
+	/* Snort 3 service rules and ip rules have no ports */
+	if (proto && n_token == RULES_HEADER_TOKENS && !strcmp(token[4], "->"))
+		n_range = rules_ports(token[6], lo, hi);
+
+	content.len = 0;
+	while ((key = rules_option(&body, &value))) {
+		if (!strcmp(key, "content")) {
+			if (rules_add_content(ctx, &content, rule_file, n_line) < 0)
+				return -1;
+			ret = value ? rules_content(value, &content) : -1;
+			if (ret < 0) {
+				fprintf(stderr, "ERR: %s:%ld: invalid content\n", rule_file,
+						n_line);
+				return -1;
+			}
+			if (ret) {
+				/* Found by its absence, no pattern */
+				ctx->n_negated++;
+				content.len = 0;
+			}
+		} else if (content.len) {
+			rules_modifier(&content, key, value);
+		}
+	}
+	if (rules_add_content(ctx, &content, rule_file, n_line) < 0)
+		return -1;
+
+	if (ctx->rules->n_pattern < first) {
+		ctx->n_skipped++;
+		return 0;
+	}
+	ctx->n_rule++;
+	return rules_add_group(ctx, first, ctx->rules->n_pattern, proto, lo, hi,
+						   n_range);
+}
+
+int
+rules_fromfile(const char *rule_file, struct rules *rules) {
+	struct rules_ctx ctx;
+	struct rules expanded;
+	char *line = NULL, *rule = NULL, *start, *p;
+	unsigned char *conflict = NULL;
+	size_t line_size = 0, rule_len = 0;
+	ssize_t len;
+	long n_line = 0, first_line = 0, n_conflict;
+	int err = -1;
+	FILE *fp;
+
+	if (rules_init(&ctx, rules) < 0)
+		return -1;
+
+	fp = fopen(rule_file, "r");
+	if (!fp) {
+		fprintf(stderr, "ERR: can't open rule file %s: %s\n", rule_file,
+				strerror(errno));
+		rules_free(rules);
+		return -1;
+	}
+	while ((len = getline(&line, &line_size, fp)) >= 0) {
+		n_line++;
+		while (len > 0 && isspace((unsigned char)line[len - 1]))
+			line[--len] = '\0';
+		/* A rule goes on in the next line after a backslash */
+		p = realloc(rule, rule_len + len + 1);
+		if (!p)
+			goto out;
+		rule = p;
+		if (!rule_len)
+			first_line = n_line;
+		memcpy(rule + rule_len, line, len + 1);
+		rule_len += len;
+		if (rule_len && rule[rule_len - 1] == '\\') {
+			rule[--rule_len] = '\0';
+			continue;
+		}
+		rule_len = 0;
+		for (start = rule; isspace((unsigned char)*start); start++)
+			;
+		if (*start == '\0' || *start == '#')
+			continue;
+		if (rules_parse(&ctx, start, rule_file, first_line) < 0)
+			goto out;
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "ERR: can't read rule file %s\n", rule_file);
+		goto out;
+	}
+	if (!rules->n_pattern) {
+		fprintf(stderr, "ERR: no content in rule file %s\n", rule_file);
+		goto out;
+	}
+	rules_trim(&ctx);
+
+	/* The nocase patterns a case-sensitive one keeps from being folded */
+	conflict = malloc(rules->n_pattern + 1);
+	if (!conflict)
+		goto out;
+	n_conflict = str2dfa_nocase_conflicts(rules->pattern_data,
+										  rules->pattern_offset,
+										  rules->n_pattern,
+										  rules->pattern_nocase, conflict);
+	if (n_conflict < 0)
+		goto out;
+	if (n_conflict) {
+		if (rules_expand(rules, conflict, &expanded, &ctx.n_approx) < 0)
+			goto out;
+		rules_free(rules);
+		*rules = expanded;
+	}
+	printf("Total %ld rules with %ld contents in %s, %ld rules skipped, "
+		   "%ld negated contents\n", ctx.n_rule, ctx.n_content, rule_file,
+		   ctx.n_skipped, ctx.n_negated);
+	printf("%ld patterns: %ld nocase contents (%ld in their cases, %ld of "
+		   "them with more than %d letters in 3 cases), %ld with offset or "
+		   "depth, %d port group rules\n", rules->n_pattern, ctx.n_nocase,
+		   n_conflict, ctx.n_approx, RULES_NOCASE_LETTERS_MAX, ctx.n_limited,
+		   rules->n_group_rule);
+	err = 0;
+
+out:
+	if (err)
+		rules_free(rules);
+	free(conflict);
+	free(line);
+	free(rule);
+	fclose(fp);
+	return err;
+}
+
+void
+rules_free(struct rules *rules) {
+	free(rules->pattern_offset);
+	free(rules->pattern_data);
+	free(rules->pattern_limit);
+	free(rules->pattern_nocase);
+	free(rules->group_rule);
+	memset(rules, 0, sizeof(*rules));
+}
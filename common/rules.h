@@ -0,0 +1,53 @@
+/*************************************************************************
+	> File Name: rules.h
+	> Description: Snort rule files, the contents of the rules turned into
+	> patterns with their offset and depth, and the port groups of the
+	> rule headers
+ ************************************************************************/
+
+#ifndef _RULES_H
+#define _RULES_H
+
+#include <stdint.h>
+#include "str2dfa.h"
+#include "portgroup.h"
+
+/* Rules on more destination ports than this are inspected on every port */
+#define RULES_PORT_SPAN_MAX 256
+/* A nocase content that can't be folded into the DFA gives a pattern for
+ * each case of its letters if it has up to this many, or else its lower,
+ * upper and written case
+ */
+#define RULES_NOCASE_LETTERS_MAX 6
+
+/* The patterns of a rule file, laid out like the pattern-ID table of
+ * struct str2dfa_dense, and the port group rules of their headers
+ */
+struct rules {
+	long n_pattern;
+	uint32_t *pattern_offset;
+	unsigned char *pattern_data;
+	struct str2dfa_limit *pattern_limit;	/* NULL if no content has any */
+	unsigned char *pattern_nocase;	/* NULL if no pattern is nocase */
+	struct port_group_rule *group_rule;
+	int n_group_rule;
+};
+
+/* Whether a pattern file is a Snort rule file, by its .rules suffix */
+int rules_file(const char *file);
+
+/* Read the contents of the alert, drop, etc. rules of a Snort 2 or 3 rule
+ * file, with their |hex| bytes, nocase, offset and depth. Contents that
+ * are negated and rules that can't match a TCP or UDP payload are skipped.
+ * A nocase content is one nocase pattern, unless a case-sensitive one
+ * keeps it from being folded (see str2dfa_nocase_conflicts()), then it is
+ * given in its cases. Return 0, or -1 on error.
+ */
+int rules_fromfile(const char *rule_file, struct rules *rules);
+/* States of the DFA of the rules with every nocase pattern given in its
+ * cases instead, to tell what folding saves. Return -1 on error.
+ */
+long rules_expanded_states(const struct rules *rules);
+void rules_free(struct rules *rules);
+
+#endif
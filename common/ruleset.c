@@ -0,0 +1,302 @@
+/*************************************************************************
+	> File Name: ruleset.c
+	> Description: Precompiled ruleset, the dense DFA of str2dfa saved in
+	> a versioned file that is mmap-ed back at start
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ruleset.h"
+
+#define RULESET_ALIGN(len) (((len) + 7) & ~(uint64_t)7)
+
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
+#define FNV1A_64_PRIME 0x100000001b3ULL
+
+static uint64_t
+fnv1a_64(uint64_t hash, const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV1A_64_PRIME;
+	}
+	return hash;
+}
+
+static int
+fnv1a_64_file(uint64_t *hash, const char *file) {
+	unsigned char buf[65536];
+	size_t len;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return -1;
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+		*hash = fnv1a_64(*hash, buf, len);
+	if (ferror(fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+int
+ruleset_hash(const char *pattern_file, const char *group_file,
+			 const char *options, uint64_t *hash) {
+	uint32_t version = RULESET_VERSION;
+
+	*hash = fnv1a_64(FNV1A_64_INIT, &version, sizeof(version));
+	*hash = fnv1a_64(*hash, options, strlen(options) + 1);
+	if (fnv1a_64_file(hash, pattern_file) < 0)
+		return -1;
+	/* Tell the end of the patterns from the start of the groups */
+	*hash = fnv1a_64(*hash, "", 1);
+	if (group_file && fnv1a_64_file(hash, group_file) < 0)
+		return -1;
+	return 0;
+}
+
+static int
+write_section(FILE *fp, const void *buf, uint64_t len) {
+	static const char zero[8];
+
+	if (len && fwrite(buf, 1, len, fp) != len)
+		return -1;
+	if (RULESET_ALIGN(len) != len &&
+		fwrite(zero, 1, RULESET_ALIGN(len) - len, fp) !=
+		RULESET_ALIGN(len) - len)
+		return -1;
+	return 0;
+}
+
+/* Write to a temporary file and rename it, so that a concurrent reader
+ * never maps a partial ruleset
+ */
+int
+ruleset_write(const char *path, const struct str2dfa_dense *dfa,
+			  const struct port_groups *groups,
+			  const unsigned char *short_member, uint64_t hash) {
+	struct ruleset_header header;
+	char tmp_path[4096];
+	uint64_t table_len, offset_len, next_len, group_len = 0, short_len = 0;
+	uint64_t limit_len = 0, nocase_len = 0;
+	long i;
+	FILE *fp;
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid()) >=
+		(int)sizeof(tmp_path))
+		return -1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RULESET_MAGIC, sizeof(header.magic));
+	header.version = RULESET_VERSION;
+	header.header_len = sizeof(header);
+	header.hash = hash;
+	header.n_state = dfa->n_state;
+	header.n_class = dfa->n_class;
+	header.n_pattern = dfa->n_pattern;
+	memcpy(header.byte_class, dfa->byte_class, sizeof(header.byte_class));
+
+	table_len = sizeof(struct str2dfa_trans) * dfa->n_state * dfa->n_class;
+	offset_len = sizeof(uint32_t) * (dfa->n_pattern + 1);
+	next_len = sizeof(uint16_t) * (dfa->n_pattern + 1);
+	header.table_offset = RULESET_ALIGN(sizeof(header));
+	header.pattern_offset_offset = header.table_offset +
+		RULESET_ALIGN(table_len);
+	header.pattern_next_offset = header.pattern_offset_offset +
+		RULESET_ALIGN(offset_len);
+	header.pattern_data_offset = header.pattern_next_offset +
+		RULESET_ALIGN(next_len);
+	header.pattern_data_len = dfa->pattern_offset[dfa->n_pattern];
+	header.port_group_offset = header.pattern_data_offset +
+		RULESET_ALIGN(header.pattern_data_len);
+	if (groups) {
+		header.n_port_group = groups->n_group;
+		header.n_port_entry = groups->n_entry;
+		group_len = sizeof(struct port_group_entry) * groups->n_entry;
+		header.any_depth = groups->any_depth;
+	}
+	header.short_member_offset = header.port_group_offset +
+		RULESET_ALIGN(group_len);
+	for (i = 1; short_member && i <= dfa->n_pattern; i++)
+		header.n_short += !!short_member[i];
+	if (header.n_short)
+		short_len = dfa->n_pattern + 1;
+	header.pattern_limit_offset = header.short_member_offset +
+		RULESET_ALIGN(short_len);
+	if (dfa->pattern_limit) {
+		header.has_limit = 1;
+		limit_len = sizeof(struct str2dfa_limit) * (dfa->n_pattern + 1);
+	}
+	header.pattern_nocase_offset = header.pattern_limit_offset +
+		RULESET_ALIGN(limit_len);
+	if (dfa->pattern_nocase) {
+		header.has_nocase = 1;
+		nocase_len = dfa->n_pattern + 1;
+	}
+	header.file_len = header.pattern_nocase_offset + RULESET_ALIGN(nocase_len);
+
+	fp = fopen(tmp_path, "w");
+	if (!fp)
+		return -1;
+	if (write_section(fp, &header, sizeof(header)) < 0 ||
+		write_section(fp, dfa->table, table_len) < 0 ||
+		write_section(fp, dfa->pattern_offset, offset_len) < 0 ||
+		write_section(fp, dfa->pattern_next, next_len) < 0 ||
+		write_section(fp, dfa->pattern_data, header.pattern_data_len) < 0 ||
+		(groups && write_section(fp, groups->entry, group_len) < 0) ||
+		(short_len && write_section(fp, short_member, short_len) < 0) ||
+		(limit_len && write_section(fp, dfa->pattern_limit, limit_len) < 0) ||
+		(nocase_len && write_section(fp, dfa->pattern_nocase, nocase_len) < 0) ||
+		fclose(fp) != 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	if (rename(tmp_path, path) < 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+ruleset_check(const struct ruleset_header *header, size_t len) {
+	uint64_t table_len, offset_len, next_len, group_len, short_len;
+	uint64_t limit_len, nocase_len;
+	int i;
+
+	if (len < sizeof(*header) ||
+		memcmp(header->magic, RULESET_MAGIC, sizeof(header->magic)) ||
+		header->version != RULESET_VERSION ||
+		header->header_len != sizeof(*header) ||
+		header->file_len != len)
+		return -1;
+	if (!header->n_state || !header->n_class ||
+		header->n_class > STR2DFA_ALPHABET ||
+		header->n_state > UINT32_MAX / header->n_class)
+		return -1;
+	for (i = 0; i < STR2DFA_ALPHABET; i++)
+		if (header->byte_class[i] >= header->n_class)
+			return -1;
+
+	table_len = sizeof(struct str2dfa_trans) * header->n_state *
+		header->n_class;
+	offset_len = sizeof(uint32_t) * ((uint64_t)header->n_pattern + 1);
+	next_len = sizeof(uint16_t) * ((uint64_t)header->n_pattern + 1);
+	group_len = sizeof(struct port_group_entry) * header->n_port_entry;
+	short_len = header->n_short ? (uint64_t)header->n_pattern + 1 : 0;
+	limit_len = header->has_limit ? sizeof(struct str2dfa_limit) *
+		((uint64_t)header->n_pattern + 1) : 0;
+	nocase_len = header->has_nocase ? (uint64_t)header->n_pattern + 1 : 0;
+	if (header->n_pattern > UINT16_MAX ||
+		header->n_port_entry > PORT_GROUP_ENTRY_MAX ||
+		header->table_offset != RULESET_ALIGN(sizeof(*header)) ||
+		header->pattern_offset_offset !=
+		header->table_offset + RULESET_ALIGN(table_len) ||
+		header->pattern_next_offset !=
+		header->pattern_offset_offset + RULESET_ALIGN(offset_len) ||
+		header->pattern_data_offset !=
+		header->pattern_next_offset + RULESET_ALIGN(next_len) ||
+		header->port_group_offset !=
+		header->pattern_data_offset + RULESET_ALIGN(header->pattern_data_len) ||
+		header->n_short > header->n_pattern ||
+		header->any_depth > UINT16_MAX ||
+		header->short_member_offset !=
+		header->port_group_offset + RULESET_ALIGN(group_len) ||
+		header->pattern_limit_offset !=
+		header->short_member_offset + RULESET_ALIGN(short_len) ||
+		header->pattern_nocase_offset !=
+		header->pattern_limit_offset + RULESET_ALIGN(limit_len) ||
+		header->file_len !=
+		header->pattern_nocase_offset + RULESET_ALIGN(nocase_len))
+		return -1;
+	return 0;
+}
+
+int
+ruleset_map(const char *path, struct ruleset *rs) {
+	const struct ruleset_header *header;
+	struct stat st;
+	uint32_t i;
+	int fd;
+
+	memset(rs, 0, sizeof(*rs));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		return -1;
+	}
+	rs->len = st.st_size;
+	rs->addr = mmap(NULL, rs->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (rs->addr == MAP_FAILED) {
+		rs->addr = NULL;
+		return -1;
+	}
+
+	header = rs->addr;
+	if (ruleset_check(header, rs->len) < 0) {
+		ruleset_unmap(rs);
+		errno = EINVAL;
+		return -1;
+	}
+	rs->hash = header->hash;
+	rs->dfa.n_state = header->n_state;
+	rs->dfa.n_pattern = header->n_pattern;
+	rs->dfa.n_class = header->n_class;
+	memcpy(rs->dfa.byte_class, header->byte_class,
+		   sizeof(rs->dfa.byte_class));
+	rs->dfa.table = (struct str2dfa_trans *)
+		((char *)rs->addr + header->table_offset);
+	rs->dfa.pattern_offset = (uint32_t *)
+		((char *)rs->addr + header->pattern_offset_offset);
+	rs->dfa.pattern_next = (uint16_t *)
+		((char *)rs->addr + header->pattern_next_offset);
+	rs->dfa.pattern_data = (unsigned char *)rs->addr +
+		header->pattern_data_offset;
+	rs->groups.n_group = header->n_port_group;
+	rs->groups.n_entry = header->n_port_entry;
+	rs->groups.entry = (struct port_group_entry *)
+		((char *)rs->addr + header->port_group_offset);
+	rs->groups.any_depth = header->any_depth;
+	if (header->has_limit)
+		rs->dfa.pattern_limit = (struct str2dfa_limit *)
+			((char *)rs->addr + header->pattern_limit_offset);
+	if (header->has_nocase)
+		rs->dfa.pattern_nocase = (unsigned char *)rs->addr +
+			header->pattern_nocase_offset;
+	if (header->n_short)
+		rs->short_member = (unsigned char *)rs->addr +
+			header->short_member_offset;
+	for (i = 0; i < rs->groups.n_entry; i++) {
+		if (rs->groups.entry[i].root >= rs->dfa.n_state)
+			break;
+	}
+	if (i < rs->groups.n_entry ||
+		rs->dfa.pattern_offset[rs->dfa.n_pattern] !=
+		header->pattern_data_len) {
+		ruleset_unmap(rs);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+ruleset_unmap(struct ruleset *rs) {
+	if (rs->addr)
+		munmap(rs->addr, rs->len);
+	memset(rs, 0, sizeof(*rs));
+}
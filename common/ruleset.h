@@ -0,0 +1,90 @@
+/*************************************************************************
+	> File Name: ruleset.h
+	> Description: Precompiled ruleset, the dense DFA of str2dfa saved in
+	> a versioned file that is mmap-ed back at start
+ ************************************************************************/
+
+#ifndef _RULESET_H
+#define _RULESET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "str2dfa.h"
+#include "portgroup.h"
+
+#define RULESET_MAGIC "IDSRULES"
+#define RULESET_VERSION 6
+
+/* Layout of a ruleset file, every section starts 8-byte aligned:
+ *   struct ruleset_header
+ *   table          n_state * n_class struct str2dfa_trans
+ *   pattern_offset (n_pattern + 1) uint32_t
+ *   pattern_next   (n_pattern + 1) uint16_t
+ *   pattern_data   pattern_data_len bytes
+ *   port_group     n_port_entry struct port_group_entry
+ *   short_member   (n_pattern + 1) bytes if n_short, 1 for the patterns
+ *                  left out of the table for the short pattern matcher
+ *   pattern_limit  (n_pattern + 1) struct str2dfa_limit if has_limit
+ *   pattern_nocase (n_pattern + 1) bytes if has_nocase, 1 for the
+ *                  patterns folded into the table
+ * All fields are in host byte order, the file is not portable across
+ * endianness.
+ */
+struct ruleset_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_len;
+	uint64_t hash;			/* ruleset_hash() of the source */
+	uint64_t n_state;
+	uint32_t n_class;
+	uint32_t n_pattern;
+	uint64_t table_offset;
+	uint64_t pattern_offset_offset;
+	uint64_t pattern_next_offset;
+	uint64_t pattern_data_offset;
+	uint64_t pattern_data_len;
+	uint32_t n_port_group;
+	uint32_t n_port_entry;
+	uint64_t port_group_offset;
+	uint32_t n_short;
+	uint32_t padding;
+	uint64_t short_member_offset;
+	uint32_t any_depth;		/* port_groups.any_depth */
+	uint32_t has_limit;
+	uint64_t pattern_limit_offset;
+	uint32_t has_nocase;
+	uint32_t padding2;
+	uint64_t pattern_nocase_offset;
+	uint64_t file_len;
+	uint8_t byte_class[STR2DFA_ALPHABET];
+};
+
+/* A mapped ruleset, dfa and groups point into the mapping and must not be
+ * freed with str2dfa_dense_free or port_groups_free. short_member is NULL
+ * without short patterns.
+ */
+struct ruleset {
+	void *addr;
+	size_t len;
+	uint64_t hash;
+	struct str2dfa_dense dfa;
+	struct port_groups groups;
+	const unsigned char *short_member;
+};
+
+/* Hash of the pattern file, the port group file if any and the build
+ * options, the key of the cache
+ */
+int ruleset_hash(const char *pattern_file, const char *group_file,
+				 const char *options, uint64_t *hash);
+
+/* groups is NULL for a ruleset without port groups, short_member NULL
+ * without short patterns
+ */
+int ruleset_write(const char *path, const struct str2dfa_dense *dfa,
+				  const struct port_groups *groups,
+				  const unsigned char *short_member, uint64_t hash);
+int ruleset_map(const char *path, struct ruleset *rs);
+void ruleset_unmap(struct ruleset *rs);
+
+#endif
@@ -0,0 +1,182 @@
+/*************************************************************************
+	> File Name: shortpat.c
+	> Description: Short patterns, matched apart from the DFA in a table
+	> indexed by the last two payload bytes
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shortpat.h"
+
+/* Put the pattern into a free way of each of its rows, keeping the rows
+ * longest first. Return 0, or -1 if a row is full.
+ */
+static int
+short_pattern_place(struct short_pattern_way *table,
+					const unsigned char *pattern, int len, uint16_t flag) {
+	struct short_pattern_way way, *row;
+	uint32_t first_row, last_row, r;
+	int i;
+
+	memset(&way, 0, sizeof(way));
+	way.flag = flag;
+	way.len = len;
+	if (len == 1) {
+		first_row = pattern[0];
+		last_row = 0xff00 | pattern[0];
+	} else {
+		first_row = last_row = pattern[len - 2] << 8 | pattern[len - 1];
+		if (len == 3)
+			way.prefix = pattern[0];
+		else if (len == 4)
+			way.prefix = pattern[0] << 8 | pattern[1];
+	}
+
+	for (r = first_row; r <= last_row; r += 0x100) {
+		row = table + (size_t)r * SHORT_PATTERN_WAYS;
+		if (row[SHORT_PATTERN_WAYS - 1].len)
+			return -1;
+		if (len != 1)
+			break;
+	}
+	for (r = first_row; r <= last_row; r += 0x100) {
+		row = table + (size_t)r * SHORT_PATTERN_WAYS;
+		for (i = SHORT_PATTERN_WAYS - 1; i > 0 && row[i - 1].len < len; i--)
+			row[i] = row[i - 1];
+		for (; i > 0 && !row[i - 1].len; i--)
+			;
+		row[i] = way;
+		if (len != 1)
+			break;
+	}
+	return 0;
+}
+
+long
+short_patterns_select(const struct str2dfa_dense *dfa, int max_len,
+					  const unsigned char *eligible, unsigned char *member) {
+	struct short_pattern_way *table;
+	long i, len, n_short = 0;
+
+	table = calloc((size_t)SHORT_PATTERN_ROWS * SHORT_PATTERN_WAYS,
+				   sizeof(*table));
+	if (!table)
+		return -1;
+	memset(member, 0, dfa->n_pattern + 1);
+	for (i = 1; i <= dfa->n_pattern; i++) {
+		len = dfa->pattern_offset[i] - dfa->pattern_offset[i - 1];
+		if (len == 0 || len >= max_len || len > SHORT_PATTERN_LEN_MAX ||
+			(eligible && !eligible[i]))
+			continue;
+		if (short_pattern_place(table, dfa->pattern_data +
+								dfa->pattern_offset[i - 1], len, i) == 0) {
+			member[i] = 1;
+			n_short++;
+		}
+	}
+	free(table);
+	return n_short;
+}
+
+int
+short_patterns_build(const struct str2dfa_dense *dfa,
+					 const unsigned char *member, struct short_patterns *sp) {
+	long i, len;
+
+	memset(sp, 0, sizeof(*sp));
+	sp->way = calloc((size_t)SHORT_PATTERN_ROWS * SHORT_PATTERN_WAYS,
+					 sizeof(*sp->way));
+	if (!sp->way)
+		return -1;
+	for (i = 1; i <= dfa->n_pattern; i++) {
+		if (!member[i])
+			continue;
+		len = dfa->pattern_offset[i] - dfa->pattern_offset[i - 1];
+		if (len < 1 || len > SHORT_PATTERN_LEN_MAX ||
+			short_pattern_place(sp->way, dfa->pattern_data +
+								dfa->pattern_offset[i - 1], len, i) < 0) {
+			fprintf(stderr, "ERR: pattern %ld does not fit in the short "
+					"pattern table\n", i);
+			short_patterns_free(sp);
+			return -1;
+		}
+		sp->n_short++;
+	}
+	return 0;
+}
+
+int
+short_patterns_unlink(struct str2dfa_dense *dfa, const unsigned char *member) {
+	uint16_t *next;
+	long i, link;
+
+	/* Walk the links as they were, not as already relinked */
+	next = malloc(sizeof(*next) * (dfa->n_pattern + 1));
+	if (!next)
+		return -1;
+	memcpy(next, dfa->pattern_next, sizeof(*next) * (dfa->n_pattern + 1));
+	for (i = 1; i <= dfa->n_pattern; i++) {
+		for (link = next[i]; link && !member[link] != !member[i];
+			 link = next[link])
+			;
+		dfa->pattern_next[i] = link;
+	}
+	free(next);
+	return 0;
+}
+
+/* Share of the transitions of the table that go to an accepting state,
+ * the hit rate of the DFA on uniformly random bytes
+ */
+static double
+short_patterns_hit_rate(const struct str2dfa_dense *dfa) {
+	long i, n_entry = dfa->n_state * dfa->n_class, n_hit = 0;
+
+	for (i = 0; i < n_entry; i++)
+		n_hit += dfa->table[i].flag > 0;
+	return n_entry ? 100.0 * n_hit / n_entry : 0;
+}
+
+int
+short_patterns_split(struct str2dfa_dense *dfa, const unsigned char *member) {
+	struct str2dfa_dense rest;
+	unsigned char *other;
+	long i, n_state = dfa->n_state, n_entry = dfa->n_state * dfa->n_class;
+	double hit_rate = short_patterns_hit_rate(dfa);
+
+	other = malloc(dfa->n_pattern + 1);
+	if (!other)
+		return -1;
+	for (i = 0; i <= dfa->n_pattern; i++)
+		other[i] = i && !member[i];
+	if (str2dfa_dense_subset(dfa, other, &rest) < 0) {
+		free(other);
+		return -1;
+	}
+	free(other);
+
+	free(dfa->table);
+	dfa->table = rest.table;
+	rest.table = NULL;
+	dfa->n_state = rest.n_state;
+	dfa->n_class = rest.n_class;
+	memcpy(dfa->byte_class, rest.byte_class, sizeof(dfa->byte_class));
+	str2dfa_dense_free(&rest);
+	if (short_patterns_unlink(dfa, member) < 0)
+		return -1;
+
+	printf("Main DFA without the short patterns: %ld states instead of %ld, "
+		   "%ld entries instead of %ld (%.1f%% smaller)\n", dfa->n_state,
+		   n_state, dfa->n_state * dfa->n_class, n_entry,
+		   100.0 - 100.0 * dfa->n_state * dfa->n_class / n_entry);
+	printf("%.3f%% of its transitions hit a pattern instead of %.3f%%\n",
+		   short_patterns_hit_rate(dfa), hit_rate);
+	return 0;
+}
+
+void
+short_patterns_free(struct short_patterns *sp) {
+	free(sp->way);
+	memset(sp, 0, sizeof(*sp));
+}
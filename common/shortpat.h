@@ -0,0 +1,59 @@
+/*************************************************************************
+	> File Name: shortpat.h
+	> Description: Short patterns, matched apart from the DFA in a table
+	> indexed by the last two payload bytes
+ ************************************************************************/
+
+#ifndef _SHORTPAT_H
+#define _SHORTPAT_H
+
+#include <stdint.h>
+#include "str2dfa.h"
+
+/* Longest short pattern, and rows and ways of the table */
+#define SHORT_PATTERN_LEN_MAX 4
+#define SHORT_PATTERN_ROWS (1 << 16)
+#define SHORT_PATTERN_WAYS 4
+
+/* A short pattern ending with the two bytes of its row. prefix holds the
+ * bytes before them, for patterns of 3 or 4 bytes.
+ */
+struct short_pattern_way {
+	uint16_t prefix;
+	uint16_t flag;		/* 1-based pattern ID */
+	uint8_t len;		/* 0 for a free way */
+	uint8_t padding[3];
+};
+
+/* Row b0 << 8 | b1 holds the patterns ending with bytes b0 b1, longest
+ * first. A pattern of one byte is in the 256 rows ending with it.
+ */
+struct short_patterns {
+	long n_short;
+	struct short_pattern_way *way;	/* SHORT_PATTERN_ROWS * WAYS */
+};
+
+/* Mark in member the eligible patterns (all if eligible is NULL) shorter
+ * than max_len bytes, as many as fit in the table. Return their number,
+ * or -1 on error.
+ */
+long short_patterns_select(const struct str2dfa_dense *dfa, int max_len,
+						   const unsigned char *eligible,
+						   unsigned char *member);
+/* Lay the member patterns out in the table. Return 0, or -1 on error. */
+int short_patterns_build(const struct str2dfa_dense *dfa,
+						 const unsigned char *member,
+						 struct short_patterns *sp);
+/* Output links only between patterns on the same side, so each side
+ * reports the patterns it holds once. Return 0, or -1 on error.
+ */
+int short_patterns_unlink(struct str2dfa_dense *dfa,
+						   const unsigned char *member);
+/* Replace the table of dfa with the DFA of the other patterns, and unlink
+ * the two sides. Return 0, or -1 on error.
+ */
+int short_patterns_split(struct str2dfa_dense *dfa,
+						 const unsigned char *member);
+void short_patterns_free(struct short_patterns *sp);
+
+#endif
@@ -6,171 +6,967 @@
  ************************************************************************/
 
 #include <stdio.h>
-#include <Python.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #include "str2dfa.h"
 
-int
-str2dfa(char **pattern_list, int pattern_list_len, struct str2dfa_kv **result) {
-	PyObject *pName, *pModule, *pFunc, *pArgs, *pReturn;
-	int i_pattern, i_entry, n_entry;
-
-	Py_Initialize();
-	PyRun_SimpleString("import sys\n");
-	PyRun_SimpleString("sys.path.append('common')\n");
-
-	pName = PyString_FromString("str2dfa");
-	/* Error checking of pName left out */
-
-	pModule = PyImport_Import(pName);
-	Py_DECREF(pName);
-
-	if (pModule != NULL) {
-		pFunc = PyObject_GetAttrString(pModule, "str2dfa");
-		/* pFunc is a new reference */
-
-		if (pFunc && PyCallable_Check(pFunc)) {
-			pArgs = PyTuple_New(1);
-			PyObject *pPatternList, *pPattern;
-			pPatternList = PyList_New(0);
-			if (!pPatternList) {
-				Py_DECREF(pArgs);
-				Py_DECREF(pModule);
-				fprintf(stderr, "Cannot convert argument\n");
-				return -1;
-			}
-			for (i_pattern = 0; i_pattern < pattern_list_len; i_pattern++) {
-				pPattern = PyString_FromString(pattern_list[i_pattern]);
-				if (!pPattern) {
-					Py_DECREF(pArgs);
-					Py_DECREF(pModule);
-					fprintf(stderr, "Cannot convert argument\n");
+/* Aho-Corasick automaton. The goto function is a trie whose children are
+ * kept in sibling lists, the failure links form a tree rooted at state 0.
+ */
+struct ac_automaton {
+	long n_node;
+	long max_node;
+	long *child;		/* First child in the trie */
+	long *sibling;		/* Next child of the same parent */
+	unsigned char *label;	/* Byte of the trie edge into the node */
+	/* The edge into the node also takes the upper case of its label, a
+	 * lower case letter. It is split into one edge per case where the
+	 * automaton tells them apart.
+	 */
+	unsigned char *folded;
+	long *fail;		/* Failure link */
+	long *flag;		/* Pattern found when reaching the node, 0 if none */
+	long *fchild;		/* First child in the failure tree */
+	long *fsibling;		/* Next child in the failure tree */
+	long *state;		/* State ID of the node in the DFA */
+	/* Output link of pattern i: the next pattern found at the node where
+	 * pattern i ends, 0 at the end of the list
+	 */
+	long *pattern_next;
+	long next_max;
+	/* Bytes of pattern i (1-based) are pattern_data[pattern_offset[i - 1]]
+	 * up to pattern_data[pattern_offset[i]]
+	 */
+	unsigned char *pattern_data;
+	uint32_t *pattern_offset;
+	size_t pattern_data_max;
+	long pattern_max;
+};
+
+static void
+ac_free(struct ac_automaton *ac) {
+	free(ac->child);
+	free(ac->sibling);
+	free(ac->label);
+	free(ac->folded);
+	free(ac->fail);
+	free(ac->flag);
+	free(ac->fchild);
+	free(ac->fsibling);
+	free(ac->state);
+	free(ac->pattern_next);
+	free(ac->pattern_data);
+	free(ac->pattern_offset);
+	memset(ac, 0, sizeof(*ac));
+}
+
+static int
+ac_grow(struct ac_automaton *ac) {
+	long max_node = ac->max_node ? ac->max_node * 2 : 1024;
+
+	ac->child = realloc(ac->child, sizeof(long) * max_node);
+	ac->sibling = realloc(ac->sibling, sizeof(long) * max_node);
+	ac->label = realloc(ac->label, max_node);
+	ac->folded = realloc(ac->folded, max_node);
+	ac->flag = realloc(ac->flag, sizeof(long) * max_node);
+	if (!ac->child || !ac->sibling || !ac->label || !ac->folded ||
+		!ac->flag)
+		return -1;
+	ac->max_node = max_node;
+	return 0;
+}
+
+static long
+ac_new_node(struct ac_automaton *ac, unsigned char label) {
+	long node;
+
+	if (ac->n_node == ac->max_node && ac_grow(ac) < 0)
+		return -1;
+	node = ac->n_node++;
+	ac->child[node] = -1;
+	ac->sibling[node] = -1;
+	ac->label[node] = label;
+	ac->folded[node] = 0;
+	ac->flag[node] = 0;
+	return node;
+}
+
+static void
+ac_link_child(struct ac_automaton *ac, long node, long child) {
+	ac->sibling[child] = ac->child[node];
+	ac->child[node] = child;
+}
+
+static long
+ac_add_child(struct ac_automaton *ac, long node, unsigned char label,
+			 int folded) {
+	long child = ac_new_node(ac, label);
+
+	if (child < 0)
+		return -1;
+	ac->folded[child] = folded;
+	ac_link_child(ac, node, child);
+	return child;
+}
+
+static long
+ac_goto(struct ac_automaton *ac, long node, unsigned char unit) {
+	long next;
+
+	for (next = ac->child[node]; next >= 0; next = ac->sibling[next]) {
+		if (ac->label[next] ==
+			(ac->folded[next] ? str2dfa_fold(unit) : unit))
+			return next;
+	}
+	return -1;
+}
+
+/* The child of node by an edge of the given label, folded or not */
+static long
+ac_edge(struct ac_automaton *ac, long node, unsigned char label,
+		int folded) {
+	long next;
+
+	for (next = ac->child[node]; next >= 0; next = ac->sibling[next]) {
+		if (ac->label[next] == label && ac->folded[next] == folded)
+			return next;
+	}
+	return -1;
+}
+
+/* Copy the subtree of node, with the patterns ending in it, under a new
+ * edge of the given label. The copy is not linked to a parent yet. Return
+ * it, or -1 on error.
+ */
+static long
+ac_clone(struct ac_automaton *ac, long node, unsigned char label) {
+	long copy, child, child_copy;
+
+	copy = ac_new_node(ac, label);
+	if (copy < 0)
+		return -1;
+	ac->flag[copy] = ac->flag[node];
+	for (child = ac->child[node]; child >= 0; child = ac->sibling[child]) {
+		child_copy = ac_clone(ac, child, ac->label[child]);
+		if (child_copy < 0)
+			return -1;
+		ac->folded[child_copy] = ac->folded[child];
+		ac_link_child(ac, copy, child_copy);
+	}
+	return copy;
+}
+
+/* Insert the pattern from node on. A letter of a nocase pattern takes a
+ * folded edge, or the edges of both cases where other patterns already
+ * tell them apart. A letter of another pattern splits a folded edge.
+ * Return 0, or -1 on error.
+ */
+static int
+ac_insert(struct ac_automaton *ac, long node, const unsigned char *pattern,
+		  long len, int nocase, long pattern_id) {
+	long i, next, lower, upper, folded;
+	unsigned char unit;
+
+	for (i = 0; i < len; i++) {
+		unit = pattern[i];
+		if (nocase && str2dfa_letter(unit)) {
+			unit = str2dfa_fold(unit);
+			next = ac_edge(ac, node, unit, 1);
+			lower = ac_edge(ac, node, unit, 0);
+			upper = ac_edge(ac, node, unit ^ 0x20, 0);
+			if (next < 0 && (lower >= 0 || upper >= 0)) {
+				if (lower < 0)
+					lower = ac_add_child(ac, node, unit, 0);
+				if (upper < 0)
+					upper = ac_add_child(ac, node, unit ^ 0x20, 0);
+				if (lower < 0 || upper < 0 ||
+					ac_insert(ac, lower, pattern + i + 1, len - i - 1,
+							  nocase, pattern_id) < 0)
 					return -1;
-				}
-				PyList_Insert(pPatternList, i_pattern, pPattern);
+				return ac_insert(ac, upper, pattern + i + 1, len - i - 1,
+								 nocase, pattern_id);
+			}
+			if (next < 0)
+				next = ac_add_child(ac, node, unit, 1);
+		} else {
+			next = ac_edge(ac, node, unit, 0);
+			folded = next < 0 && str2dfa_letter(unit) ?
+				ac_edge(ac, node, str2dfa_fold(unit), 1) : -1;
+			if (folded >= 0) {
+				ac->folded[folded] = 0;
+				ac->label[folded] = unit ^ 0x20;
+				next = ac_clone(ac, folded, unit);
+				if (next >= 0)
+					ac_link_child(ac, node, next);
+			} else if (next < 0) {
+				next = ac_add_child(ac, node, unit, 0);
 			}
-			PyTuple_SetItem(pArgs, 0, pPatternList);
-			pReturn = PyObject_CallObject(pFunc, pArgs);
-			Py_DECREF(pArgs);
-			if (pReturn != NULL) {
-				PyObject *pKey, *pValue, *pEntry;
-				n_entry = PyList_Size(pReturn);
-				struct str2dfa_kv *entries = (struct str2dfa_kv *)
-					malloc(sizeof(struct str2dfa_kv) * n_entry);
-				for (i_entry = 0; i_entry < n_entry; i_entry++) {
-					pEntry = PyList_GetItem(pReturn, i_entry);
-					pKey = PyTuple_GetItem(pEntry, 0);
-					pValue = PyTuple_GetItem(pEntry, 1);
-					entries[i_entry].key_state =
-						PyInt_AsLong(PyTuple_GetItem(pKey, 0));
-					entries[i_entry].key_unit =
-						(PyString_AsString(PyTuple_GetItem(pKey, 1)))[0];
-					entries[i_entry].value_state =
-						PyInt_AsLong(PyTuple_GetItem(pValue, 0));
-					entries[i_entry].value_flag =
-						PyInt_AsLong(PyTuple_GetItem(pValue, 1));
+		}
+		if (next < 0)
+			return -1;
+		node = next;
+	}
+	if (!ac->flag[node]) {
+		ac->flag[node] = pattern_id;
+		return 0;
+	}
+	/* A nocase pattern seen before may end at more nodes */
+	for (i = ac->flag[node]; i != pattern_id && ac->pattern_next[i];
+		 i = ac->pattern_next[i])
+		;
+	if (i != pattern_id)
+		ac->pattern_next[i] = pattern_id;
+	return 0;
+}
+
+/* Insert one pattern into the trie, a pattern seen before keeps its ID
+ * and the new ID is linked after it
+ */
+static int
+ac_add(struct ac_automaton *ac, const unsigned char *pattern, long len,
+	   int nocase, long pattern_id) {
+	long next_max;
+	long *p;
+
+	if (pattern_id >= ac->next_max) {
+		next_max = ac->next_max ? ac->next_max * 2 : 1024;
+		while (pattern_id >= next_max)
+			next_max *= 2;
+		p = realloc(ac->pattern_next, sizeof(long) * next_max);
+		if (!p)
+			return -1;
+		memset(p + ac->next_max, 0, sizeof(long) * (next_max - ac->next_max));
+		ac->pattern_next = p;
+		ac->next_max = next_max;
+	}
+	return ac_insert(ac, 0, pattern, len, nocase, pattern_id);
+}
+
+/* Node the automaton goes to from node on unit, following the failure
+ * links until some node has an edge for it
+ */
+static long
+ac_next(struct ac_automaton *ac, long node, unsigned char unit) {
+	long next;
+
+	while (node > 0 && ac_goto(ac, node, unit) < 0)
+		node = ac->fail[node];
+	next = ac_goto(ac, node, unit);
+	return next < 0 ? 0 : next;
+}
+
+/* Make room in the failure tree and the queue for the nodes ac_clone adds
+ * while the failure links are built
+ */
+static int
+ac_build_grow(struct ac_automaton *ac, long *max_node, long **queue) {
+	long node;
+
+	if (ac->n_node <= *max_node)
+		return 0;
+	ac->fail = realloc(ac->fail, sizeof(long) * ac->max_node);
+	ac->fchild = realloc(ac->fchild, sizeof(long) * ac->max_node);
+	ac->fsibling = realloc(ac->fsibling, sizeof(long) * ac->max_node);
+	*queue = realloc(*queue, sizeof(long) * ac->max_node);
+	if (!ac->fail || !ac->fchild || !ac->fsibling || !*queue)
+		return -1;
+	for (node = *max_node; node < ac->max_node; node++) {
+		ac->fchild[node] = -1;
+		ac->fsibling[node] = -1;
+	}
+	*max_node = ac->max_node;
+	return 0;
+}
+
+/* Compute the failure links in BFS order. A node that ends no pattern
+ * reports the pattern of its failure link, so a pattern ending inside a
+ * longer one is still found. The patterns of a node that ends some are
+ * linked to those of its failure link, so walking the output links from
+ * the flag of a node lists every pattern found there.
+ *
+ * A folded edge whose two cases fail to different nodes is split, its
+ * subtree copied for the upper case: those are the states where the case
+ * matters. The edges of the shallower nodes are final by then, the nodes
+ * of a level are all done before the next one.
+ */
+static int
+ac_build(struct ac_automaton *ac) {
+	long *queue = NULL, head = 0, tail = 0, max_node = 0;
+	long node, next, f, copy, i;
+	unsigned char *linked;
+	int err = -1;
+
+	/* Whether the output link of a pattern is set, a nocase pattern may
+	 * end at more nodes
+	 */
+	linked = calloc(ac->next_max ? ac->next_max : 1, 1);
+	if (!linked || ac_build_grow(ac, &max_node, &queue) < 0)
+		goto out;
+
+	ac->fail[0] = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		node = queue[head++];
+		for (next = ac->child[node]; next >= 0; next = ac->sibling[next]) {
+			f = node ? ac_next(ac, ac->fail[node], ac->label[next]) : 0;
+			if (node && ac->folded[next] &&
+				ac_next(ac, ac->fail[node], ac->label[next] ^ 0x20) != f) {
+				copy = ac_clone(ac, next, ac->label[next] ^ 0x20);
+				if (copy < 0 || ac_build_grow(ac, &max_node, &queue) < 0)
+					goto out;
+				ac->folded[next] = 0;
+				ac->sibling[copy] = ac->sibling[next];
+				ac->sibling[next] = copy;
+			}
+			ac->fail[next] = f;
+			if (!ac->flag[next]) {
+				ac->flag[next] = ac->flag[f];
+			} else {
+				for (i = ac->flag[next]; !linked[i] && ac->pattern_next[i];
+					 i = ac->pattern_next[i])
+					;
+				if (linked[i] && ac->pattern_next[i] != ac->flag[f]) {
+					fprintf(stderr, "ERR: pattern %ld is found with other "
+							"patterns in each case\n", i);
+					goto out;
 				}
-				*result = entries;
-				Py_DECREF(pKey);
-				Py_DECREF(pValue);
-				Py_DECREF(pEntry);
+				ac->pattern_next[i] = ac->flag[f];
+				linked[i] = 1;
 			}
-			else {
-				Py_DECREF(pFunc);
-				Py_DECREF(pModule);
-				PyErr_Print();
-				fprintf(stderr,"Call failed\n");
-				return -1;
+			ac->fsibling[next] = ac->fchild[f];
+			ac->fchild[f] = next;
+			queue[tail++] = next;
+		}
+	}
+	err = 0;
+
+out:
+	free(linked);
+	free(queue);
+	return err;
+}
+
+/* Next node of the failure tree in depth-first preorder, or -1 at the end.
+ * The parent of a node in the failure tree is its failure link.
+ */
+static long
+ac_dfs_next(struct ac_automaton *ac, long node, long *depth) {
+	if (ac->fchild[node] >= 0) {
+		(*depth)++;
+		return ac->fchild[node];
+	}
+	while (node > 0 && ac->fsibling[node] < 0) {
+		node = ac->fail[node];
+		(*depth)--;
+	}
+	if (node == 0)
+		return -1;
+	return ac->fsibling[node];
+}
+
+/* Number the states in depth-first preorder of the failure tree */
+static int
+ac_number(struct ac_automaton *ac) {
+	long node = 0, depth = 0, n_state = 0;
+
+	ac->state = malloc(sizeof(long) * ac->n_node);
+	if (!ac->state)
+		return -1;
+	do {
+		ac->state[node] = n_state++;
+	} while ((node = ac_dfs_next(ac, node, &depth)) >= 0);
+	return 0;
+}
+
+/* Called with the full row of every state, row[unit] being the node the
+ * state goes to on unit.
+ */
+typedef int (*ac_row_fn)(struct ac_automaton *ac, long node, const long *row,
+						 void *ctx);
+
+/* Walk the full transition function. The row of a node is the row of its
+ * failure link overridden by its own trie edges, and the failure tree is
+ * walked depth first, so only one row per level of the tree is kept. The
+ * rows come in the order of the state IDs. Return 0, or -1 on error.
+ */
+static int
+ac_closure(struct ac_automaton *ac, ac_row_fn fn, void *ctx) {
+	long *rows = NULL, *row;
+	long node = 0, depth = 0, max_depth = 0, next;
+	int err = 0;
+
+	do {
+		if (depth >= max_depth) {
+			max_depth = max_depth ? max_depth * 2 : 64;
+			row = realloc(rows, sizeof(long) * STR2DFA_ALPHABET * max_depth);
+			if (!row) {
+				err = -1;
+				break;
 			}
+			rows = row;
+		}
+		/* Rows hold node indexes, 0 (the root) being the default */
+		row = rows + depth * STR2DFA_ALPHABET;
+		if (depth == 0)
+			memset(row, 0, sizeof(long) * STR2DFA_ALPHABET);
+		else
+			memcpy(row, row - STR2DFA_ALPHABET,
+				   sizeof(long) * STR2DFA_ALPHABET);
+		for (next = ac->child[node]; next >= 0; next = ac->sibling[next]) {
+			row[ac->label[next]] = next;
+			if (ac->folded[next])
+				row[ac->label[next] ^ 0x20] = next;
 		}
-		else {
-			if (PyErr_Occurred())
-				PyErr_Print();
-				fprintf(stderr, "Cannot find function \"str2dfa\"\n");
+
+		err = fn(ac, node, row, ctx);
+		if (err)
+			break;
+	} while ((node = ac_dfs_next(ac, node, &depth)) >= 0);
+
+	free(rows);
+	return err;
+}
+
+struct ac_kv_ctx {
+	struct str2dfa_kv *result;	/* NULL to only count the entries */
+	long n_entry;
+};
+
+/* Transitions back to the root are left out, a missing entry means state 0 */
+static int
+ac_kv_row(struct ac_automaton *ac, long node, const long *row, void *ctx) {
+	struct ac_kv_ctx *kv = ctx;
+	struct str2dfa_kv *entry;
+	int unit;
+
+	for (unit = 0; unit < STR2DFA_ALPHABET; unit++) {
+		if (row[unit] == 0)
+			continue;
+		if (kv->result) {
+			entry = &kv->result[kv->n_entry];
+			entry->key_state = ac->state[node];
+			entry->key_unit = unit;
+			entry->value_state = ac->state[row[unit]];
+			entry->value_flag = ac->flag[row[unit]];
 		}
+		kv->n_entry++;
+	}
+	return 0;
+}
+
+static int
+ac_tokv(struct ac_automaton *ac, struct str2dfa_kv **result) {
+	struct ac_kv_ctx kv = { NULL, 0 };
+
+	if (ac_build(ac) < 0 || ac_number(ac) < 0) {
+		fprintf(stderr, "ERR: can't allocate the automaton\n");
+		return -1;
+	}
+
+	/* Count first, so the entries are allocated once */
+	if (ac_closure(ac, ac_kv_row, &kv) < 0 || kv.n_entry > INT_MAX) {
+		fprintf(stderr, "ERR: too many DFA entries\n");
+		return -1;
 	}
-	else {
-		PyErr_Print();
-		fprintf(stderr, "Failed to load \"str2dfa\"\n");
+	kv.result = malloc(sizeof(struct str2dfa_kv) * (kv.n_entry + 1));
+	kv.n_entry = 0;
+	if (!kv.result || ac_closure(ac, ac_kv_row, &kv) < 0) {
+		free(kv.result);
+		fprintf(stderr, "ERR: can't allocate the DFA entries\n");
 		return -1;
 	}
-	Py_Finalize();
+	*result = kv.result;
+	return kv.n_entry;
+}
+
+/* Keep the bytes of pattern n_pattern (1-based) for the pattern-ID table */
+static int
+ac_save_pattern(struct ac_automaton *ac, const char *pattern, size_t len,
+				long n_pattern) {
+	size_t data_len = ac->pattern_offset ? ac->pattern_offset[n_pattern - 1] : 0;
+	void *p;
+
+	if (n_pattern + 1 > ac->pattern_max) {
+		ac->pattern_max = ac->pattern_max ? ac->pattern_max * 2 : 1024;
+		p = realloc(ac->pattern_offset,
+					sizeof(*ac->pattern_offset) * ac->pattern_max);
+		if (!p)
+			return -1;
+		ac->pattern_offset = p;
+		ac->pattern_offset[0] = 0;
+	}
+	while (data_len + len > ac->pattern_data_max) {
+		ac->pattern_data_max = ac->pattern_data_max ?
+			ac->pattern_data_max * 2 : 65536;
+		p = realloc(ac->pattern_data, ac->pattern_data_max);
+		if (!p)
+			return -1;
+		ac->pattern_data = p;
+	}
+	if (data_len + len > UINT32_MAX)
+		return -1;
+	memcpy(ac->pattern_data + data_len, pattern, len);
+	ac->pattern_offset[n_pattern] = data_len + len;
+	return 0;
+}
+
+/* Read the patterns of a file, one per line, into the trie. Blank lines are
+ * skipped and do not take a pattern ID. Return the number of patterns, or
+ * -1 on error.
+ */
+static long
+ac_fromfile(struct ac_automaton *ac, const char *pattern_file) {
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	long n_pattern = 0;
+
+	if ((fp = fopen(pattern_file, "r")) == NULL) {
+		fprintf(stderr, "ERR: can not open pattern source file\n");
+		return -1;
+	}
+
+	if (ac_new_node(ac, 0) < 0)
+		n_pattern = -1;
+	while (n_pattern >= 0 && (len = getline(&line, &line_size, fp)) >= 0) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			len--;
+		if (len == 0)
+			continue;
+		n_pattern++;
+		if (ac_add(ac, (unsigned char *)line, len, 0, n_pattern) < 0 ||
+			ac_save_pattern(ac, line, len, n_pattern) < 0)
+			n_pattern = -1;
+	}
+	free(line);
+	fclose(fp);
+	if (n_pattern < 0) {
+		fprintf(stderr, "ERR: can't build the automaton of %s\n",
+				pattern_file);
+		return -1;
+	}
+	printf("Total %ld patterns fetched, %ld states\n", n_pattern, ac->n_node);
+	return n_pattern;
+}
+
+/* Build the DFA of the Aho-Corasick automaton over the patterns. Pattern i
+ * of the list gets flag i + 1. Return the number of entries, or -1 on
+ * error.
+ */
+int
+str2dfa(char **pattern_list, int pattern_list_len, struct str2dfa_kv **result) {
+	struct ac_automaton ac;
+	int i_pattern, n_entry = -1;
+
+	memset(&ac, 0, sizeof(ac));
+	if (ac_new_node(&ac, 0) < 0)
+		goto out;
+	for (i_pattern = 0; i_pattern < pattern_list_len; i_pattern++) {
+		if (ac_add(&ac, (unsigned char *)pattern_list[i_pattern],
+				   strlen(pattern_list[i_pattern]), 0, i_pattern + 1) < 0)
+			goto out;
+	}
+	n_entry = ac_tokv(&ac, result);
+
+out:
+	ac_free(&ac);
 	return n_entry;
 }
 
+/* Same as str2dfa(), but the patterns are read from a file */
 int
 str2dfa_fromfile(const char *pattern_file, struct str2dfa_kv **result) {
-	PyObject *pName, *pModule, *pFunc, *pArgs, *pReturn;
-	int i_pattern, i_entry, n_entry;
-
-	Py_Initialize();
-	PyRun_SimpleString("import sys\n");
-	PyRun_SimpleString("sys.path.append('common')\n");
-
-	pName = PyString_FromString("str2dfa");
-	/* Error checking of pName left out */
-
-	pModule = PyImport_Import(pName);
-	Py_DECREF(pName);
-
-	if (pModule != NULL) {
-		pFunc = PyObject_GetAttrString(pModule, "str2dfa");
-		/* pFunc is a new reference */
-
-		if (pFunc && PyCallable_Check(pFunc)) {
-			pArgs = PyTuple_New(1);
-			PyObject *pPatternList;
-			pPatternList = PyString_FromString(pattern_file);
-			if (!pPatternList) {
-				Py_DECREF(pArgs);
-				Py_DECREF(pModule);
-				fprintf(stderr, "Cannot convert argument\n");
-				return -1;
-			}
-			PyTuple_SetItem(pArgs, 0, pPatternList);
-			pReturn = PyObject_CallObject(pFunc, pArgs);
-			Py_DECREF(pArgs);
-			if (pReturn != NULL) {
-				PyObject *pKey, *pValue, *pEntry;
-				n_entry = PyList_Size(pReturn);
-				struct str2dfa_kv *entries = (struct str2dfa_kv *)
-					malloc(sizeof(struct str2dfa_kv) * n_entry);
-				for (i_entry = 0; i_entry < n_entry; i_entry++) {
-					pEntry = PyList_GetItem(pReturn, i_entry);
-					pKey = PyTuple_GetItem(pEntry, 0);
-					pValue = PyTuple_GetItem(pEntry, 1);
-					entries[i_entry].key_state =
-						PyInt_AsLong(PyTuple_GetItem(pKey, 0));
-					entries[i_entry].key_unit =
-						(PyString_AsString(PyTuple_GetItem(pKey, 1)))[0];
-					entries[i_entry].value_state =
-						PyInt_AsLong(PyTuple_GetItem(pValue, 0));
-					entries[i_entry].value_flag =
-						PyInt_AsLong(PyTuple_GetItem(pValue, 1));
-				}
-				*result = entries;
-				Py_DECREF(pKey);
-				Py_DECREF(pValue);
-				Py_DECREF(pEntry);
-			}
-			else {
-				Py_DECREF(pFunc);
-				Py_DECREF(pModule);
-				PyErr_Print();
-				fprintf(stderr,"Call failed\n");
-				return -1;
-			}
+	struct ac_automaton ac;
+	int n_entry = -1;
+
+	memset(&ac, 0, sizeof(ac));
+	if (ac_fromfile(&ac, pattern_file) >= 0)
+		n_entry = ac_tokv(&ac, result);
+	ac_free(&ac);
+	return n_entry;
+}
+
+/* Bytes that label no trie edge go to the same state from every state, so
+ * they share one class. Both cases of a letter that only labels folded
+ * edges share one too. Every other byte has a class of its own. Classes
+ * are numbered by their first byte.
+ */
+static void
+ac_byte_class(struct ac_automaton *ac, struct str2dfa_dense *dfa) {
+	unsigned char used[STR2DFA_ALPHABET], folded[STR2DFA_ALPHABET];
+	int unit, other_class = -1, fold_class[STR2DFA_ALPHABET];
+	long node;
+
+	memset(used, 0, sizeof(used));
+	memset(folded, 0, sizeof(folded));
+	memset(fold_class, -1, sizeof(fold_class));
+	for (node = 1; node < ac->n_node; node++) {
+		if (ac->folded[node])
+			folded[ac->label[node]] = 1;
+		else
+			used[ac->label[node]] = 1;
+	}
+
+	dfa->n_class = 0;
+	for (unit = 0; unit < STR2DFA_ALPHABET; unit++) {
+		if (folded[str2dfa_fold(unit)] && !used[str2dfa_fold(unit)] &&
+			!used[str2dfa_fold(unit) ^ 0x20]) {
+			if (fold_class[str2dfa_fold(unit)] < 0)
+				fold_class[str2dfa_fold(unit)] = dfa->n_class++;
+			dfa->byte_class[unit] = fold_class[str2dfa_fold(unit)];
+		} else if (used[unit] || folded[str2dfa_fold(unit)]) {
+			dfa->byte_class[unit] = dfa->n_class++;
+		} else {
+			if (other_class < 0)
+				other_class = dfa->n_class++;
+			dfa->byte_class[unit] = other_class;
+		}
+	}
+}
+
+struct ac_dense_ctx {
+	struct str2dfa_dense *dfa;
+	unsigned char class_byte[STR2DFA_ALPHABET];	/* A byte of each class */
+};
+
+static int
+ac_dense_row(struct ac_automaton *ac, long node, const long *row, void *ctx) {
+	struct ac_dense_ctx *dense = ctx;
+	struct str2dfa_dense *dfa = dense->dfa;
+	struct str2dfa_trans *trans;
+	long target;
+	int class;
+
+	trans = dfa->table + ac->state[node] * dfa->n_class;
+	for (class = 0; class < dfa->n_class; class++) {
+		target = row[dense->class_byte[class]];
+		trans[class].state = ac->state[target];
+		trans[class].flag = ac->flag[target];
+		trans[class].padding = 0;
+	}
+	return 0;
+}
+
+/* Build the dense table of the trie in ac, dfa->n_pattern being set.
+ * Return 0, or -1 on error.
+ */
+static int
+ac_dense(struct ac_automaton *ac, struct str2dfa_dense *dfa) {
+	struct ac_dense_ctx dense;
+	int unit;
+
+	if (dfa->n_pattern > UINT16_MAX || ac->n_node > UINT32_MAX) {
+		fprintf(stderr, "ERR: %ld patterns, %ld states are too many\n",
+				dfa->n_pattern, ac->n_node);
+		return -1;
+	}
+	if (ac_build(ac) < 0 || ac_number(ac) < 0)
+		return -1;
+
+	ac_byte_class(ac, dfa);
+	for (unit = STR2DFA_ALPHABET - 1; unit >= 0; unit--)
+		dense.class_byte[dfa->byte_class[unit]] = unit;
+	dense.dfa = dfa;
+
+	dfa->n_state = ac->n_node;
+	dfa->table = malloc(sizeof(struct str2dfa_trans) *
+						dfa->n_state * dfa->n_class);
+	if (!dfa->table || ac_closure(ac, ac_dense_row, &dense) < 0)
+		return -1;
+	return 0;
+}
+
+/* Build the dense DFA of the patterns in the trie, which takes over its
+ * pattern-ID table. Return 0, or -1 on error.
+ */
+static int
+ac_dense_patterns(struct ac_automaton *ac, struct str2dfa_dense *dfa) {
+	int err = -1;
+	long i;
+
+	if (dfa->n_pattern < 0 || ac_dense(ac, dfa) < 0)
+		goto out;
+
+	/* The pattern-ID table moves over from the automaton */
+	if (!ac->pattern_offset && ac_save_pattern(ac, "", 0, 0) < 0)
+		goto out;
+	dfa->pattern_next = calloc(dfa->n_pattern + 1, sizeof(uint16_t));
+	if (!dfa->pattern_next)
+		goto out;
+	for (i = 1; i <= dfa->n_pattern; i++)
+		dfa->pattern_next[i] = ac->pattern_next[i];
+	dfa->pattern_offset = ac->pattern_offset;
+	dfa->pattern_data = ac->pattern_data;
+	ac->pattern_offset = NULL;
+	ac->pattern_data = NULL;
+	err = 0;
+
+out:
+	if (err) {
+		fprintf(stderr, "ERR: can't build the DFA table\n");
+		str2dfa_dense_free(dfa);
+	}
+	ac_free(ac);
+	return err;
+}
+
+/* Build the DFA of the patterns in a file as a dense table over byte
+ * classes. Return 0, or -1 on error.
+ */
+int
+str2dfa_dense_fromfile(const char *pattern_file, struct str2dfa_dense *dfa) {
+	struct ac_automaton ac;
+
+	memset(dfa, 0, sizeof(*dfa));
+	memset(&ac, 0, sizeof(ac));
+	dfa->n_pattern = ac_fromfile(&ac, pattern_file);
+	return ac_dense_patterns(&ac, dfa);
+}
+
+struct ac_folded_key {
+	const unsigned char *data;
+	long len;
+};
+
+static int
+ac_folded_cmp(const void *a, const void *b) {
+	const struct ac_folded_key *x = a, *y = b;
+
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+	return memcmp(x->data, y->data, x->len);
+}
+
+long
+str2dfa_nocase_conflicts(const unsigned char *pattern_data,
+						 const uint32_t *pattern_offset, long n_pattern,
+						 const unsigned char *nocase,
+						 unsigned char *conflict) {
+	struct ac_folded_key *keys, key;
+	unsigned char *folded;
+	long i, j, len, n_key = 0, n_conflict = 0;
+
+	memset(conflict, 0, n_pattern + 1);
+	if (!nocase || !n_pattern)
+		return 0;
+	folded = malloc(pattern_offset[n_pattern] + 1);
+	keys = malloc(sizeof(*keys) * n_pattern);
+	if (!folded || !keys) {
+		free(folded);
+		free(keys);
+		return -1;
+	}
+	for (j = 0; j < pattern_offset[n_pattern]; j++)
+		folded[j] = str2dfa_fold(pattern_data[j]);
+
+	/* The folded case-sensitive patterns with letters */
+	for (i = 1; i <= n_pattern; i++) {
+		if (nocase[i])
+			continue;
+		len = pattern_offset[i] - pattern_offset[i - 1];
+		for (j = pattern_offset[i - 1]; j < pattern_offset[i]; j++)
+			if (str2dfa_letter(pattern_data[j]))
+				break;
+		if (j == pattern_offset[i])
+			continue;
+		keys[n_key].data = folded + pattern_offset[i - 1];
+		keys[n_key].len = len;
+		n_key++;
+	}
+	qsort(keys, n_key, sizeof(*keys), ac_folded_cmp);
+
+	for (i = 1; n_key && i <= n_pattern; i++) {
+		if (!nocase[i])
+			continue;
+		len = pattern_offset[i] - pattern_offset[i - 1];
+		for (j = 1; j <= len && !conflict[i]; j++) {
+			key.data = folded + pattern_offset[i] - j;
+			key.len = j;
+			if (bsearch(&key, keys, n_key, sizeof(*keys), ac_folded_cmp))
+				conflict[i] = 1;
 		}
-		else {
-			if (PyErr_Occurred())
-				PyErr_Print();
-				fprintf(stderr, "Cannot find function \"str2dfa\"\n");
+		n_conflict += conflict[i];
+	}
+	free(folded);
+	free(keys);
+	return n_conflict;
+}
+
+/* Insert the patterns into the trie, refusing nocase patterns that can't
+ * be folded. Return 0, or -1 on error.
+ */
+static int
+ac_add_patterns(struct ac_automaton *ac, const unsigned char *pattern_data,
+				const uint32_t *pattern_offset, long n_pattern,
+				const unsigned char *nocase) {
+	unsigned char *conflict;
+	long i, n_conflict;
+
+	conflict = malloc(n_pattern + 1);
+	if (!conflict)
+		return -1;
+	n_conflict = str2dfa_nocase_conflicts(pattern_data, pattern_offset,
+										  n_pattern, nocase, conflict);
+	free(conflict);
+	if (n_conflict) {
+		if (n_conflict > 0)
+			fprintf(stderr, "ERR: %ld nocase patterns end like case-sensitive "
+					"ones and can't be folded\n", n_conflict);
+		return -1;
+	}
+	if (ac_new_node(ac, 0) < 0)
+		return -1;
+	for (i = 1; i <= n_pattern; i++) {
+		if (ac_add(ac, pattern_data + pattern_offset[i - 1],
+				   pattern_offset[i] - pattern_offset[i - 1],
+				   nocase ? nocase[i] : 0, i) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+long
+str2dfa_count_states(const unsigned char *pattern_data,
+					 const uint32_t *pattern_offset, long n_pattern,
+					 const unsigned char *nocase) {
+	struct ac_automaton ac;
+	long n_state = -1;
+
+	memset(&ac, 0, sizeof(ac));
+	if (ac_add_patterns(&ac, pattern_data, pattern_offset, n_pattern,
+						nocase) == 0 && ac_build(&ac) == 0)
+		n_state = ac.n_node;
+	ac_free(&ac);
+	return n_state;
+}
+
+int
+str2dfa_dense_frompatterns(const unsigned char *pattern_data,
+						   const uint32_t *pattern_offset, long n_pattern,
+						   const unsigned char *nocase,
+						   struct str2dfa_dense *dfa) {
+	struct ac_automaton ac;
+	long i, len, n_nocase = 0;
+
+	memset(dfa, 0, sizeof(*dfa));
+	memset(&ac, 0, sizeof(ac));
+	dfa->n_pattern = n_pattern;
+	if (ac_add_patterns(&ac, pattern_data, pattern_offset, n_pattern,
+						nocase) < 0)
+		dfa->n_pattern = -1;
+	for (i = 1; dfa->n_pattern >= 0 && i <= n_pattern; i++) {
+		len = pattern_offset[i] - pattern_offset[i - 1];
+		if (ac_save_pattern(&ac, (const char *)pattern_data +
+							pattern_offset[i - 1], len, i) < 0)
+			dfa->n_pattern = -1;
+		n_nocase += nocase && nocase[i];
+	}
+	if (ac_dense_patterns(&ac, dfa) < 0)
+		return -1;
+	if (n_nocase) {
+		dfa->pattern_nocase = malloc(n_pattern + 1);
+		if (!dfa->pattern_nocase) {
+			str2dfa_dense_free(dfa);
+			return -1;
 		}
+		memcpy(dfa->pattern_nocase, nocase, n_pattern + 1);
+		dfa->pattern_nocase[0] = 0;
+	}
+	printf("Total %ld patterns (%ld nocase), %ld states, %d byte classes\n",
+		   n_pattern, n_nocase, dfa->n_state, dfa->n_class);
+	return 0;
+}
+
+/* Build the DFA of the patterns of full with a nonzero member[i], i being
+ * the 1-based pattern ID they keep. Only the table is built, the pattern
+ * and output link tables stay with full. Return 0, or -1 on error.
+ */
+int
+str2dfa_dense_subset(const struct str2dfa_dense *full,
+					 const unsigned char *member, struct str2dfa_dense *dfa) {
+	struct ac_automaton ac;
+	int err = -1;
+	long i;
+
+	memset(dfa, 0, sizeof(*dfa));
+	memset(&ac, 0, sizeof(ac));
+	dfa->n_pattern = full->n_pattern;
+	if (ac_new_node(&ac, 0) < 0)
+		goto out;
+	for (i = 1; i <= full->n_pattern; i++) {
+		if (!member[i])
+			continue;
+		if (ac_add(&ac, full->pattern_data + full->pattern_offset[i - 1],
+				   full->pattern_offset[i] - full->pattern_offset[i - 1],
+				   full->pattern_nocase ? full->pattern_nocase[i] : 0, i) < 0)
+			goto out;
 	}
-	else {
-		PyErr_Print();
-		fprintf(stderr, "Failed to load \"str2dfa\"\n");
+	err = ac_dense(&ac, dfa);
+
+out:
+	if (err) {
+		fprintf(stderr, "ERR: can't build the DFA table\n");
+		str2dfa_dense_free(dfa);
+	}
+	ac_free(&ac);
+	return err;
+}
+
+/* List the transitions of a dense table that do not go back to the root,
+ * with key_unit being the class. Return the number of entries, or -1 on
+ * error.
+ */
+int
+str2dfa_dense_tokv(const struct str2dfa_dense *dfa,
+				   struct str2dfa_kv **result) {
+	struct str2dfa_kv *entries;
+	long state, n_entry = 0;
+	int class;
+	const struct str2dfa_trans *trans;
+
+	for (trans = dfa->table;
+		 trans < dfa->table + dfa->n_state * dfa->n_class; trans++) {
+		if (trans->state || trans->flag)
+			n_entry++;
+	}
+	if (n_entry > INT_MAX)
+		return -1;
+	entries = malloc(sizeof(struct str2dfa_kv) * (n_entry + 1));
+	if (!entries)
 		return -1;
+
+	n_entry = 0;
+	trans = dfa->table;
+	for (state = 0; state < dfa->n_state; state++) {
+		for (class = 0; class < dfa->n_class; class++, trans++) {
+			if (!trans->state && !trans->flag)
+				continue;
+			entries[n_entry].key_state = state;
+			entries[n_entry].key_unit = class;
+			entries[n_entry].value_state = trans->state;
+			entries[n_entry].value_flag = trans->flag;
+			n_entry++;
+		}
 	}
-	Py_Finalize();
+	*result = entries;
 	return n_entry;
 }
+
+void
+str2dfa_dense_free(struct str2dfa_dense *dfa) {
+	free(dfa->table);
+	free(dfa->pattern_offset);
+	free(dfa->pattern_data);
+	free(dfa->pattern_next);
+	free(dfa->pattern_limit);
+	free(dfa->pattern_nocase);
+	dfa->table = NULL;
+	dfa->pattern_limit = NULL;
+	dfa->pattern_nocase = NULL;
+	dfa->pattern_offset = NULL;
+	dfa->pattern_data = NULL;
+	dfa->pattern_next = NULL;
+}
@@ -8,6 +8,10 @@
 #ifndef _STR2DFA_H
 #define _STR2DFA_H
 
+#include <stdint.h>
+
+#define STR2DFA_ALPHABET 256
+
 struct str2dfa_kv {
 	long key_state;
 	char key_unit;
@@ -15,7 +19,101 @@ struct str2dfa_kv {
 	long value_flag;
 };
 
+/* Aho-Corasick DFA over the patterns, with the full transition function.
+ * Transitions to state 0 are left out, value_flag is the 1-based index of
+ * the pattern found on entering value_state, or 0.
+ */
 int str2dfa(char **, int, struct str2dfa_kv **);
 int str2dfa_fromfile(const char *, struct str2dfa_kv **result);
 
+/* One transition of the dense DFA table, laid out like the values of
+ * ids_inspect_map so the table can be copied as is.
+ */
+struct str2dfa_trans {
+	uint32_t state;
+	uint16_t flag;
+	uint16_t padding;
+};
+
+/* Where a pattern may be in the payload, like the offset and depth
+ * modifiers of a Snort content: it begins offset bytes or more into the
+ * payload and, with a depth, ends within depth bytes from there.
+ */
+struct str2dfa_limit {
+	uint16_t offset;
+	uint16_t depth;		/* 0 for no limit */
+};
+
+/* ASCII letters, the bytes a nocase pattern matches in either case */
+static inline int str2dfa_letter(unsigned char unit) {
+	return (unit | 0x20) >= 'a' && (unit | 0x20) <= 'z';
+}
+
+static inline unsigned char str2dfa_fold(unsigned char unit) {
+	return str2dfa_letter(unit) ? unit | 0x20 : unit;
+}
+
+/* Dense DFA: n_state rows of n_class transitions, indexed by the class of
+ * the input byte.
+ */
+struct str2dfa_dense {
+	long n_state;
+	long n_pattern;
+	int n_class;
+	unsigned char byte_class[STR2DFA_ALPHABET];
+	struct str2dfa_trans *table;
+	/* Pattern-ID table: pattern i (1-based) is the bytes of pattern_data
+	 * from pattern_offset[i - 1] to pattern_offset[i]
+	 */
+	uint32_t *pattern_offset;
+	unsigned char *pattern_data;
+	/* Output links: pattern_next[i] is the next pattern found wherever
+	 * pattern i is, 0 at the end. A flag is the head of such a list.
+	 */
+	uint16_t *pattern_next;
+	/* Limits of pattern i, NULL if no pattern has any */
+	struct str2dfa_limit *pattern_limit;
+	/* 1 if pattern i matches its letters in either case, NULL if no
+	 * pattern does
+	 */
+	unsigned char *pattern_nocase;
+};
+
+int str2dfa_dense_fromfile(const char *pattern_file, struct str2dfa_dense *dfa);
+/* Same as str2dfa_dense_fromfile(), with the n_pattern patterns laid out
+ * like the pattern-ID table of the DFA. The patterns set in nocase (if not
+ * NULL) are folded into the automaton: their letters take one trie edge
+ * for both cases, and the byte classes of a letter only seen that way
+ * merge. An edge only splits into one per case where the rest of the
+ * automaton tells the cases apart, so mixed sets still take one lookup
+ * per byte.
+ */
+int str2dfa_dense_frompatterns(const unsigned char *pattern_data,
+							   const uint32_t *pattern_offset, long n_pattern,
+							   const unsigned char *nocase,
+							   struct str2dfa_dense *dfa);
+/* Set conflict[i] for the nocase patterns i that a case-sensitive pattern
+ * with letters, no longer than them, ends like when both are folded.
+ * Where such a pattern i is found, whether the other one is too depends on
+ * the case of the input, so no output link list fits pattern i and it
+ * can't be folded. Return their number.
+ */
+long str2dfa_nocase_conflicts(const unsigned char *pattern_data,
+							  const uint32_t *pattern_offset, long n_pattern,
+							  const unsigned char *nocase,
+							  unsigned char *conflict);
+/* Number of states of the automaton of the patterns, as in
+ * str2dfa_dense_frompatterns(), without building its table. Return -1 on
+ * error.
+ */
+long str2dfa_count_states(const unsigned char *pattern_data,
+						  const uint32_t *pattern_offset, long n_pattern,
+						  const unsigned char *nocase);
+int str2dfa_dense_subset(const struct str2dfa_dense *full,
+						 const unsigned char *member,
+						 struct str2dfa_dense *dfa);
+int str2dfa_dense_tokv(const struct str2dfa_dense *dfa,
+					   struct str2dfa_kv **result);
+void str2dfa_dense_free(struct str2dfa_dense *dfa);
+
 #endif
@@ -210,6 +210,12 @@ def str2dfa(pattern_list):
     return entries_generator.get_key_value_entries()
 
 if __name__ == '__main__':
-    x = DFAMatchEntriesGenerator(['dog', 'cat'], 1)
-    for i in x.get_key_value_entries():
-        print(i)
+    import sys
+    if len(sys.argv) > 1:
+        # Used by str2dfa_bench as the reference builder
+        entries = str2dfa(sys.argv[1])
+        sys.stderr.write("Total %d entries\n" % len(entries))
+    else:
+        x = DFAMatchEntriesGenerator(['dog', 'cat'], 1)
+        for i in x.get_key_value_entries():
+            print(i)
@@ -0,0 +1,109 @@
+/*************************************************************************
+	> File Name: trust.c
+	> Description: Trusted prefixes, the source and destination networks
+	> whose packets bypass the DPI
+ ************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "trust.h"
+
+#define TRUST_LINE_MAX 256
+
+/* Parse <addr>[/<len>] into prefix. Return 0, or -1 if invalid. */
+static int
+trust_prefix_parse(char *spec, struct trust_prefix *prefix) {
+	char *slash, *end;
+	long len, max_len;
+	int i;
+
+	slash = strchr(spec, '/');
+	if (slash)
+		*slash = '\0';
+	if (inet_pton(AF_INET, spec, prefix->addr) == 1) {
+		prefix->family = AF_INET;
+		max_len = 32;
+	} else if (inet_pton(AF_INET6, spec, prefix->addr) == 1) {
+		prefix->family = AF_INET6;
+		max_len = 128;
+	} else {
+		return -1;
+	}
+	len = max_len;
+	if (slash) {
+		errno = 0;
+		len = strtol(slash + 1, &end, 10);
+		if (errno || end == slash + 1 || *end || len < 0 || len > max_len)
+			return -1;
+	}
+	prefix->len = len;
+	/* Clear the host bits, the trie only looks at the first len anyway */
+	for (i = 0; i < max_len / 8; i++) {
+		if (len >= 8 * (i + 1))
+			continue;
+		prefix->addr[i] &= len > 8 * i ? 0xff << (8 - (len - 8 * i)) : 0;
+	}
+	return 0;
+}
+
+int
+trust_prefixes_fromfile(const char *trust_file,
+						struct trust_prefix **result) {
+	char line[TRUST_LINE_MAX], *dir, *spec, *extra, *save;
+	struct trust_prefix *prefixes = NULL, *p;
+	int n_prefix = 0, max_prefix = 0, n_line = 0;
+	FILE *fp;
+
+	fp = fopen(trust_file, "r");
+	if (!fp) {
+		fprintf(stderr, "ERR: can't open trusted prefix file %s: %s\n",
+				trust_file, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		n_line++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		dir = strtok_r(line, " \t", &save);
+		if (!dir)
+			continue;
+		if (n_prefix == max_prefix) {
+			max_prefix = max_prefix ? max_prefix * 2 : 64;
+			p = realloc(prefixes, sizeof(*prefixes) * max_prefix);
+			if (!p) {
+				fclose(fp);
+				free(prefixes);
+				return -1;
+			}
+			prefixes = p;
+		}
+		p = &prefixes[n_prefix];
+		memset(p, 0, sizeof(*p));
+		if (!strcmp(dir, "src")) {
+			p->dir = TRUST_SRC;
+			spec = strtok_r(NULL, " \t", &save);
+		} else if (!strcmp(dir, "dst")) {
+			p->dir = TRUST_DST;
+			spec = strtok_r(NULL, " \t", &save);
+		} else {
+			p->dir = TRUST_SRC | TRUST_DST;
+			spec = dir;
+		}
+		extra = spec ? strtok_r(NULL, " \t", &save) : NULL;
+		if (!spec || extra || trust_prefix_parse(spec, p) < 0)
+			goto error;
+		n_prefix++;
+	}
+	fclose(fp);
+	*result = prefixes;
+	return n_prefix;
+
+error:
+	fprintf(stderr, "ERR: %s:%d: expect [src|dst] <addr>[/<len>]\n",
+			trust_file, n_line);
+	fclose(fp);
+	free(prefixes);
+	return -1;
+}
@@ -0,0 +1,32 @@
+/*************************************************************************
+	> File Name: trust.h
+	> Description: Trusted prefixes, the source and destination networks
+	> whose packets bypass the DPI
+ ************************************************************************/
+
+#ifndef _TRUST_H
+#define _TRUST_H
+
+#include <stdint.h>
+
+#define TRUST_SRC 1
+#define TRUST_DST 2
+
+/* Packets from (TRUST_SRC) or to (TRUST_DST) addresses in the prefix are
+ * trusted
+ */
+struct trust_prefix {
+	int family;		/* AF_INET or AF_INET6 */
+	uint8_t dir;		/* TRUST_SRC, TRUST_DST or both */
+	uint8_t len;		/* Prefix length in bits */
+	uint8_t addr[16];	/* Network byte order, host bits cleared */
+};
+
+/* Read prefixes from a file, each line being [src|dst] <addr>[/<len>],
+ * IPv4 or IPv6, trusted in both directions without src or dst. Return
+ * the number of prefixes, or -1 on error.
+ */
+int trust_prefixes_fromfile(const char *trust_file,
+							struct trust_prefix **result);
+
+#endif
@@ -61,6 +61,12 @@ static const struct option_wrapper long_options[] = {
 	{{"tail-call",   required_argument,	NULL, 's' },
 	 "Set tail-call map entry with <entry> (idx:progsec)", "<entry>"},
 
+	{{"map-size",    required_argument,	NULL,  6  },
+	 "Create map with <entry> (name:max_entries)", "<entry>"},
+
+	{{"inner-map",   required_argument,	NULL,  11 },
+	 "Create map-in-map <entry> (outer:template), its inner maps are like the template map", "<entry>"},
+
 	{{"filename",    required_argument,	NULL,  1  },
 	 "Load program from <file>", "<file>"},
 
@@ -140,6 +146,13 @@ int set_tail_call_map(struct bpf_object *bpf_obj, struct config *cfg)
 			return EXIT_FAIL_BPF;
 		}
 		prog_fd = bpf_program__fd(bpf_prog);
+		if (prog_fd < 0) {
+			/* Not loaded on this kernel, see skip_bpf_loop_prep() */
+			printf("INFO: program in section '%s' not loaded, "
+			       "tail call map entry %d left empty\n",
+			       cfg->tail_call_map_progsec[i_entry], map_idx);
+			continue;
+		}
 		if (bpf_map_update_elem(tail_call_map_fd, &map_idx, &prog_fd, 0) < 0) {
 			fprintf(stderr,
 				"WARN: Failed to update bpf map (tail_call_map) : err(%d):%s\n",
@@ -1,6 +1,9 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 static const char *__doc__ = "XDP stats program\n"
-	" - Finding xdp_stats_map via --dev name info\n";
+	" - Finding xdp_stats_map via --dev name info\n"
+	" - With --top, also the most hit patterns of ids_pattern_stats_map\n"
+	" - The packets of each flow verdict of ids_verdict_stats_map, and of\n"
+	"   the blocked sources\n";
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +26,7 @@ static const char *__doc__ = "XDP stats program\n"
 #include "../common_params.h"
 #include "../common_user_bpf_xdp.h"
 #include "../xdp_stats_kern_user.h"
+#include "../../common_kern_user.h"
 
 #include "bpf_util.h" /* bpf_num_possible_cpus */
 
@@ -36,6 +40,9 @@ static const struct option_wrapper long_options[] = {
 	{{"quiet",       no_argument,		NULL, 'q' },
 	 "Quiet mode (no output)"},
 
+	{{"top",         required_argument,	NULL, 14 },
+	 "Show the <n> patterns with most hits in the period", "<n>"},
+
 	{{0, 0, NULL,  0 }}
 };
 
@@ -192,17 +199,224 @@ static void stats_collect(int map_fd, __u32 map_type,
 	}
 }
 
+/* Packets of each flow verdict, indexed by enum ids_verdict */
+struct verdict_stats_record {
+	struct record stats[IDS_VERDICT_MAX];
+};
+
+static const char *verdict_names[IDS_VERDICT_MAX] = {
+	[IDS_VERDICT_NONE]  = "Inspected",
+	[IDS_VERDICT_DROP]  = "Flow-drop",
+	[IDS_VERDICT_PASS]  = "Flow-pass",
+	[IDS_VERDICT_DEPTH] = "Flow-depth",
+	[IDS_VERDICT_BLOCK] = "Src-block",
+	[IDS_VERDICT_TRUST] = "Trusted",
+	[IDS_VERDICT_CUT]   = "Cut-short",
+};
+
+static int verdict_stats_collect(const char *pin_dir,
+				 struct verdict_stats_record *rec)
+{
+	struct bpf_map_info info = {};
+	__u32 key;
+	int fd;
+
+	fd = open_bpf_map_file(pin_dir, "ids_verdict_stats_map", &info);
+	if (fd < 0)
+		return -1;
+	if (info.type != BPF_MAP_TYPE_PERCPU_ARRAY ||
+	    info.value_size != sizeof(struct datarec) ||
+	    info.max_entries != IDS_VERDICT_MAX) {
+		fprintf(stderr, "ERR: ids_verdict_stats_map not compatible\n");
+		close(fd);
+		return -1;
+	}
+	for (key = 0; key < IDS_VERDICT_MAX; key++)
+		map_collect(fd, info.type, key, &rec->stats[key]);
+	close(fd);
+	return 0;
+}
+
+/* Only once some packet is counted, the cache and the blocklist are off
+ * and no scan was cut short otherwise
+ */
+static void verdict_stats_print(struct verdict_stats_record *rec,
+				struct verdict_stats_record *prev)
+{
+	struct record *r, *p;
+	double period;
+	int i;
+
+	for (i = 0; i < IDS_VERDICT_MAX; i++)
+		if (rec->stats[i].total.rx_packets)
+			break;
+	if (i == IDS_VERDICT_MAX)
+		return;
+	printf("%-12s (bytes of whole frames, not payloads)\n", "Flow-verdict");
+	for (i = 0; i < IDS_VERDICT_MAX; i++) {
+		r = &rec->stats[i];
+		p = &prev->stats[i];
+		period = calc_period(r, p);
+		if (period == 0)
+			return;
+		printf("%-12s %'11lld pkts (%'10.0f pps)"
+		       " %'11lld Kbytes (%'6.0f Mbits/s)\n",
+		       verdict_names[i], r->total.rx_packets,
+		       (r->total.rx_packets - p->total.rx_packets) / period,
+		       r->total.rx_bytes / 1000,
+		       (r->total.rx_bytes - p->total.rx_bytes) * 8 / period /
+		       1000000);
+	}
+	printf("\n");
+}
+
+/* Per-pattern hits, indexed by the flag of the pattern */
+struct pattern_stats_record {
+	__u64 timestamp;
+	__u32 n_pattern;
+	struct datarec *pattern;
+};
+
+struct pattern_hit {
+	__u32 flag;
+	__u64 packets;
+	__u64 bytes;
+};
+
+static int pattern_hit_cmp(const void *a, const void *b)
+{
+	const struct pattern_hit *x = a, *y = b;
+
+	if (x->packets != y->packets)
+		return x->packets < y->packets ? 1 : -1;
+	return x->flag < y->flag ? -1 : x->flag > y->flag;
+}
+
+/* Highest pattern number of the active ruleset, or 0 if unknown */
+static __u32 active_n_pattern(const char *pin_dir)
+{
+	struct ids_config config;
+	__u32 key = 0, slot, n_pattern = 0;
+	int active_fd, config_fd;
+
+	active_fd = open_bpf_map_file(pin_dir, "ids_active_map", NULL);
+	if (active_fd < 0)
+		return 0;
+	config_fd = open_bpf_map_file(pin_dir, "ids_config_map", NULL);
+	if (config_fd >= 0) {
+		if (bpf_map_lookup_elem(active_fd, &key, &slot) == 0 &&
+		    bpf_map_lookup_elem(config_fd, &slot, &config) == 0)
+			n_pattern = config.n_pattern;
+		close(config_fd);
+	}
+	close(active_fd);
+	return n_pattern;
+}
+
+/* ids_pattern_stats_map is not pinned by xdp_stats_map users, so missing
+ * it only disables the view. Only the patterns of the active ruleset are
+ * read, each key being a per-CPU lookup.
+ */
+static int pattern_stats_collect(const char *pin_dir,
+				 struct pattern_stats_record *rec)
+{
+	struct bpf_map_info info = {};
+	__u32 key, end;
+	int fd;
+
+	fd = open_bpf_map_file(pin_dir, "ids_pattern_stats_map", &info);
+	if (fd < 0)
+		return -1;
+	if (info.type != BPF_MAP_TYPE_PERCPU_ARRAY ||
+	    info.value_size != sizeof(struct datarec)) {
+		fprintf(stderr, "ERR: ids_pattern_stats_map not compatible\n");
+		close(fd);
+		return -1;
+	}
+	if (rec->n_pattern != info.max_entries) {
+		free(rec->pattern);
+		rec->pattern = calloc(info.max_entries, sizeof(*rec->pattern));
+		if (!rec->pattern) {
+			rec->n_pattern = 0;
+			close(fd);
+			return -1;
+		}
+		rec->n_pattern = info.max_entries;
+	}
+
+	end = active_n_pattern(pin_dir) + 1;
+	if (end == 1 || end > rec->n_pattern)
+		end = rec->n_pattern;
+
+	rec->timestamp = gettime();
+	/* Key 0 is never a flag, the patterns start from 1 */
+	for (key = 1; key < end; key++)
+		map_get_value_percpu_array(fd, key, &rec->pattern[key]);
+	/* Left from a larger ruleset */
+	memset(&rec->pattern[end], 0,
+	       (rec->n_pattern - end) * sizeof(*rec->pattern));
+	close(fd);
+	return 0;
+}
+
+static void pattern_stats_print(struct pattern_stats_record *rec,
+				struct pattern_stats_record *prev, int top_n)
+{
+	struct pattern_hit *hits;
+	__u32 i, n_hit = 0;
+	double period;
+
+	if (!prev->pattern || prev->n_pattern != rec->n_pattern)
+		return;
+	period = ((double)(rec->timestamp - prev->timestamp)) / NANOSEC_PER_SEC;
+	if (period <= 0)
+		return;
+
+	hits = calloc(rec->n_pattern, sizeof(*hits));
+	if (!hits)
+		return;
+	for (i = 1; i < rec->n_pattern; i++) {
+		if (rec->pattern[i].rx_packets == prev->pattern[i].rx_packets)
+			continue;
+		hits[n_hit].flag = i;
+		hits[n_hit].packets = rec->pattern[i].rx_packets -
+			prev->pattern[i].rx_packets;
+		hits[n_hit].bytes = rec->pattern[i].rx_bytes -
+			prev->pattern[i].rx_bytes;
+		n_hit++;
+	}
+	qsort(hits, n_hit, sizeof(*hits), pattern_hit_cmp);
+
+	printf("%-12s (%u patterns hit)\n", "Top-pattern", n_hit);
+	for (i = 0; i < n_hit && i < (__u32)top_n; i++) {
+		printf("%-12u %'11lld hits (%'10.0f hps)"
+		       " %'11lld Kbytes total %'11lld hits\n",
+		       hits[i].flag, hits[i].packets, hits[i].packets / period,
+		       hits[i].bytes / 1000,
+		       rec->pattern[hits[i].flag].rx_packets);
+	}
+	printf("\n");
+	free(hits);
+}
+
 static int stats_poll(const char *pin_dir, int map_fd, __u32 id,
-		      __u32 map_type, int interval)
+		      __u32 map_type, int interval, int top_n)
 {
 	struct bpf_map_info info = {};
 	struct stats_record prev, record = { 0 };
+	struct pattern_stats_record pattern_prev = { 0 }, pattern_record = { 0 };
+	struct pattern_stats_record pattern_swap;
+	struct verdict_stats_record verdict_prev, verdict_record = { 0 };
+	bool verdicts;
 
 	/* Trick to pretty printf with thousands separators use %' */
 	setlocale(LC_NUMERIC, "en_US");
 
 	/* Get initial reading quickly */
 	stats_collect(map_fd, map_type, &record);
+	if (top_n > 0)
+		pattern_stats_collect(pin_dir, &pattern_record);
+	verdicts = verdict_stats_collect(pin_dir, &verdict_record) == 0;
 	usleep(1000000/4);
 
 	while (1) {
@@ -213,11 +427,29 @@ static int stats_poll(const char *pin_dir, int map_fd, __u32 id,
 			return EXIT_FAIL_BPF;
 		} else if (id != info.id) {
 			printf("BPF map xdp_stats_map changed its ID, restarting\n");
+			free(pattern_record.pattern);
+			free(pattern_prev.pattern);
 			return 0;
 		}
 
 		stats_collect(map_fd, map_type, &record);
 		stats_print(&record, &prev);
+
+		if (verdicts) {
+			verdict_prev = verdict_record;
+			if (verdict_stats_collect(pin_dir, &verdict_record) == 0)
+				verdict_stats_print(&verdict_record, &verdict_prev);
+		}
+
+		if (top_n > 0) {
+			/* Swap the buffers instead of copying max_entries records */
+			pattern_swap = pattern_prev;
+			pattern_prev = pattern_record;
+			pattern_record = pattern_swap;
+			if (pattern_stats_collect(pin_dir, &pattern_record) == 0)
+				pattern_stats_print(&pattern_record, &pattern_prev,
+						    top_n);
+		}
 		sleep(interval);
 	}
 
@@ -286,7 +518,8 @@ int main(int argc, char **argv)
 			       );
 		}
 
-		err = stats_poll(pin_dir, stats_map_fd, info.id, info.type, interval);
+		err = stats_poll(pin_dir, stats_map_fd, info.id, info.type, interval,
+				 cfg.top_n);
 		if (err < 0)
 			return err;
 	}
@@ -4,28 +4,310 @@
 #ifndef __COMMON_KERN_USER_H
 #define __COMMON_KERN_USER_H
 
-/* IDS Inspect Uit */
+/* Number of payload bytes consumed by one lookup in the multi-stride DFA */
+#define IDS_INSPECT_STRIDE 2
+
+/* Size of the byte alphabet, before it is compressed into classes */
+#define IDS_INSPECT_ALPHABET 256
+
+/* IDS Inspect Uit, the byte class of a payload byte */
 typedef __u8 ids_inspect_unit;
-// struct ids_inspect_unit {
-	// __u8 unit[IDS_INSPECT_STRIDE];
-// };
+struct ids_inspect_stride_unit {
+	ids_inspect_unit unit[IDS_INSPECT_STRIDE];
+};
 
-/* IDS Inspect State */
-typedef __u16 ids_inspect_state;
+/* IDS Inspect State, wide enough for the automaton of the registered set */
+typedef __u32 ids_inspect_state;
 
 /* Accept state flag */
 typedef __u16 accept_state_flag;
 
-/* Key-Value of ids_inspect_map */
-struct ids_inspect_map_key {
+/* Key-Value of ids_inspect_map. The rows of the DFA are stored one after
+ * another, each with n_class transitions, so the hot rows stay compact.
+ */
+typedef __u32 ids_inspect_map_key;
+
+#define IDS_INSPECT_MAP_INDEX(state, unit, n_class) \
+	((ids_inspect_map_key)(state) * (n_class) + (unit))
+
+struct ids_inspect_map_value {
 	ids_inspect_state state;
-	ids_inspect_unit unit;
-	__u8 padding;
+	accept_state_flag flag;
+	accept_state_flag stride_flag;	/* Multi-stride only, see below */
 };
 
-struct ids_inspect_map_value {
+/* Key of ids_inspect_ms_map, which holds the multi-stride transitions of
+ * every non-root state that differ from the root row. The value is the same
+ * as ids_inspect_map: flag is the pattern found on the last byte of the
+ * stride, stride_flag the one found on the byte before, if any.
+ */
+struct ids_inspect_ms_map_key {
 	ids_inspect_state state;
+	struct ids_inspect_stride_unit unit;
+	__u8 padding[4 - IDS_INSPECT_STRIDE];
+};
+
+/* Key of ids_inspect_root_map, a dense array holding the multi-stride
+ * transitions of the root state. The key is used as the array index
+ * directly.
+ */
+struct ids_inspect_root_map_key {
+	struct ids_inspect_stride_unit unit;
+	__u8 padding[4 - IDS_INSPECT_STRIDE];
+};
+
+/* What to do with a packet a pattern is found in. When several patterns
+ * are found, the greatest action wins.
+ */
+enum ids_action {
+	IDS_ACTION_COUNT = 0,	/* Report it and go on inspecting */
+	IDS_ACTION_XSK,		/* Redirect it to the AF_XDP socket of the queue */
+	IDS_ACTION_REDIRECT,	/* Redirect it to the device of ids_redirect_map */
+	IDS_ACTION_DROP,
+	IDS_ACTION_PASS,	/* Let it through without further inspection */
+	IDS_ACTION_MAX,
+};
+
+/* Value of ids_pattern_map, indexed by pattern flag. next is the output
+ * link, the next pattern found wherever this one is, 0 at the end. The
+ * flag of an accepting state is the head of its list, and list_action is
+ * the greatest action of the patterns from this one to the end of the
+ * list. The pattern only counts if it ends from end_min to end_max bytes
+ * into the payload, by the offset and depth of its rule.
+ */
+struct ids_pattern_value {
+	accept_state_flag next;
+	__u8 action;		/* enum ids_action */
+	__u8 list_action;	/* Likewise, when no pattern has a window */
+	__u16 end_min;		/* 0 without an offset or a depth */
+	__u16 end_max;		/* 0xffff without a depth */
+};
+
+/* Number of DFA slots. xdp_prog_user fills the standby slot while the
+ * active one is in use, then flips ids_active_map to it.
+ */
+#define IDS_INSPECT_SLOTS 2
+
+/* Metadata in front of the test packets of xdp_prog_user --bench. They
+ * are inspected with the given slot instead of the active one, so the
+ * benchmark never changes the config the traffic is inspected with.
+ */
+struct ids_bench_meta {
+	__u32 slot;
+};
+
+/* Index of the DPI programs in tail_call_map. The q-gram filter and the
+ * prefilter are not DPI programs of their own, they run in front of the
+ * selected one.
+ */
+enum ids_dpi_prog {
+	IDS_DPI_PROG_STRIDE1 = 0,
+	IDS_DPI_PROG_STRIDE2,
+	IDS_DPI_PROG_LOOP,
+	IDS_DPI_PROG_PREFILTER,
+	IDS_DPI_PROG_QGRAM,
+	IDS_DPI_PROG_FRAGS,	/* Packets with fragments, whatever is selected */
+	IDS_DPI_PROG_MAX,
+};
+
+/* Value of ids_prefilter_map, one per DFA slot. Bit (b0 << 8 | b1) of gram
+ * is set if some pattern begins with bytes b0 b1, bit b of first if some
+ * pattern begins with byte b. A pattern of one byte sets every gram
+ * beginning with it.
+ */
+#define IDS_PREFILTER_GRAMS (1 << 16)
+
+struct ids_prefilter {
+	__u8 gram[IDS_PREFILTER_GRAMS / 8];
+	__u8 first[IDS_INSPECT_ALPHABET / 8];
+};
+
+/* The q-grams of the patterns (see common/qgram.h) are kept in
+ * ids_qgram_map as the len-byte gram tagged with len. Without a bloom
+ * filter, they are hashed twice into a bitmap, its value.
+ */
+#define IDS_QGRAM_LEN_MAX 4
+#define IDS_QGRAM_KEY(gram, len) ((__u64)(len) << 32 | (gram))
+#define IDS_QGRAM_BITS_LOG 20
+#define IDS_QGRAM_BITS (1 << IDS_QGRAM_BITS_LOG)
+#define IDS_QGRAM_HASH1(key) \
+	((__u32)(((key) * 0x9E3779B97F4A7C15ULL) >> (64 - IDS_QGRAM_BITS_LOG)))
+#define IDS_QGRAM_HASH2(key) \
+	((__u32)(((key) * 0xC2B2AE3D27D4EB4FULL) >> (64 - IDS_QGRAM_BITS_LOG)))
+
+struct ids_qgram_bitmap {
+	__u8 bit[IDS_QGRAM_BITS / 8];
+};
+
+/* Key-Value of ids_flow_map, which carries the DFA state of a TCP flow
+ * from one segment to the next in-order one. IPv4 addresses only use the
+ * first word of saddr/daddr.
+ */
+struct ids_flow_key {
+	__u32 saddr[4];
+	__u32 daddr[4];
+	__u16 sport;
+	__u16 dport;
+	__u8 proto;
+	__u8 padding[3];
+};
+
+struct ids_flow_value {
+	__u32 next_seq;		/* Sequence number of the next in-order segment */
+	ids_inspect_state state;	/* DFA state at the end of the last segment */
+	__u32 generation;	/* Ruleset the state belongs to, see ids_config */
+	__u32 short_window;	/* Last payload bytes, for the short patterns */
+	__u32 short_seen;	/* How many of them there are, up to 4 */
+};
+
+/* Verdict of a flow in ids_verdict_map, the later packets of a judged
+ * flow skip the DPI. ids_verdict_stats_map counts the packets of each,
+ * IDS_VERDICT_NONE being the ones inspected.
+ */
+enum ids_verdict {
+	IDS_VERDICT_NONE = 0,
+	IDS_VERDICT_DROP,	/* A drop pattern was found, drop the rest */
+	IDS_VERDICT_PASS,	/* A pass pattern was found, pass the rest */
+	IDS_VERDICT_DEPTH,	/* Past the stream depth, pass the rest */
+	IDS_VERDICT_BLOCK,	/* Only counted: the source is in ids_block_map */
+	IDS_VERDICT_TRUST,	/* Only counted: an address is in a trusted prefix */
+	IDS_VERDICT_CUT,	/* Only counted: a failed tail call ended the scan */
+	IDS_VERDICT_MAX,
+};
+
+struct ids_verdict_value {
+	__u32 verdict;		/* enum ids_verdict */
+	__u32 padding;
+	__u64 bytes;		/* Payload bytes of the flow so far */
+};
+
+/* Key-Value of ids_block_map, the sources a drop pattern was found from.
+ * Their packets are dropped right after the IP header until expire_ns, in
+ * bpf_ktime_get_ns() time. IPv4 addresses only use the first word.
+ */
+struct ids_block_key {
+	__u32 saddr[4];
+};
+
+struct ids_block_value {
+	__u64 expire_ns;
+	__u64 packets;		/* Packets dropped since the source was blocked */
+};
+
+/* Keys of ids_trust_v4_map and ids_trust_v6_map, the LPM tries of the
+ * trusted prefixes whose packets pass without the DPI. The slot and the
+ * direction come first in the data, so prefixlen is 16 plus the prefix
+ * length, and both slots and directions share a trie.
+ */
+#define IDS_TRUST_SRC 1
+#define IDS_TRUST_DST 2
+#define IDS_TRUST_PREFIX_BASE 16
+
+struct ids_trust_v4_key {
+	__u32 prefixlen;
+	__u8 slot;
+	__u8 dir;		/* IDS_TRUST_SRC or IDS_TRUST_DST */
+	__u8 addr[4];
+	__u8 padding[2];	/* Past any prefix, never compared */
+};
+
+struct ids_trust_v6_key {
+	__u32 prefixlen;
+	__u8 slot;
+	__u8 dir;
+	__u8 addr[16];
+	__u8 padding[2];
+};
+
+/* Alert of a pattern found in a packet, sent to xdp_alert through
+ * ids_alert_map. Up to IDS_ALERT_PAYLOAD_LEN bytes from the start of the
+ * payload follow it, caplen tells how many.
+ */
+#define IDS_ALERT_PAYLOAD_LEN 64
+
+struct ids_alert {
+	__u64 timestamp;	/* bpf_ktime_get_ns() when xdp_ids got the packet */
+	struct ids_flow_key key;	/* 5-tuple of the packet */
+	accept_state_flag pattern;	/* Flag of the accepting state */
+	__u16 offset;		/* Offset in the payload the pattern ends at */
+	__u16 pkt_len;
+	__u16 payload_offset;	/* Offset of the payload in the packet */
+	__u16 caplen;		/* Payload bytes following the alert */
+	__u8 padding[6];
+};
+
+/* Value of ids_alert_config_map, written by xdp_alert. Alerts are only
+ * sent while a consumer is enabled, and with a ring buffer the consumer is
+ * only woken up once wakeup alerts are pending.
+ */
+struct ids_alert_config {
+	__u32 enabled;
+	__u32 wakeup;
+};
+
+/* Key-Value of ids_port_group_map. The value has the root state of the
+ * DFA the packets of proto to port are inspected with, in the given DFA
+ * slot, and how deep into the payload its patterns can end. Ports in no
+ * group use the any group at state 0, as deep as scan_depth of the config.
+ */
+struct ids_port_group_key {
+	__u8 slot;
+	__u8 proto;
+	__u16 port;		/* Network byte order */
+};
+
+struct ids_port_group_value {
+	ids_inspect_state root;
+	__u16 depth;		/* Payload bytes to inspect, 0 for all */
+	__u16 padding;
+};
+
+/* Patterns of up to IDS_SHORT_LEN_MAX bytes may be left out of the DFA
+ * and matched in ids_short_map instead, see common/shortpat.h. Entry
+ * slot * IDS_SHORT_ROWS + (b0 << 8 | b1) holds the patterns ending with
+ * bytes b0 b1, longest first, and ids_short_bitmap_map has a bit for each
+ * row that is not empty.
+ */
+#define IDS_SHORT_LEN_MAX 4
+#define IDS_SHORT_ROWS (1 << 16)
+#define IDS_SHORT_WAYS 4
+
+struct ids_short_way {
+	__u16 prefix;		/* The bytes before b0 b1 */
 	accept_state_flag flag;
+	__u8 len;		/* 0 for a free way */
+	__u8 padding[3];
+};
+
+struct ids_short_value {
+	struct ids_short_way way[IDS_SHORT_WAYS];
+};
+
+struct ids_short_bitmap {
+	__u8 row[IDS_SHORT_ROWS / 8];
+};
+
+/* Runtime configuration of the IDS, written by xdp_prog_user for each slot
+ * of ids_config_map
+ */
+struct ids_config {
+	__u32 dpi_prog;		/* enum ids_dpi_prog */
+	__u32 n_class;		/* Number of byte classes */
+	__u32 match_all;	/* Scan the whole payload and report every pattern */
+	__u32 port_groups;	/* Entries of the slot in ids_port_group_map */
+	__u32 prefilter;	/* Skip to where a pattern can begin first */
+	__u32 qgram_lens;	/* Bit l set to test l-byte grams, 0 for no filter */
+	__u32 qgram_tail;	/* Longest pattern length minus 1 */
+	__u32 short_patterns;	/* Some patterns are in ids_short_map */
+	__u32 pattern_windows;	/* Some patterns have an offset or a depth */
+	__u32 scan_depth;	/* Payload bytes to inspect, 0 for all */
+	__u32 verdict_cache;	/* Keep the verdict of a flow in ids_verdict_map */
+	__u32 stream_depth;	/* Payload bytes of a flow to inspect, 0 for all */
+	__u32 block_ttl;	/* Seconds to block a source for, 0 for never */
+	__u32 trust;		/* IDS_TRUST_* of the directions with prefixes */
+	__u32 generation;	/* Bumped by every ruleset, unlike the slot */
+	__u32 n_pattern;	/* Highest pattern number, they start from 1 */
+	ids_inspect_unit byte_class[IDS_INSPECT_ALPHABET];
 };
 
 #endif /* __COMMON_KERN_USER_H */
@@ -274,6 +274,23 @@ static unsigned int (*bpf_set_hash)(void *ctx, __u32 hash) =
 static int (*bpf_skb_adjust_room)(void *ctx, __s32 len_diff, __u32 mode,
 				  unsigned long long flags) =
 	(void *) BPF_FUNC_skb_adjust_room;
+static long (*bpf_loop)(__u32 nr_loops, void *callback_fn, void *callback_ctx,
+			unsigned long long flags) =
+	(void *) BPF_FUNC_loop;
+static void *(*bpf_ringbuf_reserve)(void *ringbuf, __u64 size,
+				    __u64 flags) =
+	(void *) BPF_FUNC_ringbuf_reserve;
+static void (*bpf_ringbuf_submit)(void *data, __u64 flags) =
+	(void *) BPF_FUNC_ringbuf_submit;
+static void (*bpf_ringbuf_discard)(void *data, __u64 flags) =
+	(void *) BPF_FUNC_ringbuf_discard;
+static __u64 (*bpf_ringbuf_query)(void *ringbuf, __u64 flags) =
+	(void *) BPF_FUNC_ringbuf_query;
+static __u64 (*bpf_xdp_get_buff_len)(void *ctx) =
+	(void *) BPF_FUNC_xdp_get_buff_len;
+static long (*bpf_xdp_load_bytes)(void *ctx, __u32 offset, void *buf,
+				  __u32 len) =
+	(void *) BPF_FUNC_xdp_load_bytes;
 
 /* Scan the ARCH passed in from ARCH env variable (see Makefile) */
 #if defined(__TARGET_ARCH_x86)
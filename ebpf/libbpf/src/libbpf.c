@@ -167,6 +167,7 @@ struct bpf_program {
 			RELO_LD64,
 			RELO_CALL,
 			RELO_DATA,
+			RELO_FUNC,
 		} type;
 		int insn_idx;
 		union {
@@ -1876,6 +1877,18 @@ bpf_program__collect_reloc(struct bpf_program *prog, GElf_Shdr *shdr,
 			return -LIBBPF_ERRNO__RELOC;
 		}
 
+		/* Address of a subprogram, passed as a bpf_loop() or
+		 * similar callback. Backported from libbpf 0.4.
+		 */
+		if (shdr_idx == obj->efile.text_shndx) {
+			prog->reloc_desc[i].type = RELO_FUNC;
+			prog->reloc_desc[i].insn_idx = insn_idx;
+			prog->reloc_desc[i].text_off = sym.st_value +
+						       insns[insn_idx].imm;
+			obj->has_pseudo_calls = true;
+			continue;
+		}
+
 		if (bpf_object__shndx_is_maps(obj, shdr_idx) ||
 		    bpf_object__shndx_is_data(obj, shdr_idx)) {
 			type = bpf_object__section_to_libbpf_map_type(obj, shdr_idx);
@@ -3504,7 +3517,7 @@ bpf_program__reloc_text(struct bpf_program *prog, struct bpf_object *obj,
 	size_t new_cnt;
 	int err;
 
-	if (relo->type != RELO_CALL)
+	if (relo->type != RELO_CALL && relo->type != RELO_FUNC)
 		return -LIBBPF_ERRNO__RELOC;
 
 	if (prog->idx == obj->efile.text_shndx) {
@@ -3544,6 +3557,20 @@ bpf_program__reloc_text(struct bpf_program *prog, struct bpf_object *obj,
 			 prog->section_name);
 	}
 	insn = &prog->insns[relo->insn_idx];
+	if (relo->type == RELO_FUNC) {
+		if (relo->insn_idx + 1 >= (int)prog->main_prog_cnt ||
+		    relo->text_off % sizeof(*insn)) {
+			pr_warn("bad callback relo in insn %d into off %d\n",
+				relo->insn_idx, relo->text_off);
+			return -LIBBPF_ERRNO__RELOC;
+		}
+		insn[0].src_reg = BPF_PSEUDO_FUNC;
+		insn[0].imm = prog->main_prog_cnt +
+			      relo->text_off / sizeof(*insn) -
+			      relo->insn_idx - 1;
+		insn[1].imm = 0;
+		return 0;
+	}
 	insn->imm += prog->main_prog_cnt - relo->insn_idx;
 	return 0;
 }
@@ -3589,7 +3616,8 @@ bpf_program__relocate(struct bpf_program *prog, struct bpf_object *obj)
 				insns[insn_idx + 1].imm = insns[insn_idx].imm;
 			}
 			insns[insn_idx].imm = obj->maps[map_idx].fd;
-		} else if (prog->reloc_desc[i].type == RELO_CALL) {
+		} else if (prog->reloc_desc[i].type == RELO_CALL ||
+			   prog->reloc_desc[i].type == RELO_FUNC) {
 			err = bpf_program__reloc_text(prog, obj,
 						      &prog->reloc_desc[i]);
 			if (err)
@@ -3617,8 +3645,19 @@ bpf_object__relocate(struct bpf_object *obj, const char *targ_btf_path)
 			return err;
 		}
 	}
+	/* .text goes first, so the subprograms and callbacks copied into
+	 * the other programs have their map references resolved
+	 */
+	prog = bpf_object__find_prog_by_idx(obj, obj->efile.text_shndx);
+	err = bpf_program__relocate(prog, obj);
+	if (err) {
+		pr_warn("failed to relocate '%s'\n", prog->section_name);
+		return err;
+	}
 	for (i = 0; i < obj->nr_programs; i++) {
 		prog = &obj->programs[i];
+		if (prog->idx == obj->efile.text_shndx)
+			continue;
 
 		err = bpf_program__relocate(prog, obj);
 		if (err) {
@@ -4761,6 +4800,21 @@ void bpf_program__set_ifindex(struct bpf_program *prog, __u32 ifindex)
 	prog->prog_ifindex = ifindex;
 }
 
+/* Backported from libbpf 0.7 */
+__u32 bpf_program__flags(const struct bpf_program *prog)
+{
+	return prog->prog_flags;
+}
+
+int bpf_program__set_extra_flags(struct bpf_program *prog, __u32 extra_flags)
+{
+	if (prog->obj->loaded)
+		return -EBUSY;
+
+	prog->prog_flags |= extra_flags;
+	return 0;
+}
+
 const char *bpf_program__title(const struct bpf_program *prog, bool needs_copy)
 {
 	const char *title;
@@ -0,0 +1,410 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+static const char *__doc__ = "Pattern compiler benchmark\n"
+	" - Compares build time and peak RSS of the native Aho-Corasick builder\n"
+	"   with the pyahocorasick based common/str2dfa.py\n"
+	" - With --qgram, reports the packets the q-gram filter lets through\n"
+	"   and its throughput next to the DFA, on synthetic benign traffic\n"
+	" - With --short, reports how the DFA shrinks and its hits change when\n"
+	"   the patterns shorter than <n> bytes are matched apart from it\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <linux/types.h>
+
+#include "common/common_defines.h"
+#include "common/str2dfa.h"
+#include "common/qgram.h"
+#include "common/shortpat.h"
+
+#include "common_kern_user.h"
+
+static const char *python_script = "common/str2dfa.py";
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		   (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Run the Python builder in a child, so its peak RSS is measured apart */
+static int bench_python(const char *python, const char *pattern_file)
+{
+	struct timespec start;
+	struct rusage usage;
+	int status, fd;
+	pid_t pid;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "ERR: fork failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		/* The script prints every pattern */
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0)
+			dup2(fd, STDOUT_FILENO);
+		execlp(python, python, python_script, pattern_file, (char *)NULL);
+		_exit(127);
+	}
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		fprintf(stderr, "ERR: wait4 failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "ERR: %s %s failed, is pyahocorasick installed?\n",
+				python, python_script);
+		return -1;
+	}
+	printf("python: %8.3f s, peak RSS %8ld KB\n", elapsed(&start),
+		   usage.ru_maxrss);
+	return 0;
+}
+
+static int bench_native(const char *pattern_file)
+{
+	struct str2dfa_kv *entries;
+	struct timespec start;
+	struct rusage usage;
+	int n_entry;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	n_entry = str2dfa_fromfile(pattern_file, &entries);
+	if (n_entry < 0)
+		return -1;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("native: %8.3f s, peak RSS %8ld KB, %d entries\n",
+		   elapsed(&start), usage.ru_maxrss, n_entry);
+	free(entries);
+	return 0;
+}
+
+/* Synthetic benign traffic: full-size payloads of HTTP-like text, and
+ * one in BENCH_BINARY_EVERY of random bytes like compressed or encrypted
+ * content
+ */
+#define BENCH_PKTS 4096
+#define BENCH_PAYLOAD_LEN 1460
+#define BENCH_BINARY_EVERY 4
+
+static const char *bench_words[] = {
+	"GET ", "POST ", "HTTP/1.1", "200 OK", "Host: ", "User-Agent: ",
+	"Mozilla/5.0 ", "Accept: ", "text/html", "application/json",
+	"Content-Length: ", "Content-Type: ", "Cookie: ", "session=",
+	"Connection: keep-alive", "Cache-Control: no-cache", "www.", ".com",
+	"/index.html", "/api/v1/", "the ", "and ", "of ", "to ", "in ", "is ",
+	"\r\n", "<div class=\"", "</div>", "<a href=\"", "\">", "=", "&",
+};
+
+#define BENCH_WORDS (sizeof(bench_words) / sizeof(bench_words[0]))
+
+static void bench_traffic_init(unsigned char *payload)
+{
+	const char *word;
+	int i, len, n;
+
+	srand(1);
+	for (i = 0; i < BENCH_PKTS; i++, payload += BENCH_PAYLOAD_LEN) {
+		if (i % BENCH_BINARY_EVERY == 0) {
+			for (len = 0; len < BENCH_PAYLOAD_LEN; len++)
+				payload[len] = rand();
+			continue;
+		}
+		for (len = 0; len < BENCH_PAYLOAD_LEN; len += n) {
+			if (rand() % 3) {
+				word = bench_words[rand() % BENCH_WORDS];
+				n = strlen(word);
+				if (n > BENCH_PAYLOAD_LEN - len)
+					n = BENCH_PAYLOAD_LEN - len;
+				memcpy(payload + len, word, n);
+			} else {
+				/* A random lowercase word or number */
+				payload[len] = rand() % 2 ? 'a' + rand() % 26 :
+								'0' + rand() % 10;
+				n = 1;
+			}
+		}
+	}
+}
+
+/* Whether the filter lets the payload through, with the q-grams hashed
+ * into a bitmap like xdp_qgram does without a bloom filter
+ */
+static int bench_qgram_pass(const struct ids_qgram_bitmap *bitmap,
+							__u32 lens, const unsigned char *payload)
+{
+	__u32 window = 0, hash1, hash2, len;
+	__u64 key;
+	int i;
+
+	for (i = 0; i < BENCH_PAYLOAD_LEN; i++) {
+		window = window << 8 | payload[i];
+		for (len = 1; len <= IDS_QGRAM_LEN_MAX; len++) {
+			if (!(lens & (1U << len)) || i + 1 < (int)len)
+				continue;
+			key = IDS_QGRAM_KEY(len < 4 ? window & ((1U << (8 * len)) - 1) :
+								window, len);
+			hash1 = IDS_QGRAM_HASH1(key);
+			hash2 = IDS_QGRAM_HASH2(key);
+			if ((bitmap->bit[hash1 / 8] & (1 << (hash1 % 8))) &&
+				(bitmap->bit[hash2 / 8] & (1 << (hash2 % 8))))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* Whether the payload has some pattern, by the DFA over all of it like in
+ * match-all mode
+ */
+static int bench_dfa_hit(const struct str2dfa_dense *dfa,
+						 const unsigned char *payload)
+{
+	const struct str2dfa_trans *trans;
+	uint32_t state = 0;
+	int i, hit = 0;
+
+	for (i = 0; i < BENCH_PAYLOAD_LEN; i++) {
+		trans = &dfa->table[(long)state * dfa->n_class +
+							dfa->byte_class[payload[i]]];
+		state = trans->state;
+		hit |= trans->flag != 0;
+	}
+	return hit;
+}
+
+/* Fraction of the benign packets the q-gram filter and the DFA find
+ * something in, and the bytes/ns each one scans
+ */
+static int bench_qgram(const char *pattern_file, unsigned char *traffic)
+{
+	struct ids_qgram_bitmap *bitmap;
+	struct str2dfa_dense dfa;
+	struct qgram_set qgrams;
+	struct timespec start;
+	long n_pass = 0, n_hit = 0;
+	double qgram_s, dfa_s;
+	uint32_t i;
+	int pkt;
+
+	if (str2dfa_dense_fromfile(pattern_file, &dfa) < 0)
+		return -1;
+	if (qgram_set_build(&dfa, QGRAM_LEN_MAX, &qgrams) < 0) {
+		str2dfa_dense_free(&dfa);
+		return -1;
+	}
+	bitmap = calloc(1, sizeof(*bitmap));
+	if (!bitmap) {
+		qgram_set_free(&qgrams);
+		str2dfa_dense_free(&dfa);
+		return -1;
+	}
+	for (i = 0; i < qgrams.n_gram; i++) {
+		bitmap->bit[IDS_QGRAM_HASH1(qgrams.gram[i]) / 8] |=
+			1 << (IDS_QGRAM_HASH1(qgrams.gram[i]) % 8);
+		bitmap->bit[IDS_QGRAM_HASH2(qgrams.gram[i]) / 8] |=
+			1 << (IDS_QGRAM_HASH2(qgrams.gram[i]) % 8);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pkt = 0; pkt < BENCH_PKTS; pkt++)
+		n_pass += bench_qgram_pass(bitmap, qgrams.lens,
+								   traffic + pkt * BENCH_PAYLOAD_LEN);
+	qgram_s = elapsed(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pkt = 0; pkt < BENCH_PKTS; pkt++)
+		n_hit += bench_dfa_hit(&dfa, traffic + pkt * BENCH_PAYLOAD_LEN);
+	dfa_s = elapsed(&start);
+
+	printf("%s: %u grams of up to %d bytes, %.1f%% of the packets pass "
+		   "(%.1f%% hold a pattern), q-gram %.2f bytes/ns, DFA %.2f bytes/ns\n",
+		   pattern_file, qgrams.n_gram, qgrams.len,
+		   100.0 * n_pass / BENCH_PKTS, 100.0 * n_hit / BENCH_PKTS,
+		   (double)BENCH_PKTS * BENCH_PAYLOAD_LEN / (qgram_s * 1e9),
+		   (double)BENCH_PKTS * BENCH_PAYLOAD_LEN / (dfa_s * 1e9));
+	free(bitmap);
+	qgram_set_free(&qgrams);
+	str2dfa_dense_free(&dfa);
+	return 0;
+}
+
+/* Patterns found at an accepting state, its flag and the output links */
+static long bench_chain_len(const struct str2dfa_dense *dfa,
+							uint16_t flag)
+{
+	long n = 0;
+
+	for (; flag; flag = dfa->pattern_next[flag])
+		n++;
+	return n;
+}
+
+/* Scan the traffic with the DFA, and with the short pattern table like
+ * xdp_dpi does if sp is not NULL. Count the accepting transitions of the
+ * DFA, the hits of the table, and every pattern found through their output
+ * links. Return the seconds it took.
+ */
+static double bench_short_scan(const struct str2dfa_dense *dfa,
+							   const struct short_patterns *sp,
+							   const unsigned char *traffic, long *n_dfa_hit,
+							   long *n_short_hit, long *n_found)
+{
+	const struct short_pattern_way *way;
+	const struct str2dfa_trans *trans;
+	const unsigned char *payload;
+	struct timespec start;
+	uint32_t state, window, seen;
+	int pkt, i, w;
+
+	*n_dfa_hit = *n_short_hit = *n_found = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pkt = 0; pkt < BENCH_PKTS; pkt++) {
+		payload = traffic + pkt * BENCH_PAYLOAD_LEN;
+		state = window = seen = 0;
+		for (i = 0; i < BENCH_PAYLOAD_LEN; i++) {
+			trans = &dfa->table[(long)state * dfa->n_class +
+								dfa->byte_class[payload[i]]];
+			state = trans->state;
+			if (trans->flag) {
+				(*n_dfa_hit)++;
+				*n_found += bench_chain_len(dfa, trans->flag);
+			}
+			if (!sp)
+				continue;
+			window = window << 8 | payload[i];
+			if (seen < SHORT_PATTERN_LEN_MAX)
+				seen++;
+			way = sp->way + (size_t)(window & 0xffff) * SHORT_PATTERN_WAYS;
+			for (w = 0; w < SHORT_PATTERN_WAYS && way[w].len; w++) {
+				if (way[w].len > seen ||
+					(way[w].len == 3 &&
+					 way[w].prefix != ((window >> 16) & 0xff)) ||
+					(way[w].len == 4 && way[w].prefix != window >> 16))
+					continue;
+				(*n_short_hit)++;
+				*n_found += bench_chain_len(dfa, way[w].flag);
+				break;
+			}
+		}
+	}
+	return elapsed(&start);
+}
+
+/* The main DFA with and without the patterns shorter than short_len, the
+ * hits per KB of each part, and the bytes/ns of both scans. Both find the
+ * same patterns.
+ */
+static int bench_short(const char *pattern_file, int short_len,
+					   unsigned char *traffic)
+{
+	struct str2dfa_dense dfa;
+	struct short_patterns sp;
+	unsigned char *member;
+	long n_state, n_entry, n_short, dfa_hit, short_hit, found;
+	long split_dfa_hit, split_found;
+	double kb = (double)BENCH_PKTS * BENCH_PAYLOAD_LEN / 1024;
+	double full_s, split_s;
+	int err = -1;
+
+	if (str2dfa_dense_fromfile(pattern_file, &dfa) < 0)
+		return -1;
+	member = malloc(dfa.n_pattern + 1);
+	if (!member) {
+		str2dfa_dense_free(&dfa);
+		return -1;
+	}
+	n_state = dfa.n_state;
+	n_entry = dfa.n_state * dfa.n_class;
+	full_s = bench_short_scan(&dfa, NULL, traffic, &dfa_hit, &short_hit,
+							  &found);
+	n_short = short_patterns_select(&dfa, short_len, NULL, member);
+	if (n_short < 0 || short_patterns_split(&dfa, member) < 0 ||
+		short_patterns_build(&dfa, member, &sp) < 0)
+		goto out;
+	split_s = bench_short_scan(&dfa, &sp, traffic, &split_dfa_hit,
+							   &short_hit, &split_found);
+
+	printf("%s: %ld short patterns, DFA %ld -> %ld states, %ld -> %ld "
+		   "entries\n", pattern_file, n_short, n_state, dfa.n_state, n_entry,
+		   dfa.n_state * dfa.n_class);
+	printf("  DFA hits/KB %.3f -> %.3f, short table hits/KB %.3f, "
+		   "patterns found %ld -> %ld\n", dfa_hit / kb, split_dfa_hit / kb,
+		   short_hit / kb, found, split_found);
+	printf("  DFA alone %.2f bytes/ns, DFA and short table %.2f bytes/ns\n",
+		   (double)BENCH_PKTS * BENCH_PAYLOAD_LEN / (full_s * 1e9),
+		   (double)BENCH_PKTS * BENCH_PAYLOAD_LEN / (split_s * 1e9));
+	short_patterns_free(&sp);
+	err = found == split_found ? 0 : -1;
+	if (err)
+		fprintf(stderr, "ERR: the split DFA finds other patterns\n");
+
+out:
+	free(member);
+	str2dfa_dense_free(&dfa);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	const char *python = "python2";
+	unsigned char *traffic;
+	int i, short_len;
+
+	if (argc > 3 && !strcmp(argv[1], "--short")) {
+		short_len = atoi(argv[2]);
+		if (short_len < 2 || short_len > SHORT_PATTERN_LEN_MAX + 1) {
+			fprintf(stderr, "ERR: <n> must be from 2 to %d\n",
+					SHORT_PATTERN_LEN_MAX + 1);
+			return EXIT_FAIL_OPTION;
+		}
+		traffic = malloc((size_t)BENCH_PKTS * BENCH_PAYLOAD_LEN);
+		if (!traffic)
+			return EXIT_FAIL;
+		bench_traffic_init(traffic);
+		for (i = 3; i < argc; i++) {
+			if (bench_short(argv[i], short_len, traffic) < 0)
+				return EXIT_FAIL_RE2DFA;
+		}
+		free(traffic);
+		return EXIT_OK;
+	}
+	if (argc > 2 && !strcmp(argv[1], "--qgram")) {
+		traffic = malloc((size_t)BENCH_PKTS * BENCH_PAYLOAD_LEN);
+		if (!traffic)
+			return EXIT_FAIL;
+		bench_traffic_init(traffic);
+		for (i = 2; i < argc; i++) {
+			if (bench_qgram(argv[i], traffic) < 0)
+				return EXIT_FAIL_RE2DFA;
+		}
+		free(traffic);
+		return EXIT_OK;
+	}
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "%s\nUsage: %s <pattern_file> [python]\n"
+				"       %s --qgram <pattern_file>...\n"
+				"       %s --short <n> <pattern_file>...\n",
+				__doc__, argv[0], argv[0], argv[0]);
+		return EXIT_FAIL_OPTION;
+	}
+	if (argc == 3)
+		python = argv[2];
+
+	if (bench_native(argv[1]) < 0)
+		return EXIT_FAIL_RE2DFA;
+	if (bench_python(python, argv[1]) < 0)
+		return EXIT_FAIL;
+	return EXIT_OK;
+}
@@ -0,0 +1,479 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+static const char *__doc__ = "XDP IDS alert consumer\n"
+	" - Drains the alerts of ids_alert_map in batches into a binary log\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <signal.h>
+
+#include <locale.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <net/if.h>
+#include <linux/if_link.h> /* depend on kernel-headers installed */
+#include <linux/perf_event.h>
+
+#include "common/common_params.h"
+#include "common/common_user_bpf_xdp.h"
+
+#include "common_kern_user.h"
+
+#include "bpf_util.h" /* bpf_num_possible_cpus */
+
+#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
+
+/* Alerts pending before the consumer is woken up, by default */
+#define ALERT_WAKEUP 64
+/* Longest wait for a wakeup, so a partial batch is not kept too long */
+#define ALERT_POLL_MS 100
+/* Pages of each per-CPU perf buffer */
+#define ALERT_PERF_PAGES 64
+#define ALERT_LOG_BUFFER (1 << 20)
+
+/* The alert log starts with this header, then each alert follows as a
+ * struct ids_alert and its caplen payload bytes, padded to 8 bytes.
+ * The timestamps of the alerts are CLOCK_MONOTONIC, realtime_ns and
+ * monotonic_ns are taken together to convert them to wall-clock time.
+ */
+#define ALERT_LOG_MAGIC "IDSALERT"
+#define ALERT_LOG_VERSION 1
+
+struct alert_log_header {
+	char magic[8];
+	__u32 version;
+	__u32 alert_len;	/* sizeof(struct ids_alert) */
+	__u64 realtime_ns;
+	__u64 monotonic_ns;
+};
+
+#define ALERT_LOG_ALIGN(len) (((len) + 7) & ~7)
+
+static const char *ids_alert_map_name = "ids_alert_map";
+static const char *ids_alert_config_map_name = "ids_alert_config_map";
+static const char *ids_alert_lost_map_name = "ids_alert_lost_map";
+
+static const struct option_wrapper long_options[] = {
+
+	{{"help",        no_argument,		NULL, 'h' },
+	 "Show help", false},
+
+	{{"dev",         required_argument,	NULL, 'd' },
+	 "Operate on device <ifname>", "<ifname>", true},
+
+	{{"quiet",       no_argument,		NULL, 'q' },
+	 "Quiet mode (no output)"},
+
+	{{"alert-log",   required_argument,	NULL,  15 },
+	 "Append the alerts to the binary log <file>", "<file>"},
+
+	{{"wakeup",      required_argument,	NULL,  16 },
+	 "Wake up once <n> alerts are pending (default 64)", "<n>"},
+
+	{{0, 0, NULL,  0 }, NULL, false}
+};
+
+static volatile bool exiting;
+
+static void sig_handler(int signo)
+{
+	exiting = true;
+}
+
+static __u64 gettime(clockid_t clock)
+{
+	struct timespec t;
+
+	clock_gettime(clock, &t);
+	return (__u64) t.tv_sec * NANOSEC_PER_SEC + t.tv_nsec;
+}
+
+/* Alerts are written in one buffer per batch, not one write per alert */
+struct alert_log {
+	int fd;
+	char *buf;
+	size_t len;
+	__u64 n_alert;
+};
+
+static int alert_log_flush(struct alert_log *log)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < log->len) {
+		ret = write(log->fd, log->buf + off, log->len - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "ERR: writing the alert log: %s\n",
+					strerror(errno));
+			return -1;
+		}
+		off += ret;
+	}
+	log->len = 0;
+	return 0;
+}
+
+static int alert_log_open(struct alert_log *log, const char *file)
+{
+	struct alert_log_header header;
+
+	memset(log, 0, sizeof(*log));
+	log->fd = -1;
+	if (!file[0])
+		return 0;
+
+	log->fd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (log->fd < 0) {
+		fprintf(stderr, "ERR: can't open %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	log->buf = malloc(ALERT_LOG_BUFFER);
+	if (!log->buf) {
+		close(log->fd);
+		return -1;
+	}
+
+	/* Every run starts a new section, with its own clock pair */
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ALERT_LOG_MAGIC, sizeof(header.magic));
+	header.version = ALERT_LOG_VERSION;
+	header.alert_len = sizeof(struct ids_alert);
+	header.realtime_ns = gettime(CLOCK_REALTIME);
+	header.monotonic_ns = gettime(CLOCK_MONOTONIC);
+	memcpy(log->buf, &header, sizeof(header));
+	log->len = sizeof(header);
+	return alert_log_flush(log);
+}
+
+static void alert_log_close(struct alert_log *log)
+{
+	if (log->fd < 0)
+		return;
+	alert_log_flush(log);
+	close(log->fd);
+	free(log->buf);
+	log->fd = -1;
+}
+
+static void alert_log_write(struct alert_log *log,
+							const struct ids_alert *alert,
+							const void *payload)
+{
+	size_t caplen = alert->caplen, len;
+
+	log->n_alert++;
+	if (log->fd < 0)
+		return;
+
+	if (caplen > IDS_ALERT_PAYLOAD_LEN)
+		caplen = IDS_ALERT_PAYLOAD_LEN;
+	len = ALERT_LOG_ALIGN(sizeof(*alert) + caplen);
+	if (log->len + len > ALERT_LOG_BUFFER && alert_log_flush(log) < 0)
+		return;
+	memcpy(log->buf + log->len, alert, sizeof(*alert));
+	((struct ids_alert *)(log->buf + log->len))->caplen = caplen;
+	memcpy(log->buf + log->len + sizeof(*alert), payload, caplen);
+	memset(log->buf + log->len + sizeof(*alert) + caplen, 0,
+		   len - sizeof(*alert) - caplen);
+	log->len += len;
+}
+
+/* Consumer of the BPF ring buffer, mapped directly as the vendored libbpf
+ * predates ring_buffer__new(). The consumer position is only published
+ * once per batch.
+ */
+struct alert_ringbuf {
+	int epoll_fd;
+	unsigned long *consumer_pos;
+	unsigned long *producer_pos;
+	char *data;
+	unsigned long mask;
+	size_t page_size;
+	size_t len;
+};
+
+static int alert_ringbuf_open(struct alert_ringbuf *rb, int map_fd,
+							  __u32 max_entries)
+{
+	struct epoll_event event = { .events = EPOLLIN };
+	void *addr;
+
+	rb->page_size = sysconf(_SC_PAGESIZE);
+	rb->mask = max_entries - 1;
+	/* The data pages are mapped twice in a row, a record never wraps */
+	rb->len = rb->page_size + 2 * (size_t)max_entries;
+
+	addr = mmap(NULL, rb->page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				map_fd, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+	rb->consumer_pos = addr;
+
+	addr = mmap(NULL, rb->len, PROT_READ, MAP_SHARED, map_fd, rb->page_size);
+	if (addr == MAP_FAILED) {
+		munmap(rb->consumer_pos, rb->page_size);
+		return -1;
+	}
+	rb->producer_pos = addr;
+	rb->data = (char *)addr + rb->page_size;
+
+	rb->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (rb->epoll_fd < 0 ||
+		epoll_ctl(rb->epoll_fd, EPOLL_CTL_ADD, map_fd, &event) < 0) {
+		munmap(rb->producer_pos, rb->len);
+		munmap(rb->consumer_pos, rb->page_size);
+		return -1;
+	}
+	return 0;
+}
+
+static void alert_ringbuf_close(struct alert_ringbuf *rb)
+{
+	close(rb->epoll_fd);
+	munmap(rb->producer_pos, rb->len);
+	munmap(rb->consumer_pos, rb->page_size);
+}
+
+/* Consume every committed record, return the number of alerts */
+static int alert_ringbuf_drain(struct alert_ringbuf *rb,
+							   struct alert_log *log)
+{
+	unsigned long cons, prod;
+	struct ids_alert *alert;
+	__u32 *hdr, len;
+	int n = 0;
+
+	cons = __atomic_load_n(rb->consumer_pos, __ATOMIC_ACQUIRE);
+	prod = __atomic_load_n(rb->producer_pos, __ATOMIC_ACQUIRE);
+	while (cons < prod) {
+		hdr = (__u32 *)(rb->data + (cons & rb->mask));
+		len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			break;
+		cons += ALERT_LOG_ALIGN((len & ~BPF_RINGBUF_DISCARD_BIT) +
+								BPF_RINGBUF_HDR_SZ);
+		if (len & BPF_RINGBUF_DISCARD_BIT ||
+			len < sizeof(*alert) + IDS_ALERT_PAYLOAD_LEN)
+			continue;
+		alert = (struct ids_alert *)((char *)hdr + BPF_RINGBUF_HDR_SZ);
+		alert_log_write(log, alert, alert + 1);
+		n++;
+	}
+	__atomic_store_n(rb->consumer_pos, cons, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* With the perf buffer, the packet up to the end of the captured payload
+ * follows the alert
+ */
+struct alert_perf_sample {
+	struct perf_event_header header;
+	__u32 size;
+	char data[];
+};
+
+static enum bpf_perf_event_ret
+alert_perf_event(void *ctx, int cpu, struct perf_event_header *event)
+{
+	struct alert_perf_sample *sample = (struct alert_perf_sample *)event;
+	struct alert_log *log = ctx;
+	struct ids_alert *alert;
+
+	if (event->type != PERF_RECORD_SAMPLE ||
+		sample->size < sizeof(*alert))
+		return LIBBPF_PERF_EVENT_CONT;
+	alert = (struct ids_alert *)sample->data;
+	if (sample->size < sizeof(*alert) + alert->payload_offset + alert->caplen)
+		return LIBBPF_PERF_EVENT_CONT;
+	alert_log_write(log, alert,
+					sample->data + sizeof(*alert) + alert->payload_offset);
+	return LIBBPF_PERF_EVENT_CONT;
+}
+
+static __u64 alert_lost(int lost_map_fd)
+{
+	unsigned int nr_cpus = bpf_num_possible_cpus();
+	__u64 values[nr_cpus], sum = 0;
+	__u32 key = 0;
+	int i;
+
+	if (bpf_map_lookup_elem(lost_map_fd, &key, values) != 0)
+		return 0;
+	for (i = 0; i < nr_cpus; i++)
+		sum += values[i];
+	return sum;
+}
+
+static int alert_enable(int config_map_fd, __u32 enabled, __u32 wakeup)
+{
+	struct ids_alert_config alert_config = {
+		.enabled = enabled,
+		.wakeup = wakeup,
+	};
+	__u32 key = 0;
+
+	if (bpf_map_update_elem(config_map_fd, &key, &alert_config, 0) < 0) {
+		fprintf(stderr, "ERR: Failed to update bpf map file (%s): %s\n",
+				ids_alert_config_map_name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+const char *pin_basedir =  "/sys/fs/bpf";
+
+int main(int argc, char **argv)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_SOFTWARE,
+		.config = PERF_COUNT_SW_BPF_OUTPUT,
+		.sample_type = PERF_SAMPLE_RAW,
+	};
+	struct perf_buffer_raw_opts perf_opts = {};
+	struct perf_buffer *pb = NULL;
+	struct alert_ringbuf rb;
+	struct alert_log log;
+	struct bpf_map_info info = { 0 };
+	struct epoll_event event;
+	char pin_dir[PATH_MAX];
+	int alert_map_fd, config_map_fd, lost_map_fd;
+	__u64 now, last, last_alert = 0, lost, last_lost;
+	int len, ret, err = EXIT_OK;
+
+	struct config cfg = {
+		.ifindex = -1,
+		.alert_wakeup = ALERT_WAKEUP,
+	};
+
+	parse_cmdline_args(argc, argv, long_options, &cfg, __doc__);
+	if (cfg.ifindex == -1) {
+		fprintf(stderr, "ERR: required option --dev missing\n\n");
+		usage(argv[0], __doc__, long_options, (argc == 1));
+		return EXIT_FAIL_OPTION;
+	}
+	if (cfg.alert_wakeup < 1) {
+		fprintf(stderr, "ERR: --wakeup must be at least 1\n\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, cfg.ifname);
+	if (len < 0) {
+		fprintf(stderr, "ERR: creating pin dirname\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	alert_map_fd = open_bpf_map_file(pin_dir, ids_alert_map_name, &info);
+	config_map_fd = open_bpf_map_file(pin_dir, ids_alert_config_map_name,
+									  NULL);
+	lost_map_fd = open_bpf_map_file(pin_dir, ids_alert_lost_map_name, NULL);
+	if (alert_map_fd < 0 || config_map_fd < 0 || lost_map_fd < 0) {
+		return EXIT_FAIL_BPF;
+	}
+
+	if (alert_log_open(&log, cfg.alert_file) < 0) {
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (info.type == BPF_MAP_TYPE_RINGBUF) {
+		if (alert_ringbuf_open(&rb, alert_map_fd, info.max_entries) < 0) {
+			fprintf(stderr, "ERR: can't map %s: %s\n", ids_alert_map_name,
+					strerror(errno));
+			return EXIT_FAIL_BPF;
+		}
+	} else {
+		/* The perf buffer wakes the consumer up by itself */
+		attr.wakeup_events = cfg.alert_wakeup;
+		perf_opts.attr = &attr;
+		perf_opts.event_cb = alert_perf_event;
+		perf_opts.ctx = &log;
+		pb = perf_buffer__new_raw(alert_map_fd, ALERT_PERF_PAGES, &perf_opts);
+		if (libbpf_get_error(pb)) {
+			fprintf(stderr, "ERR: can't open the perf buffer of %s\n",
+					ids_alert_map_name);
+			return EXIT_FAIL_BPF;
+		}
+	}
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+	if (alert_enable(config_map_fd, 1, cfg.alert_wakeup) < 0) {
+		return EXIT_FAIL_BPF;
+	}
+
+	/* Trick to pretty printf with thousands separators use %' */
+	setlocale(LC_NUMERIC, "en_US");
+	if (verbose) {
+		printf("Draining %s (%s) from %s\n", ids_alert_map_name,
+			   pb ? "perf buffer" : "ring buffer", pin_dir);
+	}
+
+	last = gettime(CLOCK_MONOTONIC);
+	last_lost = alert_lost(lost_map_fd);
+	while (!exiting) {
+		if (pb) {
+			ret = perf_buffer__poll(pb, ALERT_POLL_MS);
+			if (ret < 0 && ret != -EINTR) {
+				err = EXIT_FAIL_BPF;
+				break;
+			}
+		} else {
+			/* Drain after a timeout too, the kernel only wakes us up
+			 * for full batches
+			 */
+			if (epoll_wait(rb.epoll_fd, &event, 1, ALERT_POLL_MS) < 0 &&
+				errno != EINTR) {
+				err = EXIT_FAIL_BPF;
+				break;
+			}
+			alert_ringbuf_drain(&rb, &log);
+		}
+		if (log.fd >= 0 && alert_log_flush(&log) < 0) {
+			err = EXIT_FAIL;
+			break;
+		}
+
+		now = gettime(CLOCK_MONOTONIC);
+		if (now - last >= NANOSEC_PER_SEC) {
+			lost = alert_lost(lost_map_fd);
+			if (verbose) {
+				printf("alerts %'11llu (%'10.0f alerts/s) lost %'11llu\n",
+					   log.n_alert,
+					   (double)(log.n_alert - last_alert) * NANOSEC_PER_SEC /
+					   (now - last), lost - last_lost);
+			}
+			last = now;
+			last_alert = log.n_alert;
+			last_lost = lost;
+		}
+	}
+
+	/* Stop the alerts first, then take what is left */
+	alert_enable(config_map_fd, 0, cfg.alert_wakeup);
+	if (pb) {
+		perf_buffer__poll(pb, 0);
+		perf_buffer__free(pb);
+	} else {
+		alert_ringbuf_drain(&rb, &log);
+		alert_ringbuf_close(&rb);
+	}
+	alert_log_close(&log);
+	return err;
+}
@@ -18,6 +18,10 @@
 #define memcpy(dest, src, n) __builtin_memcpy((dest), (src), (n))
 #endif
 
+#ifndef memset
+#define memset(dest, chr, n) __builtin_memset((dest), (chr), (n))
+#endif
+
 #define bpf_printk(fmt, ...)                                    \
 ({                                                              \
 	char ____fmt[] = fmt;                                   \
@@ -25,16 +29,343 @@
                          ##__VA_ARGS__);                        \
 })
 
-#define IDS_INSPECT_STRIDE 1
-#define IDS_INSPECT_MAP_SIZE 16777216
+/* Default size of ids_inspect_map and ids_inspect_ms_map. xdp_loader
+ * --map-size creates them with the sizes xdp_prog_user --table-size
+ * computes from the ruleset instead.
+ */
+#define IDS_INSPECT_MAP_SIZE 1048576
+#define IDS_INSPECT_ROOT_MAP_SIZE (1 << (8 * IDS_INSPECT_STRIDE))
+#define IDS_INSPECT_MS_MAP_SIZE 1048576
 #define IDS_INSPECT_DEPTH 200
-#define TAIL_CALL_MAP_SIZE 1
+/* Payload bytes xdp_prefilter and xdp_qgram test per tail call */
+#define IDS_PREFILTER_DEPTH 256
+#define IDS_QGRAM_DEPTH 256
+/* Payload bytes xdp_dpi_frags copies out of the packet per bpf_loop step,
+ * unrolled like xdp_dpi
+ */
+#define IDS_FRAGS_CHUNK IDS_INSPECT_DEPTH
+/* Q-grams the bloom filter is sized for */
+#define IDS_QGRAM_MAP_SIZE 65536
+#define IDS_FLOW_MAP_SIZE 65536
+#define IDS_VERDICT_MAP_SIZE 65536
+#define IDS_BLOCK_MAP_SIZE 65536
+/* 16384 prefixes for each slot */
+#define IDS_TRUST_MAP_SIZE (IDS_INSPECT_SLOTS * 16384)
+#define IDS_NSEC_PER_SEC 1000000000ULL
+/* PORT_GROUP_ENTRY_MAX of common/portgroup.h for each slot */
+#define IDS_PORT_GROUP_MAP_SIZE (IDS_INSPECT_SLOTS * 4096)
+#define IDS_PATTERN_MAP_SIZE (1 << (8 * sizeof(accept_state_flag)))
+/* Accepting states kept per packet in match-all mode, and output links
+ * followed from each of them
+ */
+#define IDS_MATCH_MAX 8
+#define IDS_MATCH_CHAIN_MAX 8
+/* Bound of the scan offset for the verifier, large enough for jumbo frames */
+#define IDS_SCAN_OFFSET_MAX 16383
+#define TAIL_CALL_MAP_SIZE IDS_DPI_PROG_MAX
+#define IDS_XSKS_MAP_SIZE 64
+/* Size of the alert ring buffer, a power of 2 multiple of the page size */
+#define IDS_ALERT_RINGBUF_SIZE (1 << 24)
+/* Ring buffer space taken by an alert, with the record header */
+#define IDS_ALERT_RECORD_SIZE \
+	(8 + sizeof(struct ids_alert) + IDS_ALERT_PAYLOAD_LEN)
+/* CPUs the perf buffer fallback has a slot for */
+#define IDS_ALERT_PERF_CPUS 128
 
+/* The DFA tables are not used directly, they are the templates of the
+ * tables xdp_prog_user creates for each slot of the *_slots maps below.
+ * xdp_loader --inner-map creates the slot maps from them.
+ */
+
+/* The dense DFA table, mmap-ed by xdp_prog_user to write it in one pass */
 struct bpf_map_def SEC("maps") ids_inspect_map = {
 	.type = BPF_MAP_TYPE_ARRAY,
-	.key_size = sizeof(struct ids_inspect_map_key),
+	.key_size = sizeof(ids_inspect_map_key),
 	.value_size = sizeof(struct ids_inspect_map_value),
 	.max_entries = IDS_INSPECT_MAP_SIZE,
+	.map_flags = BPF_F_MMAPABLE,
+};
+
+struct bpf_map_def SEC("maps") ids_inspect_root_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(struct ids_inspect_root_map_key),
+	.value_size = sizeof(struct ids_inspect_map_value),
+	.max_entries = IDS_INSPECT_ROOT_MAP_SIZE,
+};
+
+struct bpf_map_def SEC("maps") ids_inspect_ms_map = {
+	.type = BPF_MAP_TYPE_HASH,
+	.key_size = sizeof(struct ids_inspect_ms_map_key),
+	.value_size = sizeof(struct ids_inspect_map_value),
+	.max_entries = IDS_INSPECT_MS_MAP_SIZE,
+	.map_flags = BPF_F_NO_PREALLOC,
+};
+
+/* The output links of the patterns */
+struct bpf_map_def SEC("maps") ids_pattern_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_pattern_value),
+	.max_entries = IDS_PATTERN_MAP_SIZE,
+};
+
+/* The q-grams of the patterns. The bloom filter needs Linux 5.16, older
+ * kernels get a bitmap instead, see struct ids_qgram_bitmap.
+ */
+#ifdef HAVE_BLOOM_FILTER
+struct bpf_map_def SEC("maps") ids_qgram_map = {
+	.type = BPF_MAP_TYPE_BLOOM_FILTER,
+	.key_size = 0,
+	.value_size = sizeof(__u64),
+	.max_entries = IDS_QGRAM_MAP_SIZE,
+};
+#else
+struct bpf_map_def SEC("maps") ids_qgram_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_qgram_bitmap),
+	.max_entries = 1,
+};
+#endif
+
+/* Hits and bytes of the packets each pattern is found in, indexed by flag */
+struct bpf_map_def SEC("maps") ids_pattern_stats_map = {
+	.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct datarec),
+	.max_entries = IDS_PATTERN_MAP_SIZE,
+};
+
+struct bpf_map_def SEC("maps") ids_inspect_slots = {
+	.type = BPF_MAP_TYPE_ARRAY_OF_MAPS,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_INSPECT_SLOTS,
+};
+
+struct bpf_map_def SEC("maps") ids_inspect_root_slots = {
+	.type = BPF_MAP_TYPE_ARRAY_OF_MAPS,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_INSPECT_SLOTS,
+};
+
+struct bpf_map_def SEC("maps") ids_inspect_ms_slots = {
+	.type = BPF_MAP_TYPE_ARRAY_OF_MAPS,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_INSPECT_SLOTS,
+};
+
+struct bpf_map_def SEC("maps") ids_pattern_slots = {
+	.type = BPF_MAP_TYPE_ARRAY_OF_MAPS,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_INSPECT_SLOTS,
+};
+
+struct bpf_map_def SEC("maps") ids_qgram_slots = {
+	.type = BPF_MAP_TYPE_ARRAY_OF_MAPS,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_INSPECT_SLOTS,
+};
+
+/* The config of the DFA in each slot */
+struct bpf_map_def SEC("maps") ids_config_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_config),
+	.max_entries = IDS_INSPECT_SLOTS,
+};
+
+/* The slot new packets are inspected with */
+struct bpf_map_def SEC("maps") ids_active_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = 1,
+};
+
+struct bpf_map_def SEC("maps") ids_flow_map = {
+	.type = BPF_MAP_TYPE_LRU_HASH,
+	.key_size = sizeof(struct ids_flow_key),
+	.value_size = sizeof(struct ids_flow_value),
+	.max_entries = IDS_FLOW_MAP_SIZE,
+};
+
+/* Flows judged already, see enum ids_verdict */
+struct bpf_map_def SEC("maps") ids_verdict_map = {
+	.type = BPF_MAP_TYPE_LRU_HASH,
+	.key_size = sizeof(struct ids_flow_key),
+	.value_size = sizeof(struct ids_verdict_value),
+	.max_entries = IDS_VERDICT_MAP_SIZE,
+};
+
+/* Sources blocked after a drop, see struct ids_block_key */
+struct bpf_map_def SEC("maps") ids_block_map = {
+	.type = BPF_MAP_TYPE_LRU_HASH,
+	.key_size = sizeof(struct ids_block_key),
+	.value_size = sizeof(struct ids_block_value),
+	.max_entries = IDS_BLOCK_MAP_SIZE,
+};
+
+/* Trusted prefixes, see struct ids_trust_v4_key */
+struct bpf_map_def SEC("maps") ids_trust_v4_map = {
+	.type = BPF_MAP_TYPE_LPM_TRIE,
+	.key_size = sizeof(struct ids_trust_v4_key),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_TRUST_MAP_SIZE,
+	.map_flags = BPF_F_NO_PREALLOC,
+};
+
+struct bpf_map_def SEC("maps") ids_trust_v6_map = {
+	.type = BPF_MAP_TYPE_LPM_TRIE,
+	.key_size = sizeof(struct ids_trust_v6_key),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_TRUST_MAP_SIZE,
+	.map_flags = BPF_F_NO_PREALLOC,
+};
+
+struct bpf_map_def SEC("maps") ids_verdict_stats_map = {
+	.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct datarec),
+	.max_entries = IDS_VERDICT_MAX,
+};
+
+/* The port group of a destination port, see struct ids_port_group_key */
+struct bpf_map_def SEC("maps") ids_port_group_map = {
+	.type = BPF_MAP_TYPE_HASH,
+	.key_size = sizeof(struct ids_port_group_key),
+	.value_size = sizeof(struct ids_port_group_value),
+	.max_entries = IDS_PORT_GROUP_MAP_SIZE,
+};
+
+/* Scan context of the packet being inspected, passed from xdp_ids to the
+ * DPI programs and from one DPI tail call to the next. Tail calls stay on
+ * the same CPU, so a per-CPU slot is enough.
+ */
+struct ids_scan_ctx {
+	struct ids_flow_key key;	/* Flow of the packet, if tracked */
+	__u32 next_seq;
+	__u32 tracked;
+	__u64 start_ns;		/* When xdp_ids got the packet */
+	__u32 state;		/* DFA state to resume the scan from */
+	__u32 root;		/* Root state of the port group of the packet */
+	__u16 offset;		/* Offset of the next byte to scan */
+	__u16 n_tail_call;	/* DPI tail calls made for the packet */
+	__u32 slot;		/* DFA slot, fixed for the whole packet */
+	__u16 payload_offset;	/* Offset of the TCP/UDP payload */
+	__u16 n_match;		/* Accepting states met, in match-all mode */
+	accept_state_flag match[IDS_MATCH_MAX];	/* Their flags */
+	__u32 match_end[IDS_MATCH_MAX];	/* Payload bytes up to their ends */
+	__u32 qgram_window;	/* Last payload bytes xdp_qgram shifted in */
+	__u32 short_window;	/* Last payload bytes xdp_dpi shifted in */
+	__u32 short_seen;	/* How many of them there are, up to 4 */
+	__u32 depth;		/* Payload bytes to inspect, 0 for all */
+	__u32 verdict_cache;	/* Copy of the config, for ids_action_verdict */
+	__u32 block_ttl;	/* Likewise */
+	__u32 generation;	/* Likewise, for the flow states */
+	__u32 frags_offset;	/* offset of xdp_dpi_frags, which goes past 64KB */
+};
+
+#ifdef HAVE_XDP_FRAGS
+/* Where xdp_dpi_frags copies the payload to, one chunk at a time */
+struct ids_frags_buf {
+	__u8 data[IDS_FRAGS_CHUNK];
+};
+
+struct bpf_map_def SEC("maps") ids_frags_buf_map = {
+	.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_frags_buf),
+	.max_entries = 1,
+};
+#endif
+
+/* The 2-byte grams patterns begin with, see struct ids_prefilter */
+struct bpf_map_def SEC("maps") ids_prefilter_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_prefilter),
+	.max_entries = IDS_INSPECT_SLOTS,
+};
+
+/* The short patterns left out of the DFA, see struct ids_short_value */
+struct bpf_map_def SEC("maps") ids_short_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_short_value),
+	.max_entries = IDS_INSPECT_SLOTS * IDS_SHORT_ROWS,
+};
+
+struct bpf_map_def SEC("maps") ids_short_bitmap_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_short_bitmap),
+	.max_entries = IDS_INSPECT_SLOTS,
+};
+
+struct bpf_map_def SEC("maps") ids_scan_ctx_map = {
+	.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_scan_ctx),
+	.max_entries = 1,
+};
+
+/* Where IDS_ACTION_REDIRECT sends the packet, the device given to
+ * xdp_prog_user --redirect-dev
+ */
+struct bpf_map_def SEC("maps") ids_redirect_map = {
+	.type = BPF_MAP_TYPE_DEVMAP,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = 1,
+};
+
+/* Where IDS_ACTION_XSK sends the packet, the AF_XDP socket bound to the
+ * queue the packet came from
+ */
+struct bpf_map_def SEC("maps") ids_xsks_map = {
+	.type = BPF_MAP_TYPE_XSKMAP,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_XSKS_MAP_SIZE,
+};
+
+/* Alerts of the patterns found, drained by xdp_alert. The ring buffer
+ * needs Linux 5.8, older kernels get a perf buffer per CPU.
+ */
+#ifdef HAVE_RINGBUF
+struct bpf_map_def SEC("maps") ids_alert_map = {
+	.type = BPF_MAP_TYPE_RINGBUF,
+	.max_entries = IDS_ALERT_RINGBUF_SIZE,
+};
+#else
+struct bpf_map_def SEC("maps") ids_alert_map = {
+	.type = BPF_MAP_TYPE_PERF_EVENT_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u32),
+	.max_entries = IDS_ALERT_PERF_CPUS,
+};
+#endif
+
+struct bpf_map_def SEC("maps") ids_alert_config_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(struct ids_alert_config),
+	.max_entries = 1,
+};
+
+/* Alerts dropped because the consumer lags behind, the XDP path never
+ * waits for it
+ */
+struct bpf_map_def SEC("maps") ids_alert_lost_map = {
+	.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size = sizeof(__u32),
+	.value_size = sizeof(__u64),
+	.max_entries = 1,
 };
 
 struct bpf_map_def SEC("maps") tail_call_map = {
@@ -44,241 +375,1703 @@ struct bpf_map_def SEC("maps") tail_call_map = {
 	.max_entries = TAIL_CALL_MAP_SIZE,
 };
 
-struct meta_info {
-	__u8 unit;
-	__u8 tens;
-	__u16 raw;
-} __attribute__((aligned(4)));
+/* Save the final DFA state of a completely inspected TCP segment, so that
+ * the next in-order segment of the flow resumes from it.
+ */
+static __always_inline void save_flow_state(struct ids_scan_ctx *scan_ctx,
+											ids_inspect_state state)
+{
+	struct ids_flow_value flow_value;
+
+	if (!scan_ctx->tracked) {
+		return;
+	}
+	flow_value.next_seq = scan_ctx->next_seq;
+	flow_value.state = state;
+	flow_value.generation = scan_ctx->generation;
+	flow_value.short_window = scan_ctx->short_window;
+	flow_value.short_seen = scan_ctx->short_seen;
+	bpf_map_update_elem(&ids_flow_map, &scan_ctx->key, &flow_value, BPF_ANY);
+}
+
+/* Count a packet of a flow with the given verdict, and its frame bytes:
+ * the payload is not parsed yet for some verdicts
+ */
+static __always_inline void ids_verdict_count(struct xdp_md *ctx,
+											  __u32 verdict)
+{
+	struct datarec *rec;
+
+	rec = bpf_map_lookup_elem(&ids_verdict_stats_map, &verdict);
+	if (rec) {
+		rec->rx_packets++;
+		rec->rx_bytes += (ctx->data_end - ctx->data);
+	}
+}
+
+/* The tail call to go on with the scan failed, past MAX_TAIL_CALL_CNT (33)
+ * calls or with an empty tail call map entry: the rest of the payload is
+ * not inspected
+ */
+static __always_inline void ids_scan_cut_short(struct xdp_md *ctx)
+{
+	ids_verdict_count(ctx, IDS_VERDICT_CUT);
+}
+
+/* Act on the verdict of the flow of the packet, its payload counting
+ * toward the stream depth. Return 1 if the packet gets the verdict in
+ * *action without inspection, or 0 to inspect it.
+ */
+static __always_inline int ids_verdict_hit(struct xdp_md *ctx,
+										   struct ids_config *config,
+										   struct ids_scan_ctx *scan_ctx,
+										   int payload_len, __u32 *action)
+{
+	struct ids_verdict_value *verdict_value, new_value;
+	__u32 verdict = IDS_VERDICT_NONE;
+
+	if (!config->verdict_cache) {
+		return 0;
+	}
+	verdict_value = bpf_map_lookup_elem(&ids_verdict_map, &scan_ctx->key);
+	if (verdict_value) {
+		verdict = verdict_value->verdict;
+		/* The packet that crosses the depth is still inspected */
+		if (verdict == IDS_VERDICT_NONE && config->stream_depth &&
+			payload_len > 0) {
+			if (verdict_value->bytes >= config->stream_depth) {
+				verdict = IDS_VERDICT_DEPTH;
+				verdict_value->verdict = verdict;
+			} else {
+				__sync_fetch_and_add(&verdict_value->bytes, payload_len);
+			}
+		}
+	} else if (config->stream_depth && payload_len > 0) {
+		memset(&new_value, 0, sizeof(new_value));
+		new_value.bytes = payload_len;
+		bpf_map_update_elem(&ids_verdict_map, &scan_ctx->key, &new_value,
+							BPF_NOEXIST);
+	}
+	ids_verdict_count(ctx, verdict);
+	switch (verdict) {
+	case IDS_VERDICT_NONE:
+		return 0;
+	case IDS_VERDICT_DROP:
+		*action = XDP_DROP;
+		return 1;
+	default:
+		*action = XDP_PASS;
+		return 1;
+	}
+}
+
+/* Whether the source of the packet is blocked, only looked up when the
+ * ruleset blocks sources. An expired entry is removed on the way,
+ * xdp_prog_user --blocklist removes the others.
+ */
+static __always_inline int ids_source_blocked(struct xdp_md *ctx,
+											  struct ids_config *config,
+											  struct ids_flow_key *key)
+{
+	struct ids_block_value *block_value;
+
+	if (!config->block_ttl) {
+		return 0;
+	}
+	/* The source address is the key, as in ids_block_source */
+	block_value = bpf_map_lookup_elem(&ids_block_map, key->saddr);
+	if (!block_value) {
+		return 0;
+	}
+	if (bpf_ktime_get_ns() >= block_value->expire_ns) {
+		bpf_map_delete_elem(&ids_block_map, key->saddr);
+		return 0;
+	}
+	__sync_fetch_and_add(&block_value->packets, 1);
+	ids_verdict_count(ctx, IDS_VERDICT_BLOCK);
+	return 1;
+}
+
+/* Whether the packet comes from or goes to a trusted prefix of the slot,
+ * in the directions config->trust has prefixes for. Such a packet is counted
+ * and passed without the DPI.
+ */
+static __always_inline int ids_trusted(struct xdp_md *ctx,
+									   struct ids_config *config,
+									   __u32 slot, int ipv4,
+									   struct ids_flow_key *key)
+{
+	struct ids_trust_v4_key v4_key;
+	struct ids_trust_v6_key v6_key;
+	void *trust_value = NULL;
+
+	if (!config->trust) {
+		return 0;
+	}
+	if (ipv4) {
+		memset(&v4_key, 0, sizeof(v4_key));
+		v4_key.prefixlen = IDS_TRUST_PREFIX_BASE + 32;
+		v4_key.slot = slot;
+		if (config->trust & IDS_TRUST_SRC) {
+			v4_key.dir = IDS_TRUST_SRC;
+			memcpy(v4_key.addr, &key->saddr[0], sizeof(v4_key.addr));
+			trust_value = bpf_map_lookup_elem(&ids_trust_v4_map, &v4_key);
+		}
+		if (!trust_value && (config->trust & IDS_TRUST_DST)) {
+			v4_key.dir = IDS_TRUST_DST;
+			memcpy(v4_key.addr, &key->daddr[0], sizeof(v4_key.addr));
+			trust_value = bpf_map_lookup_elem(&ids_trust_v4_map, &v4_key);
+		}
+	} else {
+		memset(&v6_key, 0, sizeof(v6_key));
+		v6_key.prefixlen = IDS_TRUST_PREFIX_BASE + 128;
+		v6_key.slot = slot;
+		if (config->trust & IDS_TRUST_SRC) {
+			v6_key.dir = IDS_TRUST_SRC;
+			memcpy(v6_key.addr, key->saddr, sizeof(v6_key.addr));
+			trust_value = bpf_map_lookup_elem(&ids_trust_v6_map, &v6_key);
+		}
+		if (!trust_value && (config->trust & IDS_TRUST_DST)) {
+			v6_key.dir = IDS_TRUST_DST;
+			memcpy(v6_key.addr, key->daddr, sizeof(v6_key.addr));
+			trust_value = bpf_map_lookup_elem(&ids_trust_v6_map, &v6_key);
+		}
+	}
+	if (!trust_value) {
+		return 0;
+	}
+	ids_verdict_count(ctx, IDS_VERDICT_TRUST);
+	return 1;
+}
+
+/* Root state of the DFA of the port group the packet goes to, and how
+ * deep into the payload it is inspected. Its key is filled in up to the
+ * destination port.
+ */
+static __always_inline void ids_port_group(struct ids_config *config,
+										   struct ids_scan_ctx *scan_ctx)
+{
+	struct ids_port_group_value *group_value = NULL;
+	struct ids_port_group_key group_key;
+
+	if (config->port_groups) {
+		group_key.slot = scan_ctx->slot;
+		group_key.proto = scan_ctx->key.proto;
+		group_key.port = scan_ctx->key.dport;
+		group_value = bpf_map_lookup_elem(&ids_port_group_map, &group_key);
+	}
+	scan_ctx->root = group_value ? group_value->root : 0;
+	scan_ctx->depth = group_value ? group_value->depth : config->scan_depth;
+}
+
+/* Whether the byte at the given packet offset is past the depth of the
+ * port group. No pattern of the group ends there, the scan stops as at
+ * the end of the payload.
+ */
+static __always_inline int ids_past_depth(struct ids_scan_ctx *scan_ctx,
+										  __u32 offset)
+{
+	return scan_ctx->depth &&
+		   offset - scan_ctx->payload_offset >= scan_ctx->depth;
+}
+
+/* Nothing scanned so far is needed to find the next pattern, so the
+ * filters may skip ahead: the DFA is at the root, and the short pattern
+ * matcher has no bytes of the flow yet
+ */
+static __always_inline int ids_scan_fresh(struct ids_scan_ctx *scan_ctx)
+{
+	return scan_ctx->state == scan_ctx->root && !scan_ctx->short_seen;
+}
+
+/* Jump to the DPI program selected by xdp_prog_user, through the
+ * prefilter if the scan is fresh. Only returns if the tail calls fail.
+ */
+static __always_inline void ids_dpi_dispatch(struct xdp_md *ctx,
+											 struct ids_config *config,
+											 struct ids_scan_ctx *scan_ctx)
+{
+	if (config->prefilter && ids_scan_fresh(scan_ctx)) {
+		bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_PREFILTER);
+	}
+	bpf_tail_call(ctx, &tail_call_map, config->dpi_prog);
+}
+
+/* Count a hit of the pattern, like xdp_stats_record_action counts the
+ * actions
+ */
+static __always_inline void ids_pattern_count(struct xdp_md *ctx,
+											  accept_state_flag flag)
+{
+	__u32 stats_key = flag;
+	struct datarec *rec;
+
+	rec = bpf_map_lookup_elem(&ids_pattern_stats_map, &stats_key);
+	if (rec) {
+		rec->rx_packets++;
+		rec->rx_bytes += (ctx->data_end - ctx->data);
+	}
+}
+
+static __always_inline void ids_alert_lost(void)
+{
+	__u32 lost_key = 0;
+	__u64 *lost;
+
+	lost = bpf_map_lookup_elem(&ids_alert_lost_map, &lost_key);
+	if (lost) {
+		*lost += 1;
+	}
+}
+
+/* Copy the start of the payload after an alert, in the largest constant
+ * size the packet holds. Return the number of bytes copied.
+ */
+static __always_inline __u16 ids_alert_payload(__u8 *dest, __u8 *payload,
+											   void *data_end)
+{
+	if (payload + IDS_ALERT_PAYLOAD_LEN <= data_end) {
+		memcpy(dest, payload, IDS_ALERT_PAYLOAD_LEN);
+		return IDS_ALERT_PAYLOAD_LEN;
+	}
+	if (payload + IDS_ALERT_PAYLOAD_LEN / 2 <= data_end) {
+		memcpy(dest, payload, IDS_ALERT_PAYLOAD_LEN / 2);
+		return IDS_ALERT_PAYLOAD_LEN / 2;
+	}
+	if (payload + IDS_ALERT_PAYLOAD_LEN / 4 <= data_end) {
+		memcpy(dest, payload, IDS_ALERT_PAYLOAD_LEN / 4);
+		return IDS_ALERT_PAYLOAD_LEN / 4;
+	}
+	if (payload + IDS_ALERT_PAYLOAD_LEN / 8 <= data_end) {
+		memcpy(dest, payload, IDS_ALERT_PAYLOAD_LEN / 8);
+		return IDS_ALERT_PAYLOAD_LEN / 8;
+	}
+	return 0;
+}
+
+/* Send an alert of the accepting state met at the given packet offset to
+ * xdp_alert, if it is running. An alert that does not fit is counted as
+ * lost.
+ */
+static __always_inline void ids_alert(struct xdp_md *ctx,
+									  struct ids_scan_ctx *scan_ctx,
+									  accept_state_flag flag, __u32 offset)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ids_alert_config *alert_config;
+	__u32 alert_key = 0;
+	__u16 payload_offset;
+#ifdef HAVE_RINGBUF
+	struct ids_alert *alert;
+	__u64 flags;
+#else
+	struct ids_alert alert_buf;
+	struct ids_alert *alert = &alert_buf;
+	__u32 caplen;
+#endif
+
+	alert_config = bpf_map_lookup_elem(&ids_alert_config_map, &alert_key);
+	if (!alert_config || !alert_config->enabled) {
+		return;
+	}
+	payload_offset = scan_ctx->payload_offset;
+	if (payload_offset > IDS_SCAN_OFFSET_MAX) {
+		return;
+	}
+
+#ifdef HAVE_RINGBUF
+	alert = bpf_ringbuf_reserve(&ids_alert_map,
+								sizeof(*alert) + IDS_ALERT_PAYLOAD_LEN, 0);
+	if (!alert) {
+		ids_alert_lost();
+		return;
+	}
+#endif
+	memcpy(&alert->key, &scan_ctx->key, sizeof(alert->key));
+	alert->timestamp = scan_ctx->start_ns;
+	alert->pattern = flag;
+	alert->offset = offset - payload_offset;
+	alert->pkt_len = data_end - data;
+	alert->payload_offset = payload_offset;
+#ifdef HAVE_RINGBUF
+	alert->caplen = ids_alert_payload((__u8 *)(alert + 1),
+									  data + payload_offset, data_end);
+	/* Wake the consumer up once per batch of alerts */
+	flags = BPF_RB_NO_WAKEUP;
+	if (bpf_ringbuf_query(&ids_alert_map, BPF_RB_AVAIL_DATA) >=
+		(__u64)alert_config->wakeup * IDS_ALERT_RECORD_SIZE) {
+		flags = BPF_RB_FORCE_WAKEUP;
+	}
+	bpf_ringbuf_submit(alert, flags);
+#else
+	/* The perf buffer appends the packet itself, up to the end of the
+	 * captured payload
+	 */
+	caplen = alert->pkt_len - payload_offset;
+	if (caplen > IDS_ALERT_PAYLOAD_LEN) {
+		caplen = IDS_ALERT_PAYLOAD_LEN;
+	}
+	alert->caplen = caplen;
+	if (bpf_perf_event_output(ctx, &ids_alert_map, BPF_F_CURRENT_CPU |
+							  ((__u64)(payload_offset + caplen) << 32),
+							  alert, sizeof(*alert)) < 0) {
+		ids_alert_lost();
+	}
+#endif
+}
+
+/* Whether a pattern may end this many bytes into the payload, by the
+ * offset and depth of its rule. An end_max of 0xffff also takes the ends
+ * past 64KB of xdp_dpi_frags.
+ */
+static __always_inline int
+ids_pattern_in_window(struct ids_pattern_value *pattern_value, __u32 end)
+{
+	return end >= pattern_value->end_min &&
+		(end <= pattern_value->end_max || pattern_value->end_max == 0xffff);
+}
+
+/* Walk the list of an accepting state met at the given packet offset, up
+ * to IDS_MATCH_CHAIN_MAX patterns. Return the first pattern on it that
+ * may end there, or 0 if none may, and the greatest action of the
+ * patterns that may in *pattern_action. A pattern missing from the slot
+ * counts as a drop. Without windows, the head is the only lookup.
+ */
+static __always_inline accept_state_flag
+ids_pattern_window(struct ids_config *config, struct ids_scan_ctx *scan_ctx,
+				   accept_state_flag flag, __u32 offset,
+				   __u32 *pattern_action)
+{
+	struct ids_pattern_value *pattern_value;
+	accept_state_flag first = 0;
+	__u32 pattern_key, end;
+	void *pattern_map;
+	int j;
+
+	*pattern_action = IDS_ACTION_DROP;
+	pattern_map = bpf_map_lookup_elem(&ids_pattern_slots, &scan_ctx->slot);
+	if (!pattern_map) {
+		return flag;
+	}
+	*pattern_action = IDS_ACTION_COUNT;
+	end = offset - scan_ctx->payload_offset;
+	#pragma unroll
+	for (j = 0; j < IDS_MATCH_CHAIN_MAX; j++) {
+		if (!flag) {
+			break;
+		}
+		pattern_key = flag;
+		pattern_value = bpf_map_lookup_elem(pattern_map, &pattern_key);
+		if (!pattern_value) {
+			*pattern_action = IDS_ACTION_DROP;
+			return first ? first : flag;
+		}
+		if (!config->pattern_windows) {
+			*pattern_action = pattern_value->list_action;
+			return flag;
+		}
+		if (ids_pattern_in_window(pattern_value, end)) {
+			if (!first) {
+				first = flag;
+			}
+			if (pattern_value->action > *pattern_action) {
+				*pattern_action = pattern_value->action;
+			}
+		}
+		flag = pattern_value->next;
+	}
+	return first;
+}
+
+/* Judge the flow of the packet, its next packets get the verdict without
+ * inspection
+ */
+static __always_inline void ids_verdict_set(struct ids_scan_ctx *scan_ctx,
+											__u32 verdict)
+{
+	struct ids_verdict_value verdict_value;
+
+	if (!scan_ctx->verdict_cache) {
+		return;
+	}
+	memset(&verdict_value, 0, sizeof(verdict_value));
+	verdict_value.verdict = verdict;
+	bpf_map_update_elem(&ids_verdict_map, &scan_ctx->key, &verdict_value,
+						BPF_ANY);
+}
+
+/* Block the source of the packet for block_ttl seconds from now */
+static __always_inline void ids_block_source(struct ids_scan_ctx *scan_ctx)
+{
+	struct ids_block_value block_value;
+
+	if (!scan_ctx->block_ttl) {
+		return;
+	}
+	block_value.expire_ns = bpf_ktime_get_ns() +
+		scan_ctx->block_ttl * IDS_NSEC_PER_SEC;
+	block_value.packets = 0;
+	bpf_map_update_elem(&ids_block_map, scan_ctx->key.saddr, &block_value,
+						BPF_ANY);
+}
+
+/* XDP action for a packet the patterns of the given action are found in */
+static __always_inline __u32 ids_action_verdict(struct xdp_md *ctx,
+												struct ids_scan_ctx *scan_ctx,
+												__u32 pattern_action)
+{
+	switch (pattern_action) {
+	case IDS_ACTION_XSK:
+		return bpf_redirect_map(&ids_xsks_map, ctx->rx_queue_index, 0);
+	case IDS_ACTION_REDIRECT:
+		return bpf_redirect_map(&ids_redirect_map, 0, 0);
+	case IDS_ACTION_DROP:
+		ids_verdict_set(scan_ctx, IDS_VERDICT_DROP);
+		ids_block_source(scan_ctx);
+		return XDP_DROP;
+	case IDS_ACTION_PASS:
+		ids_verdict_set(scan_ctx, IDS_VERDICT_PASS);
+		return XDP_PASS;
+	default:
+		return XDP_PASS;
+	}
+}
+
+/* Remember an accepting state met in match-all mode, and where. Its
+ * patterns are checked against their windows at that offset once the scan
+ * is over. Consecutive hits of the same state are kept once, and alerted
+ * once.
+ */
+static __always_inline void ids_match_record(struct xdp_md *ctx,
+											 struct ids_scan_ctx *scan_ctx,
+											 accept_state_flag flag,
+											 __u32 offset)
+{
+	__u16 n_match = scan_ctx->n_match;
+
+	if (n_match > 0 && n_match <= IDS_MATCH_MAX &&
+		scan_ctx->match[n_match - 1] == flag) {
+		return;
+	}
+	if (n_match < IDS_MATCH_MAX) {
+		scan_ctx->match[n_match] = flag;
+		scan_ctx->match_end[n_match] = offset - scan_ctx->payload_offset;
+		ids_alert(ctx, scan_ctx, flag, offset);
+	}
+	if (n_match < 0xffff) {
+		scan_ctx->n_match = n_match + 1;
+	}
+}
+
+/* Act on the pattern of an accepting state met at the given packet
+ * offset. Return 1 if the packet gets the verdict in *action, or 0 to go
+ * on scanning.
+ */
+static __always_inline int ids_pattern_hit(struct xdp_md *ctx,
+										   struct ids_config *config,
+										   struct ids_scan_ctx *scan_ctx,
+										   accept_state_flag flag,
+										   __u32 offset, __u32 *action)
+{
+	__u32 pattern_action;
+
+	flag = ids_pattern_window(config, scan_ctx, flag, offset,
+							  &pattern_action);
+	if (!flag) {
+		return 0;
+	}
+	if (config->match_all) {
+		/* Report it with the others at the end */
+		ids_match_record(ctx, scan_ctx, flag, offset);
+		return 0;
+	}
+	ids_pattern_count(ctx, flag);
+	ids_alert(ctx, scan_ctx, flag, offset);
+	if (pattern_action == IDS_ACTION_COUNT) {
+		return 0;
+	}
+	*action = ids_action_verdict(ctx, scan_ctx, pattern_action);
+	return 1;
+}
+
+/* Shift a payload byte into the window of the short patterns, and return
+ * the flag of the longest one ending with it, or 0. The rest of them are
+ * on its output links.
+ */
+static __always_inline accept_state_flag
+ids_short_match(__u32 slot, struct ids_short_bitmap *bitmap, __u32 *window,
+				__u32 *seen, __u8 byte)
+{
+	struct ids_short_value *short_value;
+	struct ids_short_way *way;
+	__u32 row, short_key;
+	int i;
+
+	*window = *window << 8 | byte;
+	if (*seen < IDS_SHORT_LEN_MAX) {
+		*seen += 1;
+	}
+	row = *window & 0xffff;
+	if (!(bitmap->row[row >> 3] & (1 << (row & 7)))) {
+		return 0;
+	}
+	short_key = slot * IDS_SHORT_ROWS + row;
+	short_value = bpf_map_lookup_elem(&ids_short_map, &short_key);
+	if (!short_value) {
+		return 0;
+	}
+	#pragma unroll
+	for (i = 0; i < IDS_SHORT_WAYS; i++) {
+		way = &short_value->way[i];
+		if (!way->len) {
+			break;
+		}
+		/* The bytes before the payload are not in the window */
+		if (way->len > *seen) {
+			continue;
+		}
+		if ((way->len == 3 && way->prefix != ((*window >> 16) & 0xff)) ||
+			(way->len == 4 && way->prefix != *window >> 16)) {
+			continue;
+		}
+		return way->flag;
+	}
+	return 0;
+}
+
+/* Follow the output links of the accepting states met in the packet, and
+ * return the number of patterns found within their windows. The greatest
+ * action of them is returned in pattern_action.
+ */
+static __always_inline __u32 ids_match_expand(struct xdp_md *ctx,
+											  struct ids_scan_ctx *scan_ctx,
+											  __u32 *pattern_action)
+{
+	struct ids_pattern_value *pattern_value;
+	accept_state_flag flag;
+	__u32 pattern_key, n_pattern = 0;
+	void *pattern_map;
+	int i, j;
+
+	*pattern_action = IDS_ACTION_COUNT;
+	pattern_map = bpf_map_lookup_elem(&ids_pattern_slots, &scan_ctx->slot);
+	#pragma unroll
+	for (i = 0; i < IDS_MATCH_MAX; i++) {
+		if (i >= scan_ctx->n_match) {
+			break;
+		}
+		flag = scan_ctx->match[i];
+		#pragma unroll
+		for (j = 0; j < IDS_MATCH_CHAIN_MAX; j++) {
+			if (!flag) {
+				break;
+			}
+			pattern_value = NULL;
+			if (pattern_map) {
+				pattern_key = flag;
+				pattern_value = bpf_map_lookup_elem(pattern_map, &pattern_key);
+			}
+			if (!pattern_value) {
+				n_pattern++;
+				ids_pattern_count(ctx, flag);
+				*pattern_action = IDS_ACTION_DROP;
+				break;
+			}
+			if (ids_pattern_in_window(pattern_value, scan_ctx->match_end[i])) {
+				n_pattern++;
+				ids_pattern_count(ctx, flag);
+				if (pattern_value->action > *pattern_action) {
+					*pattern_action = pattern_value->action;
+				}
+			}
+			flag = pattern_value->next;
+		}
+	}
+	return n_pattern;
+}
+
+/* The scan of the packet is over. In match-all mode the greatest action
+ * of the patterns in the packet decides its fate once the whole payload
+ * is inspected.
+ */
+static __always_inline __u32 ids_match_end(struct xdp_md *ctx,
+										   struct ids_scan_ctx *scan_ctx)
+{
+	__u32 pattern_action;
+
+	if (!scan_ctx->n_match) {
+		return XDP_PASS;
+	}
+	ids_match_expand(ctx, scan_ctx, &pattern_action);
+	return ids_action_verdict(ctx, scan_ctx, pattern_action);
+}
+
+/*
+static __always_inline int inspect_payload(struct hdr_cursor *nh,void *data_end, ids_inspect_state init_state)
+{
+	// struct ids_inspect_unit *ids_unit = nh->pos;
+	ids_inspect_unit *ids_unit;
+	struct ids_inspect_map_key ids_map_key;
+	struct ids_inspect_map_value *ids_map_value;
+	int i;
+
+	ids_map_key.state = 0;
+	ids_map_key.padding = 0;
+
+	#pragma unroll
+	for (i = 0; i < IDS_INSPECT_DEPTH; i++) {
+		ids_unit = nh->pos;
+		if (ids_unit + 1 > data_end) {
+			// Reach the last byte of the packet 
+			return 0;
+		}
+		// memcpy(ids_map_key.unit.unit, ids_unit, IDS_INSPECT_STRIDE);
+		// memcpy(&(ids_map_key.unit), ids_unit, IDS_INSPECT_STRIDE);
+		ids_map_key.unit = *ids_unit;
+		// bpf_printk("char: %u\n", ids_map_key.unit);
+		// bpf_printk("src: %u\n", ids_map_key.state);
+		ids_map_value = bpf_map_lookup_elem(&ids_inspect_map, &ids_map_key);
+		if (ids_map_value) {
+			// Go to the next state according to DFA 
+			ids_map_key.state = ids_map_value->state;
+			// bpf_printk("dst: %u\n", ids_map_value->state);
+			if (ids_map_value->flag > 0) {
+				// An acceptable state, return the hit pattern number 
+				return ids_map_value->flag;
+			}
+		}
+		// Prepare for next scanning 
+		nh->pos += 1;
+	}
+
+	// The payload is not inspected completely 
+	return -1;
+}
+*/
+
+SEC("xdp_ids")
+int xdp_ids_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct ids_config *config;
+	struct ids_scan_ctx *scan_ctx;
+	struct ids_flow_value *flow_value;
+	struct ids_bench_meta *bench_meta;
+	struct hdr_cursor nh;
+	__u32 active_key = 0, scan_ctx_key = 0;
+	__u32 *active_slot;
+	int eth_type, ip_type, tcp_len, payload_len;
+	__u32 seq;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	struct ipv6hdr *ip6h;
+	struct udphdr *udph;
+	struct tcphdr *tcph;
+
+	/* Default action XDP_PASS, imply everything we couldn't parse, or that
+	 * we don't want to deal with, we just pass up the stack and let the
+	 * kernel deal with it.
+	 */
+	__u32 action = XDP_PASS; /* Default action */
+
+	nh.pos = data;
+
+	/* Parse packet */
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(&nh, data_end, &iph);
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		ip_type = parse_ip6hdr(&nh, data_end, &ip6h);
+	} else {
+		goto out;
+	}
+	if (ip_type < 0) {
+		goto out;
+	}
+
+	scan_ctx = bpf_map_lookup_elem(&ids_scan_ctx_map, &scan_ctx_key);
+	if (!scan_ctx) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	scan_ctx->tracked = 0;
+	scan_ctx->state = 0;
+	scan_ctx->n_tail_call = 0;
+	scan_ctx->n_match = 0;
+	scan_ctx->short_window = 0;
+	scan_ctx->short_seen = 0;
+	scan_ctx->start_ns = bpf_ktime_get_ns();
+
+	/* Inspect the whole packet with the DFA active now, even if
+	 * xdp_prog_user flips to another slot in the meantime
+	 */
+	bench_meta = (void *)(long)ctx->data_meta;
+	if ((void *)(bench_meta + 1) <= data) {
+		if (bench_meta->slot >= IDS_INSPECT_SLOTS) {
+			action = XDP_ABORTED;
+			goto out;
+		}
+		scan_ctx->slot = bench_meta->slot;
+	} else {
+		active_slot = bpf_map_lookup_elem(&ids_active_map, &active_key);
+		if (!active_slot) {
+			action = XDP_ABORTED;
+			goto out;
+		}
+		scan_ctx->slot = *active_slot;
+	}
+	config = bpf_map_lookup_elem(&ids_config_map, &scan_ctx->slot);
+	if (!config) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	scan_ctx->verdict_cache = config->verdict_cache;
+	scan_ctx->block_ttl = config->block_ttl;
+	scan_ctx->generation = config->generation;
+
+	/* The 5-tuple of the packet, the key of its flow and its alerts */
+	memset(&scan_ctx->key, 0, sizeof(scan_ctx->key));
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		scan_ctx->key.saddr[0] = iph->saddr;
+		scan_ctx->key.daddr[0] = iph->daddr;
+	} else {
+		memcpy(scan_ctx->key.saddr, &ip6h->saddr, sizeof(ip6h->saddr));
+		memcpy(scan_ctx->key.daddr, &ip6h->daddr, sizeof(ip6h->daddr));
+	}
+	/* A blocked source costs one lookup */
+	if (ids_source_blocked(ctx, config, &scan_ctx->key)) {
+		action = XDP_DROP;
+		goto out;
+	}
+	if (ids_trusted(ctx, config, scan_ctx->slot,
+					eth_type == bpf_htons(ETH_P_IP),
+					&scan_ctx->key)) {
+		goto out;
+	}
+
+	if (ip_type == IPPROTO_TCP) {
+		if ((tcp_len = parse_tcphdr(&nh, data_end, &tcph)) < 0) {
+			action = XDP_ABORTED;
+			goto out;
+		}
+		/* Track the flow, so a pattern split across segments is found */
+		if (eth_type == bpf_htons(ETH_P_IP)) {
+			payload_len = bpf_ntohs(iph->tot_len) - iph->ihl * 4 - tcp_len;
+		} else {
+			payload_len = bpf_ntohs(ip6h->payload_len) - tcp_len;
+		}
+		scan_ctx->key.sport = tcph->source;
+		scan_ctx->key.dport = tcph->dest;
+		scan_ctx->key.proto = IPPROTO_TCP;
+		if (ids_verdict_hit(ctx, config, scan_ctx, payload_len, &action)) {
+			goto out;
+		}
+		ids_port_group(config, scan_ctx);
+		scan_ctx->state = scan_ctx->root;
+		/* With a depth, every pattern of the group lies within one
+		 * payload, nothing is carried to the next segment
+		 */
+		if (payload_len > 0 && !scan_ctx->depth) {
+			seq = bpf_ntohl(tcph->seq);
+			flow_value = bpf_map_lookup_elem(&ids_flow_map, &scan_ctx->key);
+			if (flow_value && flow_value->generation != scan_ctx->generation) {
+				/* The state of an older ruleset */
+				flow_value = NULL;
+			}
+			/* Resume only if this is the next in-order segment */
+			if (flow_value && flow_value->next_seq == seq) {
+				scan_ctx->state = flow_value->state;
+				scan_ctx->short_window = flow_value->short_window;
+				scan_ctx->short_seen = flow_value->short_seen;
+			}
+			/* A retransmission of data the flow is past is scanned from
+			 * the root, but keeps the in-order state for the next
+			 * segment. A segment past a gap starts the flow over.
+			 */
+			if (!flow_value || (__s32)(seq - flow_value->next_seq) >= 0) {
+				scan_ctx->next_seq = seq + payload_len;
+				scan_ctx->tracked = 1;
+			}
+		}
+	} else if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(&nh, data_end, &udph) < 0) {
+			action = XDP_ABORTED;
+			goto out;
+		}
+		scan_ctx->key.sport = udph->source;
+		scan_ctx->key.dport = udph->dest;
+		scan_ctx->key.proto = IPPROTO_UDP;
+		payload_len = bpf_ntohs(udph->len) - (int)sizeof(*udph);
+		if (ids_verdict_hit(ctx, config, scan_ctx, payload_len, &action)) {
+			goto out;
+		}
+		ids_port_group(config, scan_ctx);
+		scan_ctx->state = scan_ctx->root;
+	} else {
+		goto out;
+	}
+
+	/* Only packet with valid TCP/UDP header will reach here */
+	scan_ctx->offset = nh.pos - data;
+	scan_ctx->payload_offset = scan_ctx->offset;
+	scan_ctx->frags_offset = scan_ctx->offset;
+	/* Debug info */
+	// bpf_printk("Current packet pointer: %u\n", nh.pos);
+#ifdef HAVE_XDP_FRAGS
+	/* The other programs only see the linear data, a payload that goes on
+	 * in fragments is scanned by xdp_dpi_frags, unfiltered
+	 */
+	if (bpf_xdp_get_buff_len(ctx) > (__u64)(data_end - data)) {
+		bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_FRAGS);
+	}
+#endif
+	/* Only packets with a q-gram of some pattern go on to the DFA, unless
+	 * the flow is in the middle of a pattern
+	 */
+	if (config->qgram_lens && ids_scan_fresh(scan_ctx)) {
+		scan_ctx->qgram_window = 0;
+		bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_QGRAM);
+	}
+	ids_dpi_dispatch(ctx, config, scan_ctx);
+	bpf_printk("Tail call fails in xdp_ids!\n");
+	ids_scan_cut_short(ctx);
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+SEC("xdp_dpi")
+int xdp_dpi_func(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ids_scan_ctx *scan_ctx;
+	struct hdr_cursor nh;
+	__u32 scan_ctx_key = 0;
+	__u16 offset;
+	// int ids_state = 0;
+
+	/* Default action XDP_PASS, imply everything we couldn't parse, or that
+	 * we don't want to deal with, we just pass up the stack and let the
+	 * kernel deal with it.
+	 */
+	__u32 action = XDP_PASS; /* Default action */
+
+	scan_ctx = bpf_map_lookup_elem(&ids_scan_ctx_map, &scan_ctx_key);
+	if (!scan_ctx) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+
+	/* Compute current packet pointer */
+	offset = scan_ctx->offset;
+	if (offset > IDS_SCAN_OFFSET_MAX) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	nh.pos = data + offset;
+	if (nh.pos > data_end) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+
+	/* Debug info */
+	// bpf_printk("Tail call success!\n");
+	// bpf_printk("Current packet pointer: %u\n", nh.pos);
+
+	// ids_state = inspect_payload(&nh, data_end, init_state);
+
+	__u8 *ids_byte;
+	ids_inspect_state ids_state;
+	ids_inspect_map_key ids_map_key;
+	struct ids_inspect_map_value *ids_map_value;
+	struct ids_config *config;
+	struct ids_short_bitmap *short_bitmap = NULL;
+	__u32 short_window, short_seen;
+	accept_state_flag short_flag;
+	void *ids_map;
+	int i;
+	ids_state = scan_ctx->state;
+	short_window = scan_ctx->short_window;
+	short_seen = scan_ctx->short_seen;
+
+	/* The byte class map */
+	config = bpf_map_lookup_elem(&ids_config_map, &scan_ctx->slot);
+	if (!config) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	/* No DFA is loaded in the slot yet */
+	ids_map = bpf_map_lookup_elem(&ids_inspect_slots, &scan_ctx->slot);
+	if (!ids_map) {
+		goto out;
+	}
+	if (config->short_patterns) {
+		short_bitmap = bpf_map_lookup_elem(&ids_short_bitmap_map,
+										   &scan_ctx->slot);
+	}
+
+	#pragma unroll
+	for (i = 0; i < IDS_INSPECT_DEPTH; i++) {
+		ids_byte = nh.pos;
+		if (ids_byte + 1 > data_end ||
+			ids_past_depth(scan_ctx, nh.pos - data)) {
+			/* Reach the last byte of the packet, or the depth */
+			action = ids_match_end(ctx, scan_ctx);
+			if (action == XDP_PASS) {
+				scan_ctx->short_window = short_window;
+				scan_ctx->short_seen = short_seen;
+				save_flow_state(scan_ctx, ids_state);
+			}
+			goto out;
+		}
+		ids_map_key = IDS_INSPECT_MAP_INDEX(ids_state,
+			config->byte_class[*ids_byte], config->n_class);
+		// bpf_printk("char: %u\n", *ids_byte);
+		// bpf_printk("src: %u\n", ids_state);
+		ids_map_value = bpf_map_lookup_elem(ids_map, &ids_map_key);
+		if (ids_map_value) {
+			/* Go to the next state according to DFA */
+			ids_state = ids_map_value->state;
+			// bpf_printk("dst: %u\n", ids_map_value->state);
+			/* An acceptable state, act on the hit pattern */
+			if (ids_map_value->flag > 0 &&
+				ids_pattern_hit(ctx, config, scan_ctx, ids_map_value->flag,
+								nh.pos - data, &action)) {
+				goto out;
+			}
+		}
+		/* The short patterns ending here, which the DFA does not have */
+		if (short_bitmap) {
+			short_flag = ids_short_match(scan_ctx->slot, short_bitmap,
+										 &short_window, &short_seen,
+										 *ids_byte);
+			if (short_flag > 0 &&
+				ids_pattern_hit(ctx, config, scan_ctx, short_flag,
+								nh.pos - data, &action)) {
+				goto out;
+			}
+		}
+		/* Prepare for next scanning */
+		nh.pos += 1;
+	}
+
+
+	// bpf_printk("ids_state: %d\n", ids_state);
+	// if (ids_state > 0) {
+	// 	action = XDP_DROP;
+	// 	bpf_printk("The %dth pattern is triggered\n", ids_state);
+	// 	goto out;
+	// } else if (ids_state < 0) {
+	scan_ctx->state = ids_state;
+	scan_ctx->short_window = short_window;
+	scan_ctx->short_seen = short_seen;
+	scan_ctx->offset = nh.pos - data;
+	scan_ctx->n_tail_call++;
+	/* Back at the root, skip to where the next pattern can begin. The
+	 * short patterns may need the bytes before, they are not skipped.
+	 */
+	if (config->prefilter && !config->short_patterns &&
+		ids_state == scan_ctx->root) {
+		bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_PREFILTER);
+	}
+	bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_STRIDE1);
+	bpf_printk("Tail call fails in xdp_dpi after %d calls!\n",
+			   scan_ctx->n_tail_call);
+	ids_scan_cut_short(ctx);
+	action = ids_match_end(ctx, scan_ctx);
+	// } else {
+		/* The packet is inspected completely */
+		// goto out;
+	// }
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+/* Same as xdp_dpi, but each lookup consumes IDS_INSPECT_STRIDE bytes. The
+ * root state is looked up in the dense ids_inspect_root_map, the other
+ * states in ids_inspect_ms_map first and fall back to the root row if
+ * they have no entry there. The remaining bytes shorter than a stride are
+ * inspected by ids_inspect_map.
+ */
+SEC("xdp_dpi_s2")
+int xdp_dpi_s2_func(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ids_scan_ctx *scan_ctx;
+	struct hdr_cursor nh;
+	__u32 scan_ctx_key = 0;
+	__u16 offset;
+
+	__u32 action = XDP_PASS; /* Default action */
+
+	scan_ctx = bpf_map_lookup_elem(&ids_scan_ctx_map, &scan_ctx_key);
+	if (!scan_ctx) {
+		action = XDP_ABORTED;
+		goto out;
+	}
 
-/*
-static __always_inline int inspect_payload(struct hdr_cursor *nh,void *data_end, ids_inspect_state init_state)
-{
-	// struct ids_inspect_unit *ids_unit = nh->pos;
-	ids_inspect_unit *ids_unit;
-	struct ids_inspect_map_key ids_map_key;
+	/* Compute current packet pointer */
+	offset = scan_ctx->offset;
+	if (offset > IDS_SCAN_OFFSET_MAX) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	nh.pos = data + offset;
+	if (nh.pos > data_end) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+
+	struct ids_inspect_stride_unit *ids_bytes;
+	struct ids_inspect_stride_unit ids_unit;
+	struct ids_inspect_ms_map_key ms_map_key;
+	struct ids_inspect_root_map_key root_map_key;
+	ids_inspect_map_key ids_map_key;
 	struct ids_inspect_map_value *ids_map_value;
-	int i;
+	struct ids_config *config;
+	void *ids_map, *root_map, *ms_map;
+	accept_state_flag flag;
+	int i, j;
+	memset(&ms_map_key, 0, sizeof(ms_map_key));
+	ms_map_key.state = scan_ctx->state;
+	memset(&root_map_key, 0, sizeof(root_map_key));
 
-	ids_map_key.state = 0;
-	ids_map_key.padding = 0;
+	/* The byte class map */
+	config = bpf_map_lookup_elem(&ids_config_map, &scan_ctx->slot);
+	if (!config) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	/* No DFA is loaded in the slot yet */
+	ids_map = bpf_map_lookup_elem(&ids_inspect_slots, &scan_ctx->slot);
+	root_map = bpf_map_lookup_elem(&ids_inspect_root_slots, &scan_ctx->slot);
+	ms_map = bpf_map_lookup_elem(&ids_inspect_ms_slots, &scan_ctx->slot);
+	if (!ids_map || !root_map || !ms_map) {
+		goto out;
+	}
 
 	#pragma unroll
 	for (i = 0; i < IDS_INSPECT_DEPTH; i++) {
-		ids_unit = nh->pos;
-		if (ids_unit + 1 > data_end) {
-			// Reach the last byte of the packet 
-			return 0;
+		ids_bytes = nh.pos;
+		if (ids_bytes + 1 > data_end ||
+			ids_past_depth(scan_ctx, nh.pos - data)) {
+			/* Less than one stride is left, or the depth is reached */
+			break;
+		}
+		#pragma unroll
+		for (j = 0; j < IDS_INSPECT_STRIDE; j++) {
+			ids_unit.unit[j] = config->byte_class[ids_bytes->unit[j]];
+		}
+		ids_map_value = NULL;
+		if (ms_map_key.state != 0) {
+			memcpy(&(ms_map_key.unit), &ids_unit, IDS_INSPECT_STRIDE);
+			ids_map_value = bpf_map_lookup_elem(ms_map, &ms_map_key);
+		}
+		if (!ids_map_value) {
+			/* Same transition as the root state */
+			memcpy(&(root_map_key.unit), &ids_unit, IDS_INSPECT_STRIDE);
+			ids_map_value = bpf_map_lookup_elem(root_map, &root_map_key);
 		}
-		// memcpy(ids_map_key.unit.unit, ids_unit, IDS_INSPECT_STRIDE);
-		// memcpy(&(ids_map_key.unit), ids_unit, IDS_INSPECT_STRIDE);
-		ids_map_key.unit = *ids_unit;
-		// bpf_printk("char: %u\n", ids_map_key.unit);
-		// bpf_printk("src: %u\n", ids_map_key.state);
-		ids_map_value = bpf_map_lookup_elem(&ids_inspect_map, &ids_map_key);
 		if (ids_map_value) {
-			// Go to the next state according to DFA 
-			ids_map_key.state = ids_map_value->state;
-			// bpf_printk("dst: %u\n", ids_map_value->state);
-			if (ids_map_value->flag > 0) {
-				// An acceptable state, return the hit pattern number 
-				return ids_map_value->flag;
+			/* Go to the next state according to DFA */
+			ms_map_key.state = ids_map_value->state;
+			/* Acceptable states, act on the patterns hit on the first
+			 * and on the last byte of the stride
+			 */
+			flag = ids_map_value->stride_flag;
+			if (flag > 0 &&
+				ids_pattern_hit(ctx, config, scan_ctx, flag,
+								nh.pos - data, &action)) {
+				goto out;
+			}
+			flag = ids_map_value->flag;
+			if (flag > 0 &&
+				ids_pattern_hit(ctx, config, scan_ctx, flag,
+								nh.pos - data + IDS_INSPECT_STRIDE - 1,
+								&action)) {
+				goto out;
 			}
 		}
-		// Prepare for next scanning 
-		nh->pos += 1;
+		/* Prepare for next scanning */
+		nh.pos += IDS_INSPECT_STRIDE;
 	}
 
-	// The payload is not inspected completely 
-	return -1;
+	if (i < IDS_INSPECT_DEPTH) {
+		/* Inspect the last bytes with the single-stride DFA */
+		#pragma unroll
+		for (i = 0; i < IDS_INSPECT_STRIDE - 1; i++) {
+			if (nh.pos + 1 > data_end ||
+				ids_past_depth(scan_ctx, nh.pos - data)) {
+				break;
+			}
+			ids_map_key = IDS_INSPECT_MAP_INDEX(ms_map_key.state,
+				config->byte_class[*(__u8 *)nh.pos], config->n_class);
+			ids_map_value = bpf_map_lookup_elem(ids_map, &ids_map_key);
+			if (ids_map_value) {
+				ms_map_key.state = ids_map_value->state;
+				flag = ids_map_value->flag;
+				if (flag > 0 &&
+					ids_pattern_hit(ctx, config, scan_ctx, flag,
+									nh.pos - data, &action)) {
+					goto out;
+				}
+			}
+			nh.pos += 1;
+		}
+		/* The packet is inspected completely */
+		action = ids_match_end(ctx, scan_ctx);
+		if (action == XDP_PASS) {
+			save_flow_state(scan_ctx, ms_map_key.state);
+		}
+		goto out;
+	}
+
+	scan_ctx->state = ms_map_key.state;
+	scan_ctx->offset = nh.pos - data;
+	scan_ctx->n_tail_call++;
+	if (config->prefilter && ms_map_key.state == scan_ctx->root) {
+		bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_PREFILTER);
+	}
+	bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_STRIDE2);
+	bpf_printk("Tail call fails in xdp_dpi_s2 after %d calls!\n",
+			   scan_ctx->n_tail_call);
+	ids_scan_cut_short(ctx);
+	action = ids_match_end(ctx, scan_ctx);
+
+out:
+	return xdp_stats_record_action(ctx, action);
 }
-*/
 
-SEC("xdp_ids")
-int xdp_ids_func(struct xdp_md *ctx)
+/* Test the 2-byte gram at each payload offset against ids_prefilter_map,
+ * and hand the packet to the DPI program at the first one a pattern can
+ * begin with. The DFA is at the root until there, since a pattern that
+ * began earlier would have a gram there too. If no gram of the payload
+ * can begin a pattern, the DFA is never run and would end at the root.
+ */
+SEC("xdp_prefilter")
+int xdp_prefilter_func(struct xdp_md *ctx)
 {
-	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
-	struct meta_info *meta;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ids_scan_ctx *scan_ctx;
+	struct ids_prefilter *prefilter;
+	struct ids_config *config;
 	struct hdr_cursor nh;
-	int eth_type, ip_type;
-	struct ethhdr *eth;
-	struct iphdr *iph;
-	struct ipv6hdr *ip6h;
-	struct udphdr *udph;
-	struct tcphdr *tcph;
-
-	/* Default action XDP_PASS, imply everything we couldn't parse, or that
-	 * we don't want to deal with, we just pass up the stack and let the
-	 * kernel deal with it.
-	 */
-	__u32 action = XDP_PASS; /* Default action */
+	__u32 scan_ctx_key = 0;
+	__u32 action = XDP_PASS;
+	__u16 offset, gram;
+	__u8 *ids_byte;
+	int i;
 
-	/* Prepare space for metadata */
-	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)) < 0) {
+	scan_ctx = bpf_map_lookup_elem(&ids_scan_ctx_map, &scan_ctx_key);
+	if (!scan_ctx) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	offset = scan_ctx->offset;
+	if (offset > IDS_SCAN_OFFSET_MAX) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	nh.pos = data + offset;
+	if (nh.pos > data_end) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	config = bpf_map_lookup_elem(&ids_config_map, &scan_ctx->slot);
+	if (!config) {
 		action = XDP_ABORTED;
 		goto out;
 	}
+	prefilter = bpf_map_lookup_elem(&ids_prefilter_map, &scan_ctx->slot);
+	if (!prefilter) {
+		goto dpi;
+	}
+
+	#pragma unroll
+	for (i = 0; i < IDS_PREFILTER_DEPTH; i++) {
+		ids_byte = nh.pos;
+		if (ids_byte + 1 > data_end ||
+			ids_past_depth(scan_ctx, nh.pos - data)) {
+			/* No pattern begins in the rest of the payload, or before
+			 * the depth. The flow resumes from the root, as without a
+			 * saved state.
+			 */
+			action = ids_match_end(ctx, scan_ctx);
+			goto out;
+		}
+		if (ids_byte + 2 > data_end) {
+			/* The last byte, a pattern may go on in the next segment */
+			if (prefilter->first[*ids_byte >> 3] & (1 << (*ids_byte & 7))) {
+				goto dpi;
+			}
+		} else {
+			gram = ids_byte[0] << 8 | ids_byte[1];
+			if (prefilter->gram[gram >> 3] & (1 << (gram & 7))) {
+				goto dpi;
+			}
+		}
+		nh.pos += 1;
+	}
 
-	/* Actually, I do not understand why we should reassign value to data.
-	 * But without the reassignment below, the program can not be loaded...
+	scan_ctx->offset = nh.pos - data;
+	scan_ctx->n_tail_call++;
+	bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_PREFILTER);
+
+dpi:
+	/* Run the DFA from here, the rest of the payload is not skipped if
+	 * the tail call above fails
 	 */
-	data = (void *)(long)ctx->data;
-	data_end = (void *)(long)ctx->data_end;
-	nh.pos = data;
+	scan_ctx->offset = nh.pos - data;
+	bpf_tail_call(ctx, &tail_call_map, config->dpi_prog);
+	bpf_printk("Tail call fails in xdp_prefilter after %d calls!\n",
+			   scan_ctx->n_tail_call);
+	ids_scan_cut_short(ctx);
+	action = ids_match_end(ctx, scan_ctx);
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+/* Shift the payload through a window of the last IDS_QGRAM_LEN_MAX bytes,
+ * and test its last bytes, as many as each length in qgram_lens, against
+ * the q-grams of the patterns in ids_qgram_map. Every pattern has one of
+ * them, so a payload without a hit holds no pattern, and the DFA only
+ * scans what a pattern may be in:
+ * - After a hit, from the longest pattern length before its end, where
+ *   the earliest pattern with that q-gram can begin. No pattern ends
+ *   before the hit.
+ * - Without a hit, nothing, or for a tracked TCP segment the last
+ *   qgram_tail bytes, from which the DFA gets to the state the next
+ *   segment resumes from.
+ */
+SEC("xdp_qgram")
+int xdp_qgram_func(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ids_scan_ctx *scan_ctx;
+	struct ids_config *config;
+	struct hdr_cursor nh;
+	void *qgram_map;
+#ifndef HAVE_BLOOM_FILTER
+	struct ids_qgram_bitmap *bitmap;
+	__u32 bitmap_key = 0, hash1, hash2;
+#endif
+	__u32 scan_ctx_key = 0;
+	__u32 action = XDP_PASS;
+	__u32 window, len, n_byte;
+	__u64 key;
+	long start;
+	__u16 offset;
+	int i;
 
-	/* Check the validity */
-	meta = (void *)(long)ctx->data_meta;
-	if (meta + 1 > data) {
+	scan_ctx = bpf_map_lookup_elem(&ids_scan_ctx_map, &scan_ctx_key);
+	if (!scan_ctx) {
 		action = XDP_ABORTED;
 		goto out;
 	}
-
-	/* Parse packet */
-	eth_type = parse_ethhdr(&nh, data_end, &eth);
-
-	if (eth_type == bpf_htons(ETH_P_IP)) {
-		ip_type = parse_iphdr(&nh, data_end, &iph);
-	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
-		ip_type = parse_ip6hdr(&nh, data_end, &ip6h);
-	} else {
+	offset = scan_ctx->offset;
+	if (offset > IDS_SCAN_OFFSET_MAX) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	nh.pos = data + offset;
+	if (nh.pos > data_end) {
+		action = XDP_ABORTED;
 		goto out;
 	}
+	config = bpf_map_lookup_elem(&ids_config_map, &scan_ctx->slot);
+	if (!config) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	/* No q-grams in the slot, inspect the whole payload */
+	start = scan_ctx->payload_offset;
+	qgram_map = bpf_map_lookup_elem(&ids_qgram_slots, &scan_ctx->slot);
+	if (!qgram_map) {
+		goto dpi;
+	}
+#ifndef HAVE_BLOOM_FILTER
+	bitmap = bpf_map_lookup_elem(qgram_map, &bitmap_key);
+	if (!bitmap) {
+		goto dpi;
+	}
+#endif
+	window = scan_ctx->qgram_window;
 
-	if (ip_type == IPPROTO_TCP) {
-		if (parse_tcphdr(&nh, data_end, &tcph) < 0) {
-			action = XDP_ABORTED;
-			goto out;
+	#pragma unroll
+	for (i = 0; i < IDS_QGRAM_DEPTH; i++) {
+		if (nh.pos + 1 > data_end ||
+			ids_past_depth(scan_ctx, nh.pos - data)) {
+			goto miss;
 		}
-	} else if (ip_type == IPPROTO_UDP) {
-		if (parse_udphdr(&nh, data_end, &udph) < 0) {
-			action = XDP_ABORTED;
-			goto out;
+		window = window << 8 | *(__u8 *)nh.pos;
+		nh.pos += 1;
+		n_byte = nh.pos - data - scan_ctx->payload_offset;
+		#pragma unroll
+		for (len = 1; len <= IDS_QGRAM_LEN_MAX; len++) {
+			if (!(config->qgram_lens & (1 << len)) || n_byte < len) {
+				continue;
+			}
+			key = IDS_QGRAM_KEY(len < 4 ? window & ((1U << (8 * len)) - 1) :
+								window, len);
+#ifdef HAVE_BLOOM_FILTER
+			if (bpf_map_peek_elem(qgram_map, &key) == 0) {
+				goto hit;
+			}
+#else
+			hash1 = IDS_QGRAM_HASH1(key);
+			hash2 = IDS_QGRAM_HASH2(key);
+			if ((bitmap->bit[hash1 >> 3] & (1 << (hash1 & 7))) &&
+				(bitmap->bit[hash2 >> 3] & (1 << (hash2 & 7)))) {
+				goto hit;
+			}
+#endif
 		}
-	} else {
+	}
+
+	scan_ctx->qgram_window = window;
+	scan_ctx->offset = nh.pos - data;
+	scan_ctx->n_tail_call++;
+	bpf_tail_call(ctx, &tail_call_map, IDS_DPI_PROG_QGRAM);
+	goto dpi;
+
+hit:
+	start = nh.pos - data;
+	start -= config->qgram_tail + 1;
+	goto dpi;
+
+miss:
+	if (!scan_ctx->tracked) {
+		action = ids_match_end(ctx, scan_ctx);
 		goto out;
 	}
+	start = nh.pos - data;
+	start -= config->qgram_tail;
 
-	/* Only packet with valid TCP/UDP header will reach here */
-	meta->raw = 0;
-	__u16 temp;
-	temp = nh.pos - data;
-	/* When adjusting the position of nh pointer, we cannot use 
-	the field in the meta directly. So we use unit and tens field 
-	to encode the nh pointer difference.*/
-	meta->unit = temp % 10;
-	meta->tens = temp / 10;
-	/* Debug info */
-	// bpf_printk("meta: %u\n", meta->raw);
-	// bpf_printk("Current packet pointer: %u\n", nh.pos);
-	bpf_tail_call(ctx, &tail_call_map, 0);
-	bpf_printk("Tail call fails in xdp_ids!\n");
+dpi:
+	if (start < scan_ctx->payload_offset) {
+		start = scan_ctx->payload_offset;
+	}
+	scan_ctx->offset = start;
+	ids_dpi_dispatch(ctx, config, scan_ctx);
+	bpf_printk("Tail call fails in xdp_qgram after %d calls!\n",
+			   scan_ctx->n_tail_call);
+	ids_scan_cut_short(ctx);
+	action = ids_match_end(ctx, scan_ctx);
 
 out:
 	return xdp_stats_record_action(ctx, action);
 }
 
-SEC("xdp_dpi")
-int xdp_dpi_func(struct xdp_md *ctx)
+/* Scan state shared with the bpf_loop callback */
+struct dpi_loop_ctx {
+	struct xdp_md *xdp;
+	struct ids_config *config;
+	struct ids_scan_ctx *scan_ctx;
+	void *ids_map;
+	__u32 offset;
+	ids_inspect_state state;
+	accept_state_flag flag;
+	__u32 pattern_action;
+};
+
+/* Inspect one payload byte, return 1 to stop the loop */
+static long dpi_loop_step(__u32 index, void *data)
+{
+	struct dpi_loop_ctx *loop_ctx = data;
+	void *pkt = (void *)(long)loop_ctx->xdp->data;
+	void *pkt_end = (void *)(long)loop_ctx->xdp->data_end;
+	struct ids_config *config = loop_ctx->config;
+	struct ids_inspect_map_value *ids_map_value;
+	ids_inspect_map_key ids_map_key;
+	__u32 offset = loop_ctx->offset;
+	accept_state_flag flag;
+	__u8 *ids_byte;
+
+	if (offset > IDS_SCAN_OFFSET_MAX) {
+		return 1;
+	}
+	ids_byte = pkt + offset;
+	if (ids_byte + 1 > pkt_end ||
+		ids_past_depth(loop_ctx->scan_ctx, offset)) {
+		/* Reach the last byte of the packet, or the depth */
+		return 1;
+	}
+	ids_map_key = IDS_INSPECT_MAP_INDEX(loop_ctx->state,
+		config->byte_class[*ids_byte], config->n_class);
+	ids_map_value = bpf_map_lookup_elem(loop_ctx->ids_map, &ids_map_key);
+	if (ids_map_value) {
+		/* Go to the next state according to DFA */
+		loop_ctx->state = ids_map_value->state;
+		flag = ids_map_value->flag;
+		if (flag > 0) {
+			flag = ids_pattern_window(config, loop_ctx->scan_ctx, flag,
+									  offset, &loop_ctx->pattern_action);
+		}
+		if (flag > 0 && config->match_all) {
+			/* Report it with the others at the end */
+			ids_match_record(loop_ctx->xdp, loop_ctx->scan_ctx, flag,
+							 offset);
+		} else if (flag > 0) {
+			/* An acceptable state, stop at the hit pattern unless it is
+			 * only counted
+			 */
+			ids_pattern_count(loop_ctx->xdp, flag);
+			ids_alert(loop_ctx->xdp, loop_ctx->scan_ctx, flag, offset);
+			if (loop_ctx->pattern_action != IDS_ACTION_COUNT) {
+				loop_ctx->flag = flag;
+				return 1;
+			}
+		}
+	}
+	loop_ctx->offset = offset + 1;
+	return 0;
+}
+
+/* Same DFA as xdp_dpi, but the whole payload is scanned by bpf_loop in one
+ * invocation instead of a tail call every IDS_INSPECT_DEPTH bytes.
+ * bpf_loop needs Linux 5.17, the loader skips it on older kernels.
+ */
+SEC("xdp_dpi_loop")
+int xdp_dpi_loop_func(struct xdp_md *ctx)
 {
 	void *data = (void *)(long)ctx->data;
 	void *data_end = (void *)(long)ctx->data_end;
-	void *data_meta = (void *)(long)ctx->data_meta;
-	struct meta_info *meta = data_meta;
-	struct hdr_cursor nh;
-	// int ids_state = 0;
+	struct ids_scan_ctx *scan_ctx;
+	struct dpi_loop_ctx loop_ctx;
+	__u32 scan_ctx_key = 0;
 
-	/* Default action XDP_PASS, imply everything we couldn't parse, or that
-	 * we don't want to deal with, we just pass up the stack and let the
-	 * kernel deal with it.
-	 */
 	__u32 action = XDP_PASS; /* Default action */
 
-	/* Compute current packet pointer */
-	nh.pos = data;
-
-	if (meta + 1 > data) {
-		return XDP_ABORTED;
+	scan_ctx = bpf_map_lookup_elem(&ids_scan_ctx_map, &scan_ctx_key);
+	if (!scan_ctx) {
+		action = XDP_ABORTED;
+		goto out;
 	}
 
-	if (nh.pos + meta->unit > data_end) {
+	loop_ctx.xdp = ctx;
+	loop_ctx.scan_ctx = scan_ctx;
+	loop_ctx.offset = scan_ctx->offset;
+	loop_ctx.state = scan_ctx->state;
+	loop_ctx.flag = 0;
+	loop_ctx.config = bpf_map_lookup_elem(&ids_config_map, &scan_ctx->slot);
+	if (!loop_ctx.config) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	/* No DFA is loaded in the slot yet */
+	loop_ctx.ids_map = bpf_map_lookup_elem(&ids_inspect_slots,
+										   &scan_ctx->slot);
+	if (!loop_ctx.ids_map) {
+		goto out;
+	}
+	if (data + loop_ctx.offset > data_end) {
 		action = XDP_ABORTED;
 		goto out;
 	}
-	nh.pos += meta->unit;
-	
-	// ids_inspect_state init_state = meta->raw;
 
+	bpf_loop(data_end - data - loop_ctx.offset, dpi_loop_step, &loop_ctx, 0);
 
-	if ((nh.pos + meta->tens * 10) > data_end) {
-		action = XDP_ABORTED;
+	if (loop_ctx.flag > 0) {
+		action = ids_action_verdict(ctx, scan_ctx,
+									loop_ctx.pattern_action);
 		goto out;
 	}
-	nh.pos += meta->tens * 10;
+	/* The packet is inspected completely */
+	action = ids_match_end(ctx, scan_ctx);
+	if (action == XDP_PASS) {
+		save_flow_state(scan_ctx, loop_ctx.state);
+	}
 
-	/* Debug info */
-	// bpf_printk("Tail call success!\n");
-	// bpf_printk("meta: %u\n", meta->raw);
-	// bpf_printk("Current packet pointer: %u\n", nh.pos);
+out:
+	return xdp_stats_record_action(ctx, action);
+}
 
-	// ids_state = inspect_payload(&nh, data_end, init_state);
+#ifdef HAVE_XDP_FRAGS
+/* Scan state shared with the bpf_loop callback of xdp_dpi_frags */
+struct dpi_frags_ctx {
+	struct xdp_md *xdp;
+	struct ids_config *config;
+	struct ids_scan_ctx *scan_ctx;
+	struct ids_frags_buf *buf;
+	struct ids_short_bitmap *short_bitmap;
+	void *ids_map;
+	__u64 buff_len;
+	__u32 offset;
+	ids_inspect_state state;
+	__u32 short_window;
+	__u32 short_seen;
+	__u32 hit;		/* The packet got the verdict in action */
+	__u32 action;
+};
 
-	ids_inspect_unit *ids_unit;
-	struct ids_inspect_map_key ids_map_key;
+/* Copy the next IDS_FRAGS_CHUNK payload bytes into the per-CPU buffer and
+ * scan them, return 1 to stop the loop
+ */
+static long dpi_frags_step(__u32 index, void *data)
+{
+	struct dpi_frags_ctx *frags_ctx = data;
+	struct ids_scan_ctx *scan_ctx = frags_ctx->scan_ctx;
+	struct ids_config *config = frags_ctx->config;
+	struct ids_frags_buf *buf = frags_ctx->buf;
 	struct ids_inspect_map_value *ids_map_value;
-	int i;
-	ids_map_key.state = meta->raw;
-	ids_map_key.padding = 0;
+	ids_inspect_map_key ids_map_key;
+	ids_inspect_state ids_state;
+	accept_state_flag short_flag;
+	__u32 short_window, short_seen, offset, len, i;
+	__u8 ids_byte;
+
+	/* The next chunk, up to the end of the last fragment */
+	offset = frags_ctx->offset;
+	if (offset >= frags_ctx->buff_len) {
+		return 1;
+	}
+	len = frags_ctx->buff_len - offset;
+	if (len > IDS_FRAGS_CHUNK) {
+		len = IDS_FRAGS_CHUNK;
+	}
+	/* The bounds of the copy, as the verifier sees them */
+	if (len < 1 || len > IDS_FRAGS_CHUNK) {
+		return 1;
+	}
+	if (bpf_xdp_load_bytes(frags_ctx->xdp, offset, buf->data, len) < 0) {
+		frags_ctx->action = XDP_ABORTED;
+		frags_ctx->hit = 1;
+		return 1;
+	}
 
+	ids_state = frags_ctx->state;
+	short_window = frags_ctx->short_window;
+	short_seen = frags_ctx->short_seen;
 	#pragma unroll
-	for (i = 0; i < IDS_INSPECT_DEPTH; i++) {
-		ids_unit = nh.pos;
-		if (ids_unit + 1 > data_end) {
-			/* Reach the last byte of the packet */
-			return 0;
+	for (i = 0; i < IDS_FRAGS_CHUNK; i++) {
+		if (i >= len) {
+			break;
 		}
-		// memcpy(ids_map_key.unit.unit, ids_unit, IDS_INSPECT_STRIDE);
-		// memcpy(&(ids_map_key.unit), ids_unit, IDS_INSPECT_STRIDE);
-		ids_map_key.unit = *ids_unit;
-		// bpf_printk("char: %u\n", ids_map_key.unit);
-		// bpf_printk("src: %u\n", ids_map_key.state);
-		ids_map_value = bpf_map_lookup_elem(&ids_inspect_map, &ids_map_key);
+		if (ids_past_depth(scan_ctx, offset + i)) {
+			len = i;
+			frags_ctx->buff_len = offset + i;
+			break;
+		}
+		ids_byte = buf->data[i];
+		ids_map_key = IDS_INSPECT_MAP_INDEX(ids_state,
+			config->byte_class[ids_byte], config->n_class);
+		ids_map_value = bpf_map_lookup_elem(frags_ctx->ids_map,
+											&ids_map_key);
 		if (ids_map_value) {
 			/* Go to the next state according to DFA */
-			ids_map_key.state = ids_map_value->state;
-			// bpf_printk("dst: %u\n", ids_map_value->state);
-			if (ids_map_value->flag > 0) {
-				/* An acceptable state, return the hit pattern number */
-				action = XDP_DROP;
-				bpf_printk("The %dth pattern is triggered\n", ids_map_value->flag);
-				goto out;
+			ids_state = ids_map_value->state;
+			/* An acceptable state, act on the hit pattern */
+			if (ids_map_value->flag > 0 &&
+				ids_pattern_hit(frags_ctx->xdp, config, scan_ctx,
+								ids_map_value->flag, offset + i,
+								&frags_ctx->action)) {
+				frags_ctx->hit = 1;
+				return 1;
+			}
+		}
+		/* The short patterns ending here, which the DFA does not have */
+		if (frags_ctx->short_bitmap) {
+			short_flag = ids_short_match(scan_ctx->slot,
+										 frags_ctx->short_bitmap,
+										 &short_window, &short_seen,
+										 ids_byte);
+			if (short_flag > 0 &&
+				ids_pattern_hit(frags_ctx->xdp, config, scan_ctx,
+								short_flag, offset + i,
+								&frags_ctx->action)) {
+				frags_ctx->hit = 1;
+				return 1;
 			}
 		}
-		/* Prepare for next scanning */
-		nh.pos += 1;
 	}
+	frags_ctx->state = ids_state;
+	frags_ctx->short_window = short_window;
+	frags_ctx->short_seen = short_seen;
+	frags_ctx->offset = offset + len;
+	return frags_ctx->offset >= frags_ctx->buff_len;
+}
 
+/* Same DFA as xdp_dpi, for a payload that goes on in fragments past the
+ * linear data. bpf_loop copies it IDS_FRAGS_CHUNK bytes at a time into a
+ * per-CPU buffer with bpf_xdp_load_bytes and scans each chunk, so the
+ * whole of a 9000-byte frame is scanned in one invocation.
+ * It is only built with HAVE_XDP_FRAGS, as multi-buffer XDP needs Linux
+ * 5.18 (which has bpf_loop), and loaded with BPF_F_XDP_HAS_FRAGS like
+ * every program it is tail-called from.
+ */
+SEC("xdp_dpi_frags")
+int xdp_dpi_frags_func(struct xdp_md *ctx)
+{
+	struct dpi_frags_ctx frags_ctx;
+	struct ids_scan_ctx *scan_ctx;
+	__u32 scan_ctx_key = 0, buf_key = 0, n_chunk;
 
-	// bpf_printk("ids_state: %d\n", ids_state);
-	// if (ids_state > 0) {
-	// 	action = XDP_DROP;
-	// 	bpf_printk("The %dth pattern is triggered\n", ids_state);
-	// 	goto out;
-	// } else if (ids_state < 0) {
-	meta->raw = ids_map_key.state;
-	__u16 temp;
-	temp = nh.pos - data;
-	meta->unit = temp % 10;
-	meta->tens = temp / 10;
-	bpf_tail_call(ctx, &tail_call_map, 0);
-	bpf_printk("Tail call fails in xdp_dpi!\n");
-	// } else {
-		/* The packet is inspected completely */
-		// goto out;
-	// }
+	__u32 action = XDP_PASS; /* Default action */
+
+	memset(&frags_ctx, 0, sizeof(frags_ctx));
+	scan_ctx = bpf_map_lookup_elem(&ids_scan_ctx_map, &scan_ctx_key);
+	frags_ctx.buf = bpf_map_lookup_elem(&ids_frags_buf_map, &buf_key);
+	if (!scan_ctx || !frags_ctx.buf) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	frags_ctx.config = bpf_map_lookup_elem(&ids_config_map, &scan_ctx->slot);
+	if (!frags_ctx.config) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+	/* No DFA is loaded in the slot yet */
+	frags_ctx.ids_map = bpf_map_lookup_elem(&ids_inspect_slots,
+											&scan_ctx->slot);
+	if (!frags_ctx.ids_map) {
+		goto out;
+	}
+	if (frags_ctx.config->short_patterns) {
+		frags_ctx.short_bitmap = bpf_map_lookup_elem(&ids_short_bitmap_map,
+													 &scan_ctx->slot);
+	}
+	frags_ctx.xdp = ctx;
+	frags_ctx.scan_ctx = scan_ctx;
+	frags_ctx.state = scan_ctx->state;
+	frags_ctx.short_window = scan_ctx->short_window;
+	frags_ctx.short_seen = scan_ctx->short_seen;
+	frags_ctx.offset = scan_ctx->frags_offset;
+	frags_ctx.buff_len = bpf_xdp_get_buff_len(ctx);
+
+	if (frags_ctx.offset < frags_ctx.buff_len) {
+		n_chunk = (frags_ctx.buff_len - frags_ctx.offset +
+				   IDS_FRAGS_CHUNK - 1) / IDS_FRAGS_CHUNK;
+		if (bpf_loop(n_chunk, dpi_frags_step, &frags_ctx, 0) < 0) {
+			/* Too many chunks, the payload is not inspected */
+			ids_scan_cut_short(ctx);
+		}
+	}
+	if (frags_ctx.hit) {
+		action = frags_ctx.action;
+		goto out;
+	}
+
+	/* Reach the last byte of the packet, or the depth */
+	action = ids_match_end(ctx, scan_ctx);
+	if (action == XDP_PASS) {
+		scan_ctx->short_window = frags_ctx.short_window;
+		scan_ctx->short_seen = frags_ctx.short_seen;
+		save_flow_state(scan_ctx, frags_ctx.state);
+	}
 
 out:
 	return xdp_stats_record_action(ctx, action);
 }
+#endif /* HAVE_XDP_FRAGS */
 
 SEC("xdp_pass")
 int xdp_pass_func(struct xdp_md *ctx)
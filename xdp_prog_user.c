@@ -13,6 +13,9 @@ static const char *__doc__ = "XDP redirect helper\n"
 #include <locale.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libgen.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -20,6 +23,10 @@ static const char *__doc__ = "XDP redirect helper\n"
 #include <net/if.h>
 #include <linux/if_ether.h>
 #include <linux/if_link.h> /* depend on kernel-headers installed */
+#include <linux/ip.h>
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <arpa/inet.h>
 
 #include "common/common_params.h"
 #include "common/common_user_bpf_xdp.h"
@@ -30,12 +37,40 @@ static const char *__doc__ = "XDP redirect helper\n"
 /* re2dfa and str2dfa library */
 #include "common/re2dfa.h"
 #include "common/str2dfa.h"
+#include "common/msdfa.h"
+#include "common/ruleset.h"
+#include "common/portgroup.h"
+#include "common/qgram.h"
+#include "common/shortpat.h"
+#include "common/rules.h"
+#include "common/trust.h"
 
 #include "common_kern_user.h"
 
 #define LINE_BUFFER_MAX 160
 
 static const char *ids_inspect_map_name = "ids_inspect_map";
+static const char *ids_inspect_root_map_name = "ids_inspect_root_map";
+static const char *ids_inspect_ms_map_name = "ids_inspect_ms_map";
+static const char *ids_inspect_slots_name = "ids_inspect_slots";
+static const char *ids_inspect_root_slots_name = "ids_inspect_root_slots";
+static const char *ids_inspect_ms_slots_name = "ids_inspect_ms_slots";
+static const char *ids_pattern_map_name = "ids_pattern_map";
+static const char *ids_pattern_slots_name = "ids_pattern_slots";
+static const char *ids_redirect_map_name = "ids_redirect_map";
+static const char *ids_config_map_name = "ids_config_map";
+static const char *ids_active_map_name = "ids_active_map";
+static const char *ids_port_group_map_name = "ids_port_group_map";
+static const char *ids_prefilter_map_name = "ids_prefilter_map";
+static const char *ids_qgram_map_name = "ids_qgram_map";
+static const char *ids_qgram_slots_name = "ids_qgram_slots";
+static const char *ids_short_map_name = "ids_short_map";
+static const char *ids_short_bitmap_map_name = "ids_short_bitmap_map";
+static const char *ids_verdict_map_name = "ids_verdict_map";
+static const char *ids_block_map_name = "ids_block_map";
+static const char *ids_trust_v4_map_name = "ids_trust_v4_map";
+static const char *ids_trust_v6_map_name = "ids_trust_v6_map";
+static const char *tail_call_map_name = "tail_call_map";
 static const char *pattern_file_name = \
 		// "./patterns/snort2-community-rules-content.txt";
 		"./patterns/patterns.txt";
@@ -60,13 +95,58 @@ static const struct option_wrapper long_options[] = {
 	{{"quiet",       no_argument,		NULL, 'q' },
 	 "Quiet mode (no output)"},
 
-	{{0, 0, NULL,  0 }, NULL, false}
-};
+	{{"stride",      required_argument,	NULL,  4  },
+	 "Inspect <n> payload bytes per DFA lookup (1 or 2)", "<n>"},
+
+	{{"bench",       required_argument,	NULL,  5  },
+	 "Measure ns/packet of each DPI program over <n> runs", "<n>"},
+
+	{{"table-size",  no_argument,		NULL,  7  },
+	 "Print the ids_inspect_map size the patterns need and exit"},
+
+	{{"match-all",   no_argument,		NULL,  12 },
+	 "Inspect the whole payload and report every pattern in it"},
+
+	{{"actions",     required_argument,	NULL,  13 },
+	 "Read the action of each pattern from <file>", "<file>"},
+
+	{{"compile",     no_argument,		NULL,  8  },
+	 "Compile the patterns into a ruleset file and exit"},
+
+	{{"ruleset",     required_argument,	NULL,  9  },
+	 "Load (or with --compile, write) the ruleset <file>", "<file>"},
+
+	{{"patterns",    required_argument,	NULL,  10 },
+	 "Read the patterns from <file>", "<file>"},
+
+	{{"port-groups", required_argument,	NULL,  17 },
+	 "Split the patterns into the port groups of <file>", "<file>"},
+
+	{{"prefilter",   no_argument,		NULL,  18 },
+	 "Skip the payload up to where a pattern can begin"},
+
+	{{"qgram",       no_argument,		NULL,  19 },
+	 "Only inspect packets with a q-gram of some pattern"},
+
+	{{"short-len",   required_argument,	NULL,  20 },
+	 "Match patterns shorter than <n> bytes apart from the DFA", "<n>"},
+
+	{{"verdict-cache", no_argument,	NULL,  21 },
+	 "Drop or pass the rest of a flow once a drop or pass pattern is found"},
 
-/* Follow struct declaration is for fixing the bug of bpf_map_update_elem */
-struct ids_inspect_map_update_value {
-	struct ids_inspect_map_value value;
-	__u8 padding[8 - sizeof(struct ids_inspect_map_value)];
+	{{"stream-depth", required_argument,	NULL,  22 },
+	 "Pass a flow without inspection after <n> payload bytes", "<n>"},
+
+	{{"block-ttl",   required_argument,	NULL,  23 },
+	 "Drop the packets of a source for <s> seconds after a drop", "<s>"},
+
+	{{"blocklist",   no_argument,		NULL,  24 },
+	 "List the blocked sources, remove the expired ones and exit"},
+
+	{{"trust",       required_argument,	NULL,  25 },
+	 "Pass the packets of the prefixes in <file> without inspection", "<file>"},
+
+	{{0, 0, NULL,  0 }, NULL, false}
 };
 
 /*
@@ -101,7 +181,7 @@ static int re2dfa2map(char *re_string, int map_fd)
 	// Convert dfa to map
 	state = (struct DFA_state **) state_list.p_dat;
 	map_key.padding = 0;
-	map_value.padding = 0;
+	map_value.stride_flag = 0;
 	for (i_state = 0; i_state < n_state; i_state++, state++) {
 		int i_trans, n_trans = (*state)->n_transitions;
 		for (i_trans = 0; i_trans < n_trans; i_trans++) {
@@ -204,7 +284,7 @@ static int str2dfa2map(char **pattern_list, int pattern_number, int map_fd) {
 
 	// Convert dfa to map
 	map_key.padding = 0;
-	map_value.padding = 0;
+	map_value.stride_flag = 0;
 	for (i_entry = 0; i_entry < n_entry; i_entry++) {
 		map_key.state = map_entries[i_entry].key_state;
 		map_key.unit = map_entries[i_entry].key_unit;
@@ -234,76 +314,1485 @@ static int str2dfa2map(char **pattern_list, int pattern_number, int map_fd) {
 }
 */
 
-static int str2dfa2map_fromfile(const char *pattern_file, int ids_map_fd) {
-	struct str2dfa_kv *map_entries;
-	int i_entry, n_entry;
-	int i_cpu, n_cpu = libbpf_num_possible_cpus();
-	struct ids_inspect_map_key ids_map_key;
-	struct ids_inspect_map_update_value ids_map_values[n_cpu];
-	ids_inspect_state value_state;
-	accept_state_flag value_flag;
+/* The patterns shorter than short_len bytes that are in no port group
+ * and fit in the short pattern table, in *short_member. It is NULL if
+ * there are none.
+ */
+static int short_patterns_choose(const struct str2dfa_dense *dfa,
+								 int short_len,
+								 const struct port_group_rule *rules,
+								 int n_rule, unsigned char **short_member)
+{
+	unsigned char *eligible, *member;
+	long i, n_short;
+	int i_rule;
 
-	printf("Number of CPUs: %d\n", n_cpu);
+	*short_member = NULL;
+	eligible = malloc(dfa->n_pattern + 1);
+	member = malloc(dfa->n_pattern + 1);
+	if (!eligible || !member) {
+		free(eligible);
+		free(member);
+		return -1;
+	}
+	/* The short pattern table is looked up by the bytes as they are */
+	for (i = 0; i <= dfa->n_pattern; i++)
+		eligible[i] = !dfa->pattern_nocase || !dfa->pattern_nocase[i];
+	for (i_rule = 0; i_rule < n_rule; i_rule++) {
+		for (i = rules[i_rule].first; i <= rules[i_rule].last; i++)
+			eligible[i] = 0;
+	}
+	n_short = short_patterns_select(dfa, short_len, eligible, member);
+	free(eligible);
+	if (n_short <= 0) {
+		free(member);
+		return n_short;
+	}
+	printf("Total %ld short patterns of less than %d bytes matched apart "
+		   "from the DFA\n", n_short, short_len);
+	*short_member = member;
+	return 0;
+}
 
-	/* Convert string to DFA first */
-	n_entry = str2dfa_fromfile(pattern_file, &map_entries);
-	if (n_entry < 0) {
+/* Compile the contents of a Snort rule file into the DFA, with the limits
+ * of the patterns. The port group rules come from the rule headers.
+ * Return their number, or -1 on error.
+ */
+static int rules_compile(const char *rule_file, struct str2dfa_dense *dfa,
+						 struct port_group_rule **group_rules)
+{
+	struct rules rules;
+	long n_expanded;
+	int n_rule;
+
+	if (rules_fromfile(rule_file, &rules) < 0)
+		return -1;
+	if (str2dfa_dense_frompatterns(rules.pattern_data, rules.pattern_offset,
+								   rules.n_pattern, rules.pattern_nocase,
+								   dfa) < 0) {
+		rules_free(&rules);
+		return -1;
+	}
+	if (dfa->pattern_nocase) {
+		n_expanded = rules_expanded_states(&rules);
+		if (n_expanded > 0)
+			printf("Folding the nocase patterns takes %ld states instead "
+				   "of %ld in their cases\n", dfa->n_state, n_expanded);
+	}
+	dfa->pattern_limit = rules.pattern_limit;
+	*group_rules = rules.group_rule;
+	n_rule = rules.n_group_rule;
+	rules.pattern_limit = NULL;
+	rules.group_rule = NULL;
+	rules_free(&rules);
+	return n_rule;
+}
+
+/* Compile the patterns into a dense DFA over byte classes, with one DFA
+ * per port group if a group file is given, or if the rules of a Snort
+ * rule file name ports. With short_len, the short patterns are left out
+ * of it, *short_member tells which they are.
+ */
+static int str2dfa_compile(const char *pattern_file, const char *group_file,
+						   int short_len, struct str2dfa_dense *dfa,
+						   struct port_groups *groups,
+						   unsigned char **short_member) {
+	struct port_group_rule *rules = NULL;
+	bool grouped = group_file[0];
+	int n_rule = 0;
+
+	memset(groups, 0, sizeof(*groups));
+	*short_member = NULL;
+	if (rules_file(pattern_file)) {
+		if (grouped) {
+			fprintf(stderr, "ERR: the port groups of %s come from its "
+					"rules, drop --port-groups\n", pattern_file);
+			return -1;
+		}
+		n_rule = rules_compile(pattern_file, dfa, &rules);
+		if (n_rule < 0) {
+			fprintf(stderr, "ERR: can't compile the rules of %s\n",
+					pattern_file);
+			return -1;
+		}
+		grouped = n_rule > 0;
+	} else if (str2dfa_dense_fromfile(pattern_file, dfa) < 0) {
 		fprintf(stderr, "ERR: can't convert the String to DFA/Map\n");
 		return -1;
-	} else {
-		printf("Totol %d entries generated from pattern list\n", n_entry);
 	}
+	if (group_file[0]) {
+		n_rule = port_group_rules_fromfile(group_file, dfa->n_pattern,
+										   &rules);
+		if (n_rule < 0) {
+			str2dfa_dense_free(dfa);
+			return -1;
+		}
+	}
+	if (short_len &&
+		short_patterns_choose(dfa, short_len, rules, n_rule,
+							  short_member) < 0) {
+		fprintf(stderr, "ERR: can't choose the short patterns\n");
+		goto error;
+	}
+	if (grouped) {
+		if (port_groups_build(dfa, rules, n_rule, *short_member,
+							  groups) < 0)
+			goto error;
+		if (*short_member &&
+			short_patterns_unlink(dfa, *short_member) < 0) {
+			port_groups_free(groups);
+			goto error;
+		}
+	} else if (*short_member &&
+			   short_patterns_split(dfa, *short_member) < 0) {
+		goto error;
+	}
+	free(rules);
+	if ((unsigned long)dfa->n_state * dfa->n_class > UINT32_MAX) {
+		fprintf(stderr, "ERR: %ld states do not fit in %s\n",
+				dfa->n_state, ids_inspect_map_name);
+		str2dfa_dense_free(dfa);
+		port_groups_free(groups);
+		free(*short_member);
+		*short_member = NULL;
+		return -1;
+	}
+	return 0;
 
-	/* Initial */
-	ids_map_key.padding = 0;
-	memset(ids_map_values, 0, sizeof(ids_map_values));
-	/* Convert dfa to map */
-	for (i_entry = 0; i_entry < n_entry; i_entry++) {
-		ids_map_key.state = map_entries[i_entry].key_state;
-		ids_map_key.unit = map_entries[i_entry].key_unit;
-		value_state = map_entries[i_entry].value_state;
-		value_flag = map_entries[i_entry].value_flag;
-		for (i_cpu = 0; i_cpu < n_cpu; i_cpu++) {
-			ids_map_values[i_cpu].value.state = value_state;
-			ids_map_values[i_cpu].value.flag = value_flag;
-		}
-		if (bpf_map_update_elem(ids_map_fd,
-								&ids_map_key, ids_map_values, 0) < 0) {
+error:
+	free(rules);
+	str2dfa_dense_free(dfa);
+	free(*short_member);
+	*short_member = NULL;
+	return -1;
+}
+
+/* Fill the byte classes of the config, and compute the number of
+ * ids_inspect_map entries the DFA needs.
+ */
+static void str2dfa_config(const struct str2dfa_dense *dfa,
+						   struct ids_config *ids_config, __u32 *table_size) {
+	memcpy(ids_config->byte_class, dfa->byte_class,
+		   sizeof(ids_config->byte_class));
+	ids_config->n_class = dfa->n_class;
+	*table_size = dfa->n_state * dfa->n_class;
+	printf("Total %d byte classes, %ld states, %u entries in %s\n",
+		   dfa->n_class, dfa->n_state, *table_size, ids_inspect_map_name);
+}
+
+/* Number of entries uploaded per batch, between two progress updates */
+#define MAP_UPLOAD_CHUNK 65536
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 +
+		   (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Upload the entries in batches of MAP_UPLOAD_CHUNK, showing the progress
+ * on one line and a timing summary at the end.
+ */
+static int map_upload(int map_fd, const char *map_name,
+					  const void *keys, __u32 key_size,
+					  const void *values, __u32 value_size, __u32 n_entry)
+{
+	struct timespec start;
+	__u32 i_entry, n_chunk;
+	bool batched = false;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i_entry = 0; i_entry < n_entry; i_entry += n_chunk) {
+		n_chunk = n_entry - i_entry;
+		if (n_chunk > MAP_UPLOAD_CHUNK)
+			n_chunk = MAP_UPLOAD_CHUNK;
+		err = bpf_map_update_elems(map_fd,
+								   (const char *)keys + i_entry * key_size,
+								   key_size,
+								   (const char *)values + i_entry * value_size,
+								   value_size, n_chunk, BPF_ANY, &batched);
+		if (err < 0) {
 			fprintf(stderr,
-				"WARN: Failed to update bpf map file: err(%d):%s\n",
-				errno, strerror(errno));
+				"\nERR: Failed to update bpf map (%s): err(%d):%s\n",
+				map_name, -err, strerror(-err));
 			return -1;
+		}
+		if (verbose) {
+			printf("\r%s: %u/%u entries", map_name,
+				   i_entry + n_chunk, n_entry);
+			fflush(stdout);
+		}
+	}
+	if (verbose && n_entry > 0)
+		printf("\n");
+	printf("Total %u entries are inserted into %s in %.3f ms (%s)\n",
+		   n_entry, map_name, elapsed_ms(&start),
+		   batched ? "batch" : "per-entry");
+	return 0;
+}
+
+/* The dense table is copied as is into the values of ids_inspect_map */
+_Static_assert(sizeof(struct str2dfa_trans) ==
+			   sizeof(struct ids_inspect_map_value),
+			   "str2dfa_trans must match ids_inspect_map_value");
+
+/* Write the whole table into the mmap-ed ids_inspect_map with one memcpy.
+ * The entries past the table are cleared, so no stale transition of a
+ * larger ruleset is left behind.
+ */
+static int str2dfa2map_mmap(struct str2dfa_dense *dfa, int ids_map_fd,
+							const struct bpf_map_info *info) {
+	size_t table_len = sizeof(*dfa->table) * dfa->n_state * dfa->n_class;
+	size_t map_len = (size_t)info->max_entries * info->value_size;
+	struct timespec start;
+	void *map;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   ids_map_fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "ERR: can't mmap %s: %s\n",
+				ids_inspect_map_name, strerror(errno));
+		return -1;
+	}
+	memcpy(map, dfa->table, table_len);
+	memset((char *)map + table_len, 0, map_len - table_len);
+	munmap(map, map_len);
+	printf("Total %ld entries are copied into %s in %.3f ms (mmap)\n",
+		   dfa->n_state * dfa->n_class, ids_inspect_map_name,
+		   elapsed_ms(&start));
+	return 0;
+}
+
+static int str2dfa2map(struct str2dfa_dense *dfa, int ids_map_fd,
+					   const struct bpf_map_info *info) {
+	ids_inspect_map_key *ids_map_keys;
+	struct ids_inspect_map_value *ids_map_values;
+	__u32 index, n_entry = 0, table_size = dfa->n_state * dfa->n_class;
+	int err;
+
+	if (info->map_flags & BPF_F_MMAPABLE)
+		return str2dfa2map_mmap(dfa, ids_map_fd, info);
+
+	/* Maps pinned by an older loader: upload the transitions that do not
+	 * go back to the root
+	 */
+	ids_map_keys = calloc(table_size + 1, sizeof(*ids_map_keys));
+	ids_map_values = calloc(table_size + 1, sizeof(*ids_map_values));
+	if (!ids_map_keys || !ids_map_values) {
+		fprintf(stderr, "ERR: can't allocate the map entries\n");
+		free(ids_map_keys);
+		free(ids_map_values);
+		return -1;
+	}
+	for (index = 0; index < table_size; index++) {
+		if (!dfa->table[index].state && !dfa->table[index].flag)
+			continue;
+		ids_map_keys[n_entry] = index;
+		memcpy(&ids_map_values[n_entry], &dfa->table[index],
+			   sizeof(ids_map_values[n_entry]));
+		n_entry++;
+	}
+	err = map_upload(ids_map_fd, ids_inspect_map_name,
+					 ids_map_keys, sizeof(*ids_map_keys),
+					 ids_map_values, sizeof(*ids_map_values), n_entry);
+	free(ids_map_keys);
+	free(ids_map_values);
+	return err;
+}
+
+static const char *ids_action_names[IDS_ACTION_MAX] = {
+	[IDS_ACTION_COUNT] = "count",
+	[IDS_ACTION_XSK] = "xsk",
+	[IDS_ACTION_REDIRECT] = "redirect",
+	[IDS_ACTION_DROP] = "drop",
+	[IDS_ACTION_PASS] = "pass",
+};
+
+/* Read the actions of the patterns. Each line of the file is
+ *   <first>[-<last>] <action>
+ * where first and last are pattern numbers (1-based, as in the flags) or
+ * "*" for all patterns, and action is one of ids_action_names. Later
+ * lines override earlier ones, "#" starts a comment. Without a file
+ * every pattern drops the packet.
+ */
+static int pattern_actions_fromfile(const char *action_file, long n_pattern,
+									__u8 **result)
+{
+	char line[LINE_BUFFER_MAX], name[16];
+	long first, last, i;
+	int n_line = 0, action;
+	__u8 *actions;
+	FILE *fp;
+
+	actions = malloc(n_pattern + 1);
+	if (!actions)
+		return -1;
+	memset(actions, IDS_ACTION_DROP, n_pattern + 1);
+	if (!action_file[0])
+		goto done;
+
+	fp = fopen(action_file, "r");
+	if (!fp) {
+		fprintf(stderr, "ERR: can't open action file %s: %s\n",
+				action_file, strerror(errno));
+		free(actions);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		n_line++;
+		name[0] = '\0';
+		line[strcspn(line, "#\r\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0')
+			continue;
+		if (sscanf(line, " * %15s", name) == 1) {
+			first = 1;
+			last = n_pattern;
+		} else if (sscanf(line, " %ld-%ld %15s", &first, &last, name) == 3) {
+		} else if (sscanf(line, " %ld %15s", &first, name) == 2) {
+			last = first;
 		} else {
-			printf("---------------------------------------------------\n");
-			printf(
-				"New element is added in to map (%s)\n",
-				ids_inspect_map_name);
-			printf(
-				"Key - state: %d, unit: %c\n",
-				ids_map_key.state, ids_map_key.unit);
-			printf("Value - state: %d, flag: %d\n", value_state, value_flag);
-			printf("---------------------------------------------------\n");
+			first = 0;
+		}
+		for (action = 0; action < IDS_ACTION_MAX; action++) {
+			if (!strcmp(name, ids_action_names[action]))
+				break;
+		}
+		if (first < 1 || last < first || last > n_pattern ||
+			action == IDS_ACTION_MAX) {
+			fprintf(stderr, "ERR: %s:%d: expect <first>[-<last>] <action> "
+					"for patterns 1-%ld\n", action_file, n_line, n_pattern);
+			fclose(fp);
+			free(actions);
+			return -1;
+		}
+		for (i = first; i <= last; i++)
+			actions[i] = action;
+	}
+	fclose(fp);
+
+done:
+	*result = actions;
+	return 0;
+}
+
+/* Replace the port groups of the slot in ids_port_group_map. The slot is
+ * the standby one, so packets never see a half-written set.
+ */
+static int port_groups2map(const struct port_groups *groups, __u32 slot,
+						   int port_group_map_fd)
+{
+	struct ids_port_group_key key, next_key, *stale = NULL, *p;
+	struct ids_port_group_value value;
+	__u32 i, n_stale = 0, max_stale = 0;
+	void *prev = NULL;
+	int err = 0;
+
+	/* Collect the keys first, deleting while walking the hash skips some */
+	while (bpf_map_get_next_key(port_group_map_fd, prev, &next_key) == 0) {
+		key = next_key;
+		prev = &key;
+		if (key.slot != slot)
+			continue;
+		if (n_stale == max_stale) {
+			max_stale = max_stale ? max_stale * 2 : 256;
+			p = realloc(stale, sizeof(*stale) * max_stale);
+			if (!p) {
+				free(stale);
+				return -1;
+			}
+			stale = p;
+		}
+		stale[n_stale++] = key;
+	}
+	for (i = 0; i < n_stale; i++)
+		bpf_map_delete_elem(port_group_map_fd, &stale[i]);
+	free(stale);
+
+	for (i = 0; i < groups->n_entry; i++) {
+		memset(&key, 0, sizeof(key));
+		key.slot = slot;
+		key.proto = groups->entry[i].proto;
+		key.port = htons(groups->entry[i].port);
+		memset(&value, 0, sizeof(value));
+		value.root = groups->entry[i].root;
+		value.depth = groups->entry[i].depth;
+		if (bpf_map_update_elem(port_group_map_fd, &key, &value, 0) < 0) {
+			fprintf(stderr,
+				"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+				ids_port_group_map_name, errno, strerror(errno));
+			err = -1;
+			break;
+		}
+	}
+	return err;
+}
+
+/* Fill the prefilter of the slot with the 2-byte grams and the bytes the
+ * patterns begin with
+ */
+static int prefilter2map(const struct str2dfa_dense *dfa, __u32 slot,
+						 int prefilter_map_fd)
+{
+	struct ids_prefilter *prefilter;
+	const unsigned char *pattern;
+	unsigned char first[2], second[2];
+	long i, n_gram = 0;
+	__u32 len, gram;
+	int err = 0, n_first, n_second, j, k;
+
+	prefilter = calloc(1, sizeof(*prefilter));
+	if (!prefilter) {
+		fprintf(stderr, "ERR: can't allocate the prefilter\n");
+		return -1;
+	}
+	for (i = 1; i <= dfa->n_pattern; i++) {
+		pattern = dfa->pattern_data + dfa->pattern_offset[i - 1];
+		len = dfa->pattern_offset[i] - dfa->pattern_offset[i - 1];
+		if (len == 0)
+			continue;
+		/* A nocase pattern begins with its letters in either case */
+		first[0] = second[0] = pattern[0];
+		n_first = n_second = 1;
+		if (dfa->pattern_nocase && dfa->pattern_nocase[i]) {
+			if (str2dfa_letter(pattern[0]))
+				first[n_first++] = pattern[0] ^ 0x20;
+			if (len > 1 && str2dfa_letter(pattern[1]))
+				second[n_second++] = pattern[1] ^ 0x20;
+		}
+		if (len > 1)
+			second[0] = pattern[1];
+		for (j = 0; j < n_first; j++) {
+			prefilter->first[first[j] / 8] |= 1 << (first[j] % 8);
+			if (len == 1) {
+				/* Any byte may follow */
+				memset(prefilter->gram + first[j] * 256 / 8, 0xff, 256 / 8);
+				continue;
+			}
+			for (k = 0; k < n_second; k++) {
+				gram = first[j] << 8 | second[k];
+				prefilter->gram[gram / 8] |= 1 << (gram % 8);
+			}
+		}
+	}
+	for (i = 0; i < IDS_PREFILTER_GRAMS; i++)
+		n_gram += !!(prefilter->gram[i / 8] & (1 << (i % 8)));
+	printf("Prefilter: %ld of %d 2-byte grams (%.2f%%) can begin a pattern\n",
+		   n_gram, IDS_PREFILTER_GRAMS, 100.0 * n_gram / IDS_PREFILTER_GRAMS);
+
+	if (bpf_map_update_elem(prefilter_map_fd, &slot, prefilter, 0) < 0) {
+		fprintf(stderr,
+			"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+			ids_prefilter_map_name, errno, strerror(errno));
+		err = -1;
+	}
+	free(prefilter);
+	return err;
+}
+
+/* The q-gram filter settings of the config */
+static void qgram_config(const struct qgram_set *qgrams,
+						 struct ids_config *ids_config)
+{
+	ids_config->qgram_lens = qgrams->lens;
+	ids_config->qgram_tail = qgrams->max_pattern_len ?
+							 qgrams->max_pattern_len - 1 : 0;
+}
+
+/* Random q-grams tested against the table for its false positive rate */
+#define QGRAM_FP_SAMPLES 65536
+
+static bool qgram_bitmap_test(const struct ids_qgram_bitmap *bitmap,
+							  __u64 key)
+{
+	__u32 hash1 = IDS_QGRAM_HASH1(key), hash2 = IDS_QGRAM_HASH2(key);
+
+	return (bitmap->bit[hash1 / 8] & (1 << (hash1 % 8))) &&
+		   (bitmap->bit[hash2 / 8] & (1 << (hash2 % 8)));
+}
+
+/* Fill a q-gram table of a slot, a bloom filter or a bitmap like the
+ * ids_qgram_map template, and print the rate of random q-grams outside
+ * the set it lets through
+ */
+static int qgram2map(const struct qgram_set *qgrams, int qgram_map_fd,
+					 const struct bpf_map_info *info)
+{
+	struct ids_qgram_bitmap *bitmap = NULL;
+	long n_sample = 0, n_pass = 0;
+	__u32 i, len, gram, key = 0;
+	bool bloom, member, pass;
+	__u64 qgram;
+
+	bloom = info->type == BPF_MAP_TYPE_BLOOM_FILTER;
+	if (!bloom) {
+		bitmap = calloc(1, sizeof(*bitmap));
+		if (!bitmap) {
+			fprintf(stderr, "ERR: can't allocate the q-gram bitmap\n");
+			return -1;
+		}
+	}
+	for (i = 0; i < qgrams->n_gram; i++) {
+		qgram = qgrams->gram[i];
+		if (bloom) {
+			if (bpf_map_update_elem(qgram_map_fd, NULL, &qgram, 0) < 0)
+				break;
+		} else {
+			bitmap->bit[IDS_QGRAM_HASH1(qgram) / 8] |=
+				1 << (IDS_QGRAM_HASH1(qgram) % 8);
+			bitmap->bit[IDS_QGRAM_HASH2(qgram) / 8] |=
+				1 << (IDS_QGRAM_HASH2(qgram) % 8);
+		}
+	}
+	if (i < qgrams->n_gram ||
+		(!bloom && bpf_map_update_elem(qgram_map_fd, &key, bitmap, 0) < 0)) {
+		fprintf(stderr,
+			"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+			ids_qgram_map_name, errno, strerror(errno));
+		free(bitmap);
+		return -1;
+	}
+
+	/* A payload window is tested once for each length */
+	srand(1);
+	for (i = 0; i < QGRAM_FP_SAMPLES; i++) {
+		gram = (__u32)rand() << 16 ^ (__u32)rand();
+		member = pass = false;
+		for (len = 1; len <= IDS_QGRAM_LEN_MAX; len++) {
+			if (!(qgrams->lens & (1U << len)))
+				continue;
+			qgram = IDS_QGRAM_KEY(len < 4 ? gram & ((1U << (8 * len)) - 1) :
+								  gram, len);
+			member |= qgram_set_find(qgrams, qgram);
+			if (bloom)
+				pass |= bpf_map_lookup_elem(qgram_map_fd, NULL, &qgram) == 0;
+			else
+				pass |= qgram_bitmap_test(bitmap, qgram);
+		}
+		if (member)
+			continue;
+		n_sample++;
+		n_pass += pass;
+	}
+	printf("Q-gram filter: %u grams of up to %d bytes in a %s, %.4f%% "
+		   "false positives per payload window\n", qgrams->n_gram,
+		   qgrams->len, bloom ? "bloom filter" : "bitmap",
+		   n_sample ? 100.0 * n_pass / n_sample : 0.0);
+	if (qgrams->lens & (1U << 1))
+		printf("WARN: 1-byte patterns let most packets through the q-gram "
+			   "filter\n");
+	free(bitmap);
+	return 0;
+}
+
+/* Upload the rows of the short pattern table that are not empty to the
+ * slot, and the bitmap of them, which hides the rows of an older ruleset
+ */
+static int short2map(const struct short_patterns *sp, __u32 slot,
+					 int short_map_fd, int short_bitmap_map_fd)
+{
+	const struct short_pattern_way *row;
+	struct ids_short_bitmap *bitmap;
+	struct ids_short_value short_value;
+	__u32 short_key, r;
+	long n_row = 0;
+	int i, err = 0;
+
+	bitmap = calloc(1, sizeof(*bitmap));
+	if (!bitmap) {
+		fprintf(stderr, "ERR: can't allocate the short pattern bitmap\n");
+		return -1;
+	}
+	for (r = 0; r < IDS_SHORT_ROWS; r++) {
+		row = sp->way + (size_t)r * SHORT_PATTERN_WAYS;
+		if (!row[0].len)
+			continue;
+		memset(&short_value, 0, sizeof(short_value));
+		for (i = 0; i < IDS_SHORT_WAYS && i < SHORT_PATTERN_WAYS; i++) {
+			short_value.way[i].prefix = row[i].prefix;
+			short_value.way[i].flag = row[i].flag;
+			short_value.way[i].len = row[i].len;
+		}
+		short_key = slot * IDS_SHORT_ROWS + r;
+		if (bpf_map_update_elem(short_map_fd, &short_key, &short_value,
+								0) < 0) {
+			fprintf(stderr,
+				"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+				ids_short_map_name, errno, strerror(errno));
+			err = -1;
+			goto out;
+		}
+		bitmap->row[r / 8] |= 1 << (r % 8);
+		n_row++;
+	}
+	if (bpf_map_update_elem(short_bitmap_map_fd, &slot, bitmap, 0) < 0) {
+		fprintf(stderr,
+			"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+			ids_short_bitmap_map_name, errno, strerror(errno));
+		err = -1;
+		goto out;
+	}
+	printf("Short patterns: %ld in %ld of %d rows\n", sp->n_short, n_row,
+		   IDS_SHORT_ROWS);
+
+out:
+	free(bitmap);
+	return err;
+}
+
+/* Upload the output link of every pattern, its action and the greatest
+ * one from it to the end of its list, and the payload offsets it may end
+ * at
+ */
+static int pattern2map(const struct str2dfa_dense *dfa, const __u8 *actions,
+					   int pattern_map_fd)
+{
+	__u32 *pattern_keys;
+	struct ids_pattern_value *pattern_values;
+	const struct str2dfa_limit *limit;
+	__u32 n_entry = 0;
+	long i, next;
+	int err;
+
+	pattern_keys = calloc(dfa->n_pattern + 1, sizeof(*pattern_keys));
+	pattern_values = calloc(dfa->n_pattern + 1, sizeof(*pattern_values));
+	if (!pattern_keys || !pattern_values) {
+		fprintf(stderr, "ERR: can't allocate the map entries\n");
+		free(pattern_keys);
+		free(pattern_values);
+		return -1;
+	}
+	for (i = 1; i <= dfa->n_pattern; i++) {
+		pattern_keys[n_entry] = i;
+		pattern_values[n_entry].next = dfa->pattern_next[i];
+		pattern_values[n_entry].action = actions[i];
+		pattern_values[n_entry].list_action = actions[i];
+		pattern_values[n_entry].end_max = 0xffff;
+		limit = dfa->pattern_limit ? &dfa->pattern_limit[i] : NULL;
+		if (limit && (limit->offset || limit->depth)) {
+			pattern_values[n_entry].end_min = limit->offset +
+				dfa->pattern_offset[i] - dfa->pattern_offset[i - 1] - 1;
+			if (limit->depth)
+				pattern_values[n_entry].end_max = limit->offset +
+					limit->depth - 1;
+		}
+		for (next = dfa->pattern_next[i]; next; next = dfa->pattern_next[next]) {
+			if (actions[next] > pattern_values[n_entry].list_action)
+				pattern_values[n_entry].list_action = actions[next];
+		}
+		n_entry++;
+	}
+	err = map_upload(pattern_map_fd, ids_pattern_map_name,
+					 pattern_keys, sizeof(*pattern_keys),
+					 pattern_values, sizeof(*pattern_values), n_entry);
+	free(pattern_keys);
+	free(pattern_values);
+	return err;
+}
+
+/* Convert the single-stride DFA to multi-stride DFA, and compute the
+ * number of ids_inspect_ms_map entries it needs, those of the states other
+ * than the root. Return the number of entries, or -1 on error.
+ */
+static int msdfa_convert(const struct str2dfa_dense *dfa, int stride,
+						 struct msdfa_kv **ms_entries, __u32 *ms_size) {
+	struct str2dfa_kv *map_entries;
+	int i_entry, n_entry, n_ms_entry;
+
+	n_entry = str2dfa_dense_tokv(dfa, &map_entries);
+	if (n_entry < 0)
+		return -1;
+	n_ms_entry = msdfa_fromkv(map_entries, n_entry, dfa->n_class, stride,
+							  ms_entries);
+	free(map_entries);
+	if (n_ms_entry < 0) {
+		fprintf(stderr, "ERR: can't convert the DFA to multi-stride DFA\n");
+		return -1;
+	}
+	*ms_size = 0;
+	for (i_entry = 0; i_entry < n_ms_entry; i_entry++)
+		*ms_size += (*ms_entries)[i_entry].key_state != 0;
+	printf("Total %u entries in %s\n", *ms_size, ids_inspect_ms_map_name);
+	return n_ms_entry;
+}
+
+static int msdfa2map(struct msdfa_kv *ms_entries, int n_ms_entry, int stride,
+					 int root_map_fd, int ms_map_fd) {
+	int i_entry, n_root = 0, n_other = 0, err = -1;
+	struct ids_inspect_root_map_key *root_map_keys;
+	struct ids_inspect_ms_map_key *ms_map_keys;
+	struct ids_inspect_map_value *root_map_values, *ms_map_values;
+
+	/* Zeroed, as the padding is part of the keys */
+	root_map_keys = calloc(n_ms_entry + 1, sizeof(*root_map_keys));
+	root_map_values = calloc(n_ms_entry + 1, sizeof(*root_map_values));
+	ms_map_keys = calloc(n_ms_entry + 1, sizeof(*ms_map_keys));
+	ms_map_values = calloc(n_ms_entry + 1, sizeof(*ms_map_values));
+	if (!root_map_keys || !root_map_values || !ms_map_keys || !ms_map_values) {
+		fprintf(stderr, "ERR: can't allocate the map entries\n");
+		goto out;
+	}
+
+	for (i_entry = 0; i_entry < n_ms_entry; i_entry++) {
+		if (ms_entries[i_entry].key_state == 0) {
+			/* Root row goes to the dense array */
+			memcpy(&root_map_keys[n_root].unit, ms_entries[i_entry].key_unit,
+				   stride);
+			root_map_values[n_root].state = ms_entries[i_entry].value_state;
+			root_map_values[n_root].flag = ms_entries[i_entry].value_flag;
+			root_map_values[n_root].stride_flag =
+				ms_entries[i_entry].value_first_flag;
+			n_root++;
+		} else {
+			ms_map_keys[n_other].state = ms_entries[i_entry].key_state;
+			memcpy(&ms_map_keys[n_other].unit, ms_entries[i_entry].key_unit,
+				   stride);
+			ms_map_values[n_other].state = ms_entries[i_entry].value_state;
+			ms_map_values[n_other].flag = ms_entries[i_entry].value_flag;
+			ms_map_values[n_other].stride_flag =
+				ms_entries[i_entry].value_first_flag;
+			n_other++;
+		}
+	}
+	if (map_upload(root_map_fd, ids_inspect_root_map_name,
+				   root_map_keys, sizeof(*root_map_keys),
+				   root_map_values, sizeof(*root_map_values), n_root) < 0 ||
+		map_upload(ms_map_fd, ids_inspect_ms_map_name,
+				   ms_map_keys, sizeof(*ms_map_keys),
+				   ms_map_values, sizeof(*ms_map_values), n_other) < 0)
+		goto out;
+	err = 0;
+
+out:
+	free(root_map_keys);
+	free(root_map_values);
+	free(ms_map_keys);
+	free(ms_map_values);
+	return err;
+}
+
+/* Get a table for the standby slot of slots_fd, a new map like the pinned
+ * template. With reuse, the template itself is used as long as the active
+ * slot does not hold it, so the first ruleset needs no extra copy.
+ */
+static int slot_map_create(int slots_fd, __u32 active_slot, int template_fd,
+						   const struct bpf_map_info *info, bool reuse)
+{
+	struct bpf_create_map_attr attr = { 0 };
+	__u32 map_id;
+	int fd;
+
+	if (reuse && (bpf_map_lookup_elem(slots_fd, &active_slot, &map_id) < 0 ||
+				  map_id != info->id))
+		return dup(template_fd);
+
+	attr.name = info->name;
+	attr.map_type = info->type;
+	attr.key_size = info->key_size;
+	attr.value_size = info->value_size;
+	attr.max_entries = info->max_entries;
+	attr.map_flags = info->map_flags;
+	fd = bpf_create_map_xattr(&attr);
+	if (fd < 0)
+		fprintf(stderr, "ERR: can't create a table like %s: %s\n",
+				info->name, strerror(errno));
+	return fd;
+}
+
+/* Put the table into a slot. The outer map holds its own reference, so
+ * the table lives until the slot is replaced.
+ */
+static int slot_map_install(int slots_fd, const char *slots_name, __u32 slot,
+							int map_fd)
+{
+	if (bpf_map_update_elem(slots_fd, &slot, &map_fd, 0) < 0) {
+		fprintf(stderr,
+			"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+			slots_name, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Remove every entry of the map, key being room for one of its keys.
+ * Return how many there were.
+ */
+static long map_clear(int map_fd, void *key)
+{
+	long n_entry = 0;
+
+	while (bpf_map_get_next_key(map_fd, NULL, key) == 0 &&
+		   bpf_map_delete_elem(map_fd, key) == 0)
+		n_entry++;
+	return n_entry;
+}
+
+/* Forget the verdicts of the flows, they came from the patterns replaced
+ * at the flip
+ */
+static void verdict_map_clear(int verdict_map_fd)
+{
+	struct ids_flow_key key;
+	long n_flow;
+
+	n_flow = map_clear(verdict_map_fd, &key);
+	if (n_flow)
+		printf("Forgot the verdicts of %ld flows\n", n_flow);
+}
+
+/* Remove the prefixes of the slot from a trust map. The keys are
+ * collected first, deleting while walking the trie restarts the walk.
+ * The v6 key has room for the keys of both maps, whose slot is at the
+ * same place.
+ */
+static int trust_map_clear(int map_fd, __u32 slot)
+{
+	struct ids_trust_v6_key key, next_key, *stale = NULL, *p;
+	__u32 i, n_stale = 0, max_stale = 0;
+	void *prev = NULL;
+
+	while (bpf_map_get_next_key(map_fd, prev, &next_key) == 0) {
+		key = next_key;
+		prev = &key;
+		if (key.slot != slot)
+			continue;
+		if (n_stale == max_stale) {
+			max_stale = max_stale ? max_stale * 2 : 256;
+			p = realloc(stale, sizeof(*stale) * max_stale);
+			if (!p) {
+				free(stale);
+				return -1;
+			}
+			stale = p;
 		}
+		stale[n_stale++] = key;
 	}
-	printf("\nTotal entries are inserted: %d\n\n", n_entry);
+	for (i = 0; i < n_stale; i++)
+		bpf_map_delete_elem(map_fd, &stale[i]);
+	free(stale);
 	return 0;
 }
 
+/* Replace the trusted prefixes of the slot with those of trust_file, if
+ * any, and set *trust to the directions they are in. The slot is the
+ * standby one, so packets never see a half-written set. Return their
+ * number, or -1 on error.
+ */
+static int trust2map(const char *pin_dir, const char *trust_file,
+					 __u32 slot, __u32 *trust)
+{
+	static const __u8 dirs[2][2] = {
+		{ TRUST_SRC, IDS_TRUST_SRC },
+		{ TRUST_DST, IDS_TRUST_DST },
+	};
+	struct trust_prefix *prefixes = NULL, *p;
+	struct ids_trust_v4_key v4_key;
+	struct ids_trust_v6_key v6_key;
+	int v4_map_fd, v6_map_fd, n_prefix = 0, i, j, err;
+	__u32 value = 1;
+
+	*trust = 0;
+	v4_map_fd = open_bpf_map_file(pin_dir, ids_trust_v4_map_name, NULL);
+	v6_map_fd = open_bpf_map_file(pin_dir, ids_trust_v6_map_name, NULL);
+	if (v4_map_fd < 0 || v6_map_fd < 0) {
+		return -1;
+	}
+	if (trust_map_clear(v4_map_fd, slot) < 0 ||
+		trust_map_clear(v6_map_fd, slot) < 0) {
+		fprintf(stderr, "ERR: can't clear the trusted prefixes\n");
+		return -1;
+	}
+	if (trust_file[0]) {
+		n_prefix = trust_prefixes_fromfile(trust_file, &prefixes);
+		if (n_prefix < 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < n_prefix; i++) {
+		p = &prefixes[i];
+		for (j = 0; j < 2; j++) {
+			if (!(p->dir & dirs[j][0]))
+				continue;
+			if (p->family == AF_INET) {
+				memset(&v4_key, 0, sizeof(v4_key));
+				v4_key.prefixlen = IDS_TRUST_PREFIX_BASE + p->len;
+				v4_key.slot = slot;
+				v4_key.dir = dirs[j][1];
+				memcpy(v4_key.addr, p->addr, sizeof(v4_key.addr));
+				err = bpf_map_update_elem(v4_map_fd, &v4_key, &value, 0);
+			} else {
+				memset(&v6_key, 0, sizeof(v6_key));
+				v6_key.prefixlen = IDS_TRUST_PREFIX_BASE + p->len;
+				v6_key.slot = slot;
+				v6_key.dir = dirs[j][1];
+				memcpy(v6_key.addr, p->addr, sizeof(v6_key.addr));
+				err = bpf_map_update_elem(v6_map_fd, &v6_key, &value, 0);
+			}
+			if (err < 0) {
+				fprintf(stderr,
+					"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+					p->family == AF_INET ? ids_trust_v4_map_name :
+					ids_trust_v6_map_name, errno, strerror(errno));
+				free(prefixes);
+				return -1;
+			}
+			*trust |= dirs[j][1];
+		}
+	}
+	free(prefixes);
+	return n_prefix;
+}
+
+/* Entries read or deleted per batch */
+#define BLOCKLIST_CHUNK 1024
+
+/* Read the entries of ids_block_map with BPF_MAP_LOOKUP_BATCH, or, on
+ * kernels without batch operations, by walking the keys first and looking
+ * them up after, since an entry removed at the walk position would
+ * restart it. Return the number of entries, or -1 on error.
+ */
+static long blocklist_read(int fd, struct ids_block_key **result_keys,
+						   struct ids_block_value **result_values)
+{
+	struct ids_block_key *keys = NULL, *key = NULL;
+	struct ids_block_value *values = NULL;
+	long n_key = 0, max_key = 0, i, n_found;
+	__u32 batch, count;
+	bool batched = true;
+	void *in_batch = NULL, *p;
+
+	for (;;) {
+		if (n_key + BLOCKLIST_CHUNK > max_key) {
+			max_key += BLOCKLIST_CHUNK;
+			p = realloc(keys, sizeof(*keys) * max_key);
+			if (!p)
+				goto nomem;
+			keys = p;
+			p = realloc(values, sizeof(*values) * max_key);
+			if (!p)
+				goto nomem;
+			values = p;
+		}
+		if (batched) {
+			count = BLOCKLIST_CHUNK;
+			if (!bpf_map_lookup_batch_compat(fd, in_batch, &batch,
+											 &keys[n_key], &values[n_key],
+											 &count, 0)) {
+				n_key += count;
+				in_batch = &batch;
+				continue;
+			}
+			n_key += count;
+			/* ENOENT once the last entries are read */
+			if (errno == ENOENT)
+				break;
+			if (!in_batch && bpf_map_batch_unsupported()) {
+				batched = false;
+				continue;
+			}
+			fprintf(stderr, "ERR: can't read %s: %s\n", ids_block_map_name,
+					strerror(errno));
+			goto err;
+		}
+		if (bpf_map_get_next_key(fd, key, &keys[n_key]) < 0)
+			break;
+		key = &keys[n_key++];
+	}
+
+	if (!batched) {
+		/* Entries evicted since the walk are left out */
+		for (i = 0, n_found = 0; i < n_key; i++) {
+			if (bpf_map_lookup_elem(fd, &keys[i], &values[n_found]) < 0)
+				continue;
+			keys[n_found++] = keys[i];
+		}
+		n_key = n_found;
+	}
+	*result_keys = keys;
+	*result_values = values;
+	return n_key;
+
+nomem:
+	fprintf(stderr, "ERR: can't allocate the blocklist\n");
+err:
+	free(keys);
+	free(values);
+	return -1;
+}
+
+/* Delete the given entries of ids_block_map with BPF_MAP_DELETE_BATCH,
+ * or one by one on kernels without batch operations. Entries already
+ * removed by xdp_ids are skipped. Return the number deleted.
+ */
+static long blocklist_delete(int fd, struct ids_block_key *keys, long n_key)
+{
+	long i = 0, n_deleted = 0;
+	bool batched = true;
+	__u32 count;
+
+	while (i < n_key) {
+		if (batched) {
+			count = n_key - i < BLOCKLIST_CHUNK ? n_key - i : BLOCKLIST_CHUNK;
+			if (!bpf_map_delete_batch_compat(fd, &keys[i], &count, 0)) {
+				n_deleted += count;
+				i += count;
+				continue;
+			}
+			n_deleted += count;
+			i += count;
+			if (errno == ENOENT) {
+				/* Stopped at a key removed since it was read */
+				i++;
+				continue;
+			}
+			if (!n_deleted && bpf_map_batch_unsupported()) {
+				batched = false;
+				continue;
+			}
+			fprintf(stderr, "ERR: can't delete from %s: %s\n",
+					ids_block_map_name, strerror(errno));
+			break;
+		}
+		n_deleted += bpf_map_delete_elem(fd, &keys[i++]) == 0;
+	}
+	return n_deleted;
+}
+
+/* List the sources of ids_block_map with the seconds they stay blocked
+ * and the packets dropped since, and remove the expired ones.
+ */
+static int blocklist_age(const char *pin_dir)
+{
+	struct ids_block_key *keys, *expired;
+	struct ids_block_value *values;
+	struct timespec now;
+	char addr[INET6_ADDRSTRLEN];
+	long n_key, n_expired = 0, n_deleted, i;
+	__u64 now_ns;
+	int fd;
+
+	fd = open_bpf_map_file(pin_dir, ids_block_map_name, NULL);
+	if (fd < 0)
+		return EXIT_FAIL_BPF;
+	n_key = blocklist_read(fd, &keys, &values);
+	if (n_key < 0)
+		return EXIT_FAIL;
+	expired = malloc(sizeof(*expired) * (n_key + 1));
+	if (!expired) {
+		fprintf(stderr, "ERR: can't allocate the blocklist\n");
+		free(keys);
+		free(values);
+		return EXIT_FAIL;
+	}
+
+	/* The kernel stamps the entries with bpf_ktime_get_ns() */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_ns = (__u64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	for (i = 0; i < n_key; i++) {
+		if (values[i].expire_ns <= now_ns) {
+			expired[n_expired++] = keys[i];
+			continue;
+		}
+		if (!keys[i].saddr[1] && !keys[i].saddr[2] && !keys[i].saddr[3])
+			inet_ntop(AF_INET, keys[i].saddr, addr, sizeof(addr));
+		else
+			inet_ntop(AF_INET6, keys[i].saddr, addr, sizeof(addr));
+		printf("%-40s %6llus left %12llu packets dropped\n", addr,
+			   (unsigned long long)(values[i].expire_ns - now_ns) /
+			   1000000000ULL,
+			   (unsigned long long)values[i].packets);
+	}
+	n_deleted = blocklist_delete(fd, expired, n_expired);
+	printf("%ld sources blocked, %ld expired ones removed\n",
+		   n_key - n_expired, n_deleted);
+	free(expired);
+	free(keys);
+	free(values);
+	return EXIT_OK;
+}
+
+/* The bpf_loop engine is used only if the kernel has the helper and
+ * xdp_loader has put xdp_dpi_loop into its tail_call_map slot.
+ */
+static bool dpi_prog_loaded(int tail_call_map_fd, __u32 dpi_prog)
+{
+	__u32 prog_id;
+
+	return bpf_map_lookup_elem(tail_call_map_fd, &dpi_prog, &prog_id) == 0;
+}
+
+static bool dpi_loop_supported(int tail_call_map_fd)
+{
+	return bpf_probe_helper(BPF_FUNC_loop, BPF_PROG_TYPE_XDP, 0) &&
+		   dpi_prog_loaded(tail_call_map_fd, IDS_DPI_PROG_LOOP);
+}
+
+/* Synthetic Ethernet/IPv4/TCP packet with a full-size benign payload */
+#define BENCH_PAYLOAD_LEN 1460
+
+struct bench_pkt {
+	struct ethhdr eth;
+	struct iphdr iph;
+	struct tcphdr tcph;
+	__u8 payload[BENCH_PAYLOAD_LEN];
+} __attribute__((packed));
+
+/* Distance between two copies of a pattern in the payload with hits */
+#define BENCH_HIT_GAP 256
+
+/* With a DFA, the first pattern is copied into the payload every
+ * BENCH_HIT_GAP bytes
+ */
+static void bench_pkt_init(struct bench_pkt *pkt,
+						   const struct str2dfa_dense *dfa)
+{
+	__u32 len;
+	int i;
+
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->eth.h_proto = htons(ETH_P_IP);
+	pkt->iph.version = 4;
+	pkt->iph.ihl = sizeof(pkt->iph) / 4;
+	pkt->iph.ttl = 64;
+	pkt->iph.protocol = IPPROTO_TCP;
+	pkt->iph.tot_len = htons(sizeof(*pkt) - sizeof(pkt->eth));
+	pkt->iph.saddr = htonl(0x0a000001);
+	pkt->iph.daddr = htonl(0x0a000002);
+	pkt->tcph.source = htons(40000);
+	pkt->tcph.dest = htons(80);
+	pkt->tcph.doff = sizeof(pkt->tcph) / 4;
+	pkt->tcph.ack = 1;
+	for (i = 0; i < BENCH_PAYLOAD_LEN; i++) {
+		pkt->payload[i] = 'a' + i % 26;
+	}
+	if (!dfa || dfa->n_pattern < 1)
+		return;
+	len = dfa->pattern_offset[1] - dfa->pattern_offset[0];
+	if (len > BENCH_HIT_GAP)
+		len = BENCH_HIT_GAP;
+	for (i = 0; i + len <= BENCH_PAYLOAD_LEN; i += BENCH_HIT_GAP) {
+		memcpy(pkt->payload + i, dfa->pattern_data + dfa->pattern_offset[0],
+			   len);
+	}
+}
+
+/* Run the program over the packet with the given config in the slot,
+ * which the metadata in front of the packet selects, and return the
+ * average ns/packet the kernel measured, or -1 on error
+ */
+static long bench_run(int prog_fd, int repeat, int config_map_fd,
+					  __u32 slot, const struct ids_config *config,
+					  struct bench_pkt *pkt)
+{
+	struct {
+		struct ids_bench_meta meta;
+		struct bench_pkt pkt;
+	} __attribute__((packed)) data;
+	struct xdp_md ctx = {
+		.data = sizeof(data.meta),
+		.data_end = sizeof(data),
+	};
+	struct bpf_prog_test_run_attr attr = {
+		.prog_fd = prog_fd,
+		.repeat = repeat,
+		.data_in = &data,
+		.data_size_in = sizeof(data),
+		.ctx_in = &ctx,
+		.ctx_size_in = sizeof(ctx),
+	};
+
+	if (bpf_map_update_elem(config_map_fd, &slot, config, 0) < 0)
+		return -1;
+	data.meta.slot = slot;
+	memcpy(&data.pkt, pkt, sizeof(data.pkt));
+	if (bpf_prog_test_run_xattr(&attr)) {
+		fprintf(stderr, "ERR: bpf_prog_test_run failed: %s\n%s",
+				strerror(errno), errno == EINVAL ?
+				"Hint: the metadata of test runs needs Linux 5.14\n" : "");
+		return -1;
+	}
+	return attr.duration;
+}
+
+/* Filters in front of the DPI programs --bench compares */
+static const struct {
+	__u32 dpi_prog;
+	const char *name;
+} bench_filters[] = {
+	{ IDS_DPI_PROG_PREFILTER, "prefilter" },
+	{ IDS_DPI_PROG_QGRAM, "q-gram" },
+};
+
+#define BENCH_FILTERS (sizeof(bench_filters) / sizeof(bench_filters[0]))
+
+/* Run the xdp_ids program attached to the device once per DPI program with
+ * BPF_PROG_TEST_RUN, and report the average time the kernel measured: on
+ * a benign packet, and on a packet with hits in first-match and match-all
+ * mode. The benign packet is run again through each loaded filter alone,
+ * and the payload bytes/ns are compared. The runs use the config of the
+ * standby slot, before the flip, and leave the active one alone.
+ */
+static int bench_dpi_progs(struct config *cfg, int config_map_fd,
+						   int tail_call_map_fd, __u32 slot,
+						   struct ids_config *ids_config,
+						   const struct str2dfa_dense *dfa,
+						   const struct qgram_set *qgrams)
+{
+	/* Every run inspects the packet, none is judged by the cache or
+	 * blocked
+	 */
+	struct ids_config bench_config = *ids_config;
+	static const char *dpi_prog_names[IDS_DPI_PROG_MAX] = {
+		[IDS_DPI_PROG_STRIDE1] = "stride-1 chain",
+		[IDS_DPI_PROG_STRIDE2] = "stride-2 chain",
+		[IDS_DPI_PROG_LOOP] = "bpf_loop",
+		[IDS_DPI_PROG_FRAGS] = "frags chain",
+	};
+	struct bench_pkt pkt, hit_pkt;
+	long benign, first_match, match_all, filtered[BENCH_FILTERS];
+	bool filter_loaded[BENCH_FILTERS];
+	int prog_fd, err = EXIT_OK;
+	__u32 dpi_prog, prog_id, i;
+
+	if (bpf_get_link_xdp_id(cfg->ifindex, &prog_id, cfg->xdp_flags) ||
+		!prog_id) {
+		fprintf(stderr, "ERR: no XDP program on %s\n", cfg->ifname);
+		return EXIT_FAIL_XDP;
+	}
+	prog_fd = bpf_prog_get_fd_by_id(prog_id);
+	if (prog_fd < 0) {
+		fprintf(stderr, "ERR: bpf_prog_get_fd_by_id failed: %s\n",
+				strerror(errno));
+		return EXIT_FAIL_BPF;
+	}
+
+	bench_config.verdict_cache = 0;
+	bench_config.stream_depth = 0;
+	bench_config.block_ttl = 0;
+	bench_config.trust = 0;
+	bench_pkt_init(&pkt, NULL);
+	bench_pkt_init(&hit_pkt, dfa);
+	printf("\nBenchmark: %d runs of a %zu-byte packet, ns/packet\n",
+		   cfg->bench_repeat, sizeof(pkt));
+	printf("  %-16s %8s %12s %10s", "", "benign", "first-match",
+		   "match-all");
+	for (i = 0; i < BENCH_FILTERS; i++) {
+		filter_loaded[i] = dpi_prog_loaded(tail_call_map_fd,
+										   bench_filters[i].dpi_prog);
+		if (filter_loaded[i])
+			printf(" %10s", bench_filters[i].name);
+	}
+	printf("   benign bytes/ns\n");
+	for (dpi_prog = 0; dpi_prog < IDS_DPI_PROG_MAX; dpi_prog++) {
+		if (dpi_prog == IDS_DPI_PROG_PREFILTER ||
+			dpi_prog == IDS_DPI_PROG_QGRAM)
+			continue;
+		/* Stride tables are only uploaded with --stride */
+		if (dpi_prog == IDS_DPI_PROG_STRIDE2 && cfg->inspect_stride == 1)
+			continue;
+		/* Only the stride-1 and frags chains match the short patterns */
+		if (ids_config->short_patterns && dpi_prog != IDS_DPI_PROG_STRIDE1 &&
+			dpi_prog != IDS_DPI_PROG_FRAGS)
+			continue;
+		if (!dpi_prog_loaded(tail_call_map_fd, dpi_prog))
+			continue;
+		bench_config.dpi_prog = dpi_prog;
+		bench_config.match_all = 0;
+		bench_config.prefilter = 0;
+		bench_config.qgram_lens = 0;
+		benign = bench_run(prog_fd, cfg->bench_repeat, config_map_fd,
+						   slot, &bench_config, &pkt);
+		first_match = bench_run(prog_fd, cfg->bench_repeat, config_map_fd,
+								slot, &bench_config, &hit_pkt);
+		bench_config.match_all = 1;
+		match_all = bench_run(prog_fd, cfg->bench_repeat, config_map_fd,
+							  slot, &bench_config, &hit_pkt);
+		if (benign < 0 || first_match < 0 || match_all < 0) {
+			err = EXIT_FAIL_BPF;
+			break;
+		}
+		bench_config.match_all = 0;
+		for (i = 0; i < BENCH_FILTERS; i++) {
+			filtered[i] = 0;
+			if (!filter_loaded[i])
+				continue;
+			bench_config.prefilter =
+				bench_filters[i].dpi_prog == IDS_DPI_PROG_PREFILTER;
+			if (bench_filters[i].dpi_prog == IDS_DPI_PROG_QGRAM)
+				qgram_config(qgrams, &bench_config);
+			else
+				bench_config.qgram_lens = 0;
+			filtered[i] = bench_run(prog_fd, cfg->bench_repeat,
+									config_map_fd, slot, &bench_config,
+									&pkt);
+			if (filtered[i] < 0)
+				err = EXIT_FAIL_BPF;
+		}
+		if (err)
+			break;
+		printf("  %-16s %8ld %12ld %10ld", dpi_prog_names[dpi_prog],
+			   benign, first_match, match_all);
+		for (i = 0; i < BENCH_FILTERS; i++) {
+			if (filter_loaded[i])
+				printf(" %10ld", filtered[i]);
+		}
+		printf("   %.2f", benign ? (double)BENCH_PAYLOAD_LEN / benign : 0);
+		for (i = 0; i < BENCH_FILTERS; i++) {
+			if (filter_loaded[i])
+				printf(" / %.2f", filtered[i] ?
+					   (double)BENCH_PAYLOAD_LEN / filtered[i] : 0);
+		}
+		printf("\n");
+	}
+
+	/* Restore the config the slot is flipped to */
+	if (bpf_map_update_elem(config_map_fd, &slot, ids_config, 0) < 0)
+		err = EXIT_FAIL_BPF;
+	close(prog_fd);
+	return err;
+}
+
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+/* Everything besides the pattern file that changes the compiled ruleset */
+#define RULESET_OPTIONS "trans=8,alphabet=256,short=%d,rules=%d"
+
+/* Get the DFA of the patterns, from the ruleset file given by --ruleset,
+ * or else from the cache next to the pattern file, which is keyed by the
+ * hash of the patterns and refreshed when it is stale. With --compile the
+ * patterns are always compiled and the ruleset is written out. The port
+ * groups and the short patterns come with the DFA, in *groups and
+ * *short_member.
+ */
+static struct str2dfa_dense *ruleset_load(const struct config *cfg,
+										  const char *pattern_file,
+										  struct ruleset *rs,
+										  struct str2dfa_dense *dfa,
+										  struct port_groups *compiled_groups,
+										  const struct port_groups **groups,
+										  const unsigned char **short_member)
+{
+	char cache_dir[PATH_MAX], path[PATH_MAX], dir_buf[PATH_MAX];
+	char options[64];
+	unsigned char *compiled_short;
+	uint64_t hash;
+	int len;
+
+	if (cfg->ruleset_file[0] && !cfg->compile_ruleset) {
+		if (ruleset_map(cfg->ruleset_file, rs) < 0) {
+			fprintf(stderr, "ERR: can't load ruleset %s: %s\n",
+					cfg->ruleset_file, strerror(errno));
+			return NULL;
+		}
+		printf("Ruleset %s loaded, %ld patterns\n", cfg->ruleset_file,
+			   rs->dfa.n_pattern);
+		*groups = &rs->groups;
+		*short_member = rs->short_member;
+		return &rs->dfa;
+	}
+
+	snprintf(options, sizeof(options), RULESET_OPTIONS, cfg->short_len,
+			 rules_file(pattern_file));
+	if (ruleset_hash(pattern_file,
+					 cfg->port_group_file[0] ? cfg->port_group_file : NULL,
+					 options, &hash) < 0) {
+		fprintf(stderr, "ERR: can't read pattern file %s: %s\n",
+				pattern_file, strerror(errno));
+		return NULL;
+	}
+	if (cfg->ruleset_file[0]) {
+		len = snprintf(path, PATH_MAX, "%s", cfg->ruleset_file);
+	} else {
+		snprintf(dir_buf, PATH_MAX, "%s", pattern_file);
+		snprintf(cache_dir, PATH_MAX, "%s/.cache", dirname(dir_buf));
+		len = snprintf(path, PATH_MAX, "%s/%016llx.rules", cache_dir,
+					   (unsigned long long)hash);
+	}
+	if (len < 0 || len >= PATH_MAX) {
+		fprintf(stderr, "ERR: creating ruleset filename\n");
+		return NULL;
+	}
+
+	if (!cfg->compile_ruleset && ruleset_map(path, rs) == 0) {
+		if (rs->hash == hash) {
+			printf("Ruleset cache %s hit, %ld patterns\n", path,
+				   rs->dfa.n_pattern);
+			*groups = &rs->groups;
+			*short_member = rs->short_member;
+			return &rs->dfa;
+		}
+		ruleset_unmap(rs);
+	}
+
+	if (str2dfa_compile(pattern_file, cfg->port_group_file, cfg->short_len,
+						dfa, compiled_groups, &compiled_short) < 0)
+		return NULL;
+	*groups = compiled_groups;
+	*short_member = compiled_short;
+	if (!cfg->ruleset_file[0] && mkdir(cache_dir, 0755) < 0 &&
+		errno != EEXIST) {
+		fprintf(stderr, "WARN: can't create ruleset cache %s: %s\n",
+				cache_dir, strerror(errno));
+	} else if (ruleset_write(path, dfa, compiled_groups, compiled_short,
+							 hash) < 0) {
+		fprintf(stderr, "%s: can't write ruleset %s: %s\n",
+				cfg->compile_ruleset ? "ERR" : "WARN", path, strerror(errno));
+		if (cfg->compile_ruleset) {
+			str2dfa_dense_free(dfa);
+			port_groups_free(compiled_groups);
+			free(compiled_short);
+			return NULL;
+		}
+	} else if (verbose || cfg->compile_ruleset) {
+		printf("Ruleset written to %s\n", path);
+	}
+	return dfa;
+}
+
 const char *pin_basedir = "/sys/fs/bpf";
 
 int main(int argc, char **argv)
 {
 	int len;
-	int ids_map_fd;
+	int ids_map_fd, root_map_fd, ms_map_fd, config_map_fd, tail_call_map_fd;
+	int slots_fd, root_slots_fd, ms_slots_fd, active_map_fd, table_fd;
+	int pattern_map_fd, pattern_slots_fd, redirect_map_fd;
+	__u8 *actions;
+	__u32 active_slot, standby_slot;
 	char pin_dir[PATH_MAX];
+	struct str2dfa_dense compiled_dfa, *dfa;
+	struct port_groups compiled_groups;
+	const struct port_groups *groups;
+	int port_group_map_fd, prefilter_map_fd;
+	int qgram_map_fd, qgram_slots_fd;
+	int short_map_fd, short_bitmap_map_fd, verdict_map_fd, n_trust, err;
+	const unsigned char *short_member;
+	struct short_patterns sp;
+	struct bpf_map_info qgram_map_info = { 0 };
+	struct qgram_set qgrams;
+	struct ruleset rs;
+	const char *pattern_file;
+	struct msdfa_kv *ms_entries = NULL;
+	struct bpf_map_info ids_map_info = { 0 };
+	struct bpf_map_info root_map_info = { 0 }, ms_map_info = { 0 };
+	struct bpf_map_info pattern_map_info = { 0 };
+	__u32 table_size, ms_table_size = 0;
+	int n_ms_entry = 0;
+	struct ids_config active_config;
+	struct ids_config ids_config = {
+		.dpi_prog = IDS_DPI_PROG_STRIDE1,
+	};
+	__u32 config_key = 0;
 
 	struct config cfg = {
 		.ifindex = -1,
 		.redirect_ifindex = -1,
+		.inspect_stride = 1,
 	};
 
 	/* Cmdline options can change progsec */
@@ -313,6 +1802,86 @@ int main(int argc, char **argv)
 		usage(argv[0], __doc__, long_options, (argc == 1));
 		return EXIT_FAIL_OPTION;
 	}
+	if (cfg.inspect_stride != 1 && cfg.inspect_stride != IDS_INSPECT_STRIDE) {
+		fprintf(stderr, "ERR: --stride must be 1 or %d\n\n",
+				IDS_INSPECT_STRIDE);
+		return EXIT_FAIL_OPTION;
+	}
+	ids_config.match_all = cfg.match_all;
+	if (cfg.list_blocked) {
+		if (cfg.ifindex == -1) {
+			fprintf(stderr, "ERR: required option --dev missing\n\n");
+			return EXIT_FAIL_OPTION;
+		}
+		len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, cfg.ifname);
+		if (len < 0) {
+			fprintf(stderr, "ERR: creating pin dirname\n");
+			return EXIT_FAIL_OPTION;
+		}
+		return blocklist_age(pin_dir);
+	}
+	if (cfg.block_ttl < 0) {
+		fprintf(stderr, "ERR: --block-ttl must not be negative\n\n");
+		return EXIT_FAIL_OPTION;
+	}
+	if (cfg.stream_depth < 0) {
+		fprintf(stderr, "ERR: --stream-depth must not be negative\n\n");
+		return EXIT_FAIL_OPTION;
+	}
+	if (cfg.short_len && (cfg.short_len < 2 ||
+						  cfg.short_len > SHORT_PATTERN_LEN_MAX + 1)) {
+		fprintf(stderr, "ERR: --short-len must be from 2 to %d\n\n",
+				SHORT_PATTERN_LEN_MAX + 1);
+		return EXIT_FAIL_OPTION;
+	}
+
+	/* Get the DFA first, the map size depends on it */
+	pattern_file = cfg.pattern_file[0] ? cfg.pattern_file : pattern_file_name;
+	dfa = ruleset_load(&cfg, pattern_file, &rs, &compiled_dfa,
+					   &compiled_groups, &groups, &short_member);
+	if (!dfa) {
+		fprintf(stderr, "ERR: can't convert the string to DFA/Map\n");
+		return EXIT_FAIL_RE2DFA;
+	}
+	/* The multi-stride tables are built from the DFA alone */
+	if (short_member && cfg.inspect_stride != 1) {
+		fprintf(stderr, "ERR: the short patterns need --stride 1\n\n");
+		return EXIT_FAIL_OPTION;
+	}
+	ids_config.short_patterns = !!short_member;
+	str2dfa_config(dfa, &ids_config, &table_size);
+	ids_config.port_groups = groups->n_entry;
+	/* The scan stops past the depth of the patterns of the port group */
+	ids_config.pattern_windows = !!dfa->pattern_limit;
+	ids_config.n_pattern = dfa->n_pattern;
+	ids_config.scan_depth = groups->n_entry ? groups->any_depth :
+		port_group_depth(dfa, NULL);
+	if (ids_config.scan_depth)
+		printf("Inspect the first %u payload bytes outside the port "
+			   "groups\n", ids_config.scan_depth);
+	if (pattern_actions_fromfile(cfg.action_file, dfa->n_pattern,
+								 &actions) < 0) {
+		return EXIT_FAIL_OPTION;
+	}
+	if (cfg.compile_ruleset) {
+		return EXIT_OK;
+	}
+	/* The multi-stride tables, whose ids_inspect_ms_map is sized from
+	 * them like ids_inspect_map
+	 */
+	if (cfg.inspect_stride > 1) {
+		n_ms_entry = msdfa_convert(dfa, cfg.inspect_stride, &ms_entries,
+								   &ms_table_size);
+		if (n_ms_entry < 0) {
+			return EXIT_FAIL_RE2DFA;
+		}
+	}
+	if (cfg.print_table_size) {
+		if (cfg.inspect_stride > 1)
+			printf("%s:%u\n", ids_inspect_ms_map_name, ms_table_size);
+		printf("%s:%u\n", ids_inspect_map_name, table_size);
+		return EXIT_OK;
+	}
 
 	len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, cfg.ifname);
 	if (len < 0) {
@@ -323,16 +1892,281 @@ int main(int argc, char **argv)
 	printf("map dir: %s\n", pin_dir);
 
 	/* Open the maps corresponding to the cfg.ifname interface */
-	ids_map_fd = open_bpf_map_file(pin_dir, ids_inspect_map_name, NULL);
-	if (ids_map_fd < 0) {
+	ids_map_fd = open_bpf_map_file(pin_dir, ids_inspect_map_name,
+								   &ids_map_info);
+	slots_fd = open_bpf_map_file(pin_dir, ids_inspect_slots_name, NULL);
+	root_slots_fd = open_bpf_map_file(pin_dir, ids_inspect_root_slots_name,
+									  NULL);
+	ms_slots_fd = open_bpf_map_file(pin_dir, ids_inspect_ms_slots_name, NULL);
+	active_map_fd = open_bpf_map_file(pin_dir, ids_active_map_name, NULL);
+	pattern_map_fd = open_bpf_map_file(pin_dir, ids_pattern_map_name,
+									   &pattern_map_info);
+	pattern_slots_fd = open_bpf_map_file(pin_dir, ids_pattern_slots_name,
+										 NULL);
+	if (ids_map_fd < 0 || slots_fd < 0 || root_slots_fd < 0 ||
+		ms_slots_fd < 0 || active_map_fd < 0 || pattern_map_fd < 0 ||
+		pattern_slots_fd < 0) {
+		return EXIT_FAIL_BPF;
+	}
+	if (ids_map_info.max_entries < table_size) {
+		fprintf(stderr, "ERR: %s has %u entries, the patterns need %u\n"
+				"Hint: load with xdp_loader --map-size %s:%u\n",
+				ids_inspect_map_name, ids_map_info.max_entries, table_size,
+				ids_inspect_map_name, table_size);
+		return EXIT_FAIL_BPF;
+	}
+	config_map_fd = open_bpf_map_file(pin_dir, ids_config_map_name, NULL);
+	if (config_map_fd < 0) {
+		return EXIT_FAIL_BPF;
+	}
+	tail_call_map_fd = open_bpf_map_file(pin_dir, tail_call_map_name, NULL);
+	if (tail_call_map_fd < 0) {
 		return EXIT_FAIL_BPF;
 	}
 
-	/* Convert the string to DFA and map */
-	if (str2dfa2map_fromfile(pattern_file_name, ids_map_fd) < 0) {
-		fprintf(stderr, "ERR: can't convert the string to DFA/Map\n");
+	/* Where IDS_ACTION_REDIRECT sends the packets */
+	if (cfg.redirect_ifindex > 0) {
+		redirect_map_fd = open_bpf_map_file(pin_dir, ids_redirect_map_name,
+											NULL);
+		if (redirect_map_fd < 0) {
+			return EXIT_FAIL_BPF;
+		}
+		if (bpf_map_update_elem(redirect_map_fd, &config_key,
+								&cfg.redirect_ifindex, 0) < 0) {
+			fprintf(stderr,
+				"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+				ids_redirect_map_name, errno, strerror(errno));
+			return EXIT_FAIL_BPF;
+		}
+	}
+
+	/* The new DFA goes to the standby slot, packets keep being inspected
+	 * with the active one until the flip below
+	 */
+	if (bpf_map_lookup_elem(active_map_fd, &config_key, &active_slot) < 0) {
+		fprintf(stderr, "ERR: can't read %s: %s\n", ids_active_map_name,
+				strerror(errno));
+		return EXIT_FAIL_BPF;
+	}
+	standby_slot = (active_slot + 1) % IDS_INSPECT_SLOTS;
+	/* The slots take turns, a flow state saved two rulesets ago must not
+	 * be resumed in the new DFA
+	 */
+	if (bpf_map_lookup_elem(config_map_fd, &active_slot, &active_config) < 0) {
+		fprintf(stderr, "ERR: can't read %s: %s\n", ids_config_map_name,
+				strerror(errno));
+		return EXIT_FAIL_BPF;
+	}
+	ids_config.generation = active_config.generation + 1;
+
+	/* Upload the DFA to a table of the standby slot */
+	table_fd = slot_map_create(slots_fd, active_slot, ids_map_fd,
+							   &ids_map_info, true);
+	if (table_fd < 0 || str2dfa2map(dfa, table_fd, &ids_map_info) < 0) {
+		fprintf(stderr, "ERR: can't upload the DFA to map\n");
+		return EXIT_FAIL_BPF;
+	}
+	pattern_map_fd = slot_map_create(pattern_slots_fd, active_slot,
+									 pattern_map_fd, &pattern_map_info, false);
+	if (pattern_map_fd < 0 || pattern2map(dfa, actions, pattern_map_fd) < 0) {
+		fprintf(stderr, "ERR: can't upload the output links to map\n");
+		return EXIT_FAIL_BPF;
+	}
+
+	/* The single-stride DFA is still used for the tail of the payload */
+	if (cfg.inspect_stride > 1) {
+		/* The multi-stride tables are sparse, start from empty ones */
+		root_map_fd = open_bpf_map_file(pin_dir, ids_inspect_root_map_name,
+										&root_map_info);
+		ms_map_fd = open_bpf_map_file(pin_dir, ids_inspect_ms_map_name,
+									  &ms_map_info);
+		if (root_map_fd < 0 || ms_map_fd < 0) {
+			return EXIT_FAIL_BPF;
+		}
+		if (ms_map_info.max_entries < ms_table_size) {
+			fprintf(stderr, "ERR: %s has %u entries, the patterns need %u\n"
+					"Hint: load with xdp_loader --map-size %s:%u\n",
+					ids_inspect_ms_map_name, ms_map_info.max_entries,
+					ms_table_size, ids_inspect_ms_map_name, ms_table_size);
+			return EXIT_FAIL_BPF;
+		}
+		root_map_fd = slot_map_create(root_slots_fd, active_slot, root_map_fd,
+									  &root_map_info, false);
+		ms_map_fd = slot_map_create(ms_slots_fd, active_slot, ms_map_fd,
+									&ms_map_info, false);
+		if (root_map_fd < 0 || ms_map_fd < 0) {
+			return EXIT_FAIL_BPF;
+		}
+		if (msdfa2map(ms_entries, n_ms_entry, cfg.inspect_stride,
+					  root_map_fd, ms_map_fd) < 0) {
+			fprintf(stderr, "ERR: can't convert the DFA to multi-stride map\n");
+			return EXIT_FAIL_RE2DFA;
+		}
+		free(ms_entries);
+		ids_config.dpi_prog = IDS_DPI_PROG_STRIDE2;
+	} else if (!ids_config.short_patterns &&
+			   dpi_loop_supported(tail_call_map_fd)) {
+		/* Scan the whole payload in one invocation */
+		ids_config.dpi_prog = IDS_DPI_PROG_LOOP;
+	}
+
+	/* The short patterns of the standby slot, only the stride-1 chain
+	 * matches them
+	 */
+	if (short_member) {
+		short_map_fd = open_bpf_map_file(pin_dir, ids_short_map_name, NULL);
+		short_bitmap_map_fd = open_bpf_map_file(pin_dir,
+												ids_short_bitmap_map_name,
+												NULL);
+		if (short_map_fd < 0 || short_bitmap_map_fd < 0) {
+			return EXIT_FAIL_BPF;
+		}
+		if (short_patterns_build(dfa, short_member, &sp) < 0) {
+			return EXIT_FAIL_RE2DFA;
+		}
+		if (short2map(&sp, standby_slot, short_map_fd,
+					  short_bitmap_map_fd) < 0) {
+			return EXIT_FAIL_BPF;
+		}
+		short_patterns_free(&sp);
+	}
+
+	/* The port groups of the standby slot go first, its config tells
+	 * xdp_ids to look them up
+	 */
+	port_group_map_fd = open_bpf_map_file(pin_dir, ids_port_group_map_name,
+										  NULL);
+	if (port_group_map_fd < 0 ||
+		port_groups2map(groups, standby_slot, port_group_map_fd) < 0) {
+		return EXIT_FAIL_BPF;
+	}
+
+	/* The prefilter is always filled, --prefilter turns it on and --bench
+	 * compares with it
+	 */
+	prefilter_map_fd = open_bpf_map_file(pin_dir, ids_prefilter_map_name,
+										 NULL);
+	if (prefilter_map_fd < 0 ||
+		prefilter2map(dfa, standby_slot, prefilter_map_fd) < 0) {
+		return EXIT_FAIL_BPF;
+	}
+	if (cfg.prefilter &&
+		!dpi_prog_loaded(tail_call_map_fd, IDS_DPI_PROG_PREFILTER)) {
+		fprintf(stderr, "WARN: xdp_prefilter is not loaded, "
+				"add -s %d:xdp_prefilter to xdp_loader\n",
+				IDS_DPI_PROG_PREFILTER);
+	}
+	ids_config.prefilter = cfg.prefilter;
+#ifdef HAVE_XDP_FRAGS
+	if (!dpi_prog_loaded(tail_call_map_fd, IDS_DPI_PROG_FRAGS)) {
+		fprintf(stderr, "WARN: xdp_dpi_frags is not loaded, the fragments "
+				"of multi-buffer packets are not inspected, "
+				"add -s %d:xdp_dpi_frags to xdp_loader\n",
+				IDS_DPI_PROG_FRAGS);
+	}
+#endif
+
+	/* The q-gram table of the standby slot, likewise always filled */
+	if (qgram_set_build(dfa, QGRAM_LEN_MAX, &qgrams) < 0) {
 		return EXIT_FAIL_RE2DFA;
 	}
+	qgram_map_fd = open_bpf_map_file(pin_dir, ids_qgram_map_name,
+									 &qgram_map_info);
+	qgram_slots_fd = open_bpf_map_file(pin_dir, ids_qgram_slots_name, NULL);
+	if (qgram_map_fd < 0 || qgram_slots_fd < 0) {
+		return EXIT_FAIL_BPF;
+	}
+	qgram_map_fd = slot_map_create(qgram_slots_fd, active_slot, qgram_map_fd,
+								   &qgram_map_info, false);
+	if (qgram_map_fd < 0 ||
+		(qgrams.len && qgram2map(&qgrams, qgram_map_fd, &qgram_map_info) < 0)) {
+		return EXIT_FAIL_BPF;
+	}
+	if (cfg.qgram &&
+		!dpi_prog_loaded(tail_call_map_fd, IDS_DPI_PROG_QGRAM)) {
+		fprintf(stderr, "WARN: xdp_qgram is not loaded, "
+				"add -s %d:xdp_qgram to xdp_loader\n", IDS_DPI_PROG_QGRAM);
+	}
+	if (cfg.qgram) {
+		qgram_config(&qgrams, &ids_config);
+	}
+
+	/* The verdicts of the flows, forgotten at the flip below */
+	ids_config.verdict_cache = cfg.verdict_cache || cfg.stream_depth;
+	ids_config.stream_depth = cfg.stream_depth;
+	ids_config.block_ttl = cfg.block_ttl;
+	verdict_map_fd = open_bpf_map_file(pin_dir, ids_verdict_map_name, NULL);
+	if (verdict_map_fd < 0) {
+		return EXIT_FAIL_BPF;
+	}
+
+	n_trust = trust2map(pin_dir, cfg.trust_file, standby_slot,
+						&ids_config.trust);
+	if (n_trust < 0) {
+		return EXIT_FAIL_BPF;
+	}
+
+	/* Fill the standby slot */
+	if (bpf_map_update_elem(config_map_fd, &standby_slot, &ids_config, 0) < 0) {
+		fprintf(stderr,
+			"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+			ids_config_map_name, errno, strerror(errno));
+		return EXIT_FAIL_BPF;
+	}
+	if (slot_map_install(slots_fd, ids_inspect_slots_name, standby_slot,
+						 table_fd) < 0 ||
+		slot_map_install(pattern_slots_fd, ids_pattern_slots_name,
+						 standby_slot, pattern_map_fd) < 0 ||
+		slot_map_install(qgram_slots_fd, ids_qgram_slots_name,
+						 standby_slot, qgram_map_fd) < 0) {
+		return EXIT_FAIL_BPF;
+	}
+	if (cfg.inspect_stride > 1) {
+		if (slot_map_install(root_slots_fd, ids_inspect_root_slots_name,
+							 standby_slot, root_map_fd) < 0 ||
+			slot_map_install(ms_slots_fd, ids_inspect_ms_slots_name,
+							 standby_slot, ms_map_fd) < 0) {
+			return EXIT_FAIL_BPF;
+		}
+	} else {
+		/* Free the multi-stride tables of an older ruleset */
+		bpf_map_delete_elem(root_slots_fd, &standby_slot);
+		bpf_map_delete_elem(ms_slots_fd, &standby_slot);
+	}
+
+	/* Benchmark the DPI programs on the new DFA before the traffic gets it */
+	if (cfg.bench_repeat > 0) {
+		err = bench_dpi_progs(&cfg, config_map_fd, tail_call_map_fd,
+							  standby_slot, &ids_config, dfa, &qgrams);
+		if (err != EXIT_OK) {
+			return err;
+		}
+	}
+
+	/* Flip, the next packet is inspected with the new DFA */
+	if (bpf_map_update_elem(active_map_fd, &config_key, &standby_slot, 0) < 0) {
+		fprintf(stderr,
+			"ERR: Failed to update bpf map file (%s): err(%d):%s\n",
+			ids_active_map_name, errno, strerror(errno));
+		return EXIT_FAIL_BPF;
+	}
+	verdict_map_clear(verdict_map_fd);
+	if (cfg.stream_depth)
+		printf("Pass the flows without inspection after %d payload "
+			   "bytes\n", cfg.stream_depth);
+	if (cfg.block_ttl)
+		printf("Block the source of a dropped packet for %d seconds\n",
+			   cfg.block_ttl);
+	if (n_trust)
+		printf("Pass the packets of %d trusted prefixes without "
+			   "inspection\n", n_trust);
+	printf("Inspect %d byte(s) per DFA lookup%s%s%s%s%s, slot %u is active\n",
+		   cfg.inspect_stride,
+		   ids_config.dpi_prog == IDS_DPI_PROG_LOOP ? " with bpf_loop" : "",
+		   ids_config.short_patterns ? " and the short patterns apart" : "",
+		   cfg.match_all ? " for all patterns" : "",
+		   ids_config.qgram_lens ? " after the q-gram filter" : "",
+		   cfg.prefilter ? " after the prefilter" : "", standby_slot);
 
 	return EXIT_OK;
 }